@@ -0,0 +1,516 @@
+#include "async.h"
+
+#include "pmm.h"
+#include "serial.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "thread.h"
+#include "vma.h"
+
+#include <stddef.h>
+
+extern uint64_t hhdm_offset;
+
+// Empty passes over every ring before the poller goes to sleep
+#define ASYNC_POLL_IDLE_ROUNDS 64
+
+#define ASYNC_ALIGN(x) (((x) + 63) & ~63ULL)
+
+// A receive that found its port empty, retried until a message arrives
+typedef struct
+{
+  uint32_t port;
+  uint64_t user_data;
+} async_pending_t;
+
+typedef struct async_ctx
+{
+  // Reached through the HHDM, so the poller can use them from any address space
+  async_rings_t *rings;
+  async_sqe_t *sq;
+  async_cqe_t *cq;
+  uint32_t sq_entries;
+  uint32_t cq_entries;
+
+  void *frames;
+  uint32_t order;
+  uint64_t user_addr;
+
+  async_pending_t *pending; // Each one holds a completion slot
+  uint32_t pending_count;
+
+  int poll;
+  uint32_t refs; // Protected by async_lock, the poller holds one while it works
+} async_ctx_t;
+
+// Contexts the poller serves
+static spinlock_t async_lock = SPINLOCK_INIT;
+static async_ctx_t *polled[ASYNC_POLL_MAX];
+static uint32_t polled_count = 0;
+static Port *poller_doorbell = NULL;
+
+static void async_free(async_ctx_t *ctx)
+{
+  if (ctx->frames)
+  {
+    pmm_free_pages(ctx->frames, ctx->order);
+  }
+  kfree(ctx->pending);
+  kfree(ctx);
+}
+
+static void async_put(async_ctx_t *ctx)
+{
+  uint64_t flags = spin_lock_irqsave(&async_lock);
+  uint32_t refs = --ctx->refs;
+  spin_unlock_irqrestore(&async_lock, flags);
+
+  if (refs == 0)
+  {
+    async_free(ctx);
+  }
+}
+
+// Completion slots not spoken for yet, every taken submission owns one
+static uint32_t cq_room(async_ctx_t *ctx)
+{
+  uint32_t used = ctx->rings->cq_tail - __atomic_load_n(&ctx->rings->cq_head, __ATOMIC_ACQUIRE);
+  if (used > ctx->cq_entries)
+  {
+    return 0; // Userspace scribbled over cq_head
+  }
+
+  uint32_t free = ctx->cq_entries - used;
+  return free > ctx->pending_count ? free - ctx->pending_count : 0;
+}
+
+static void complete(async_ctx_t *ctx, uint64_t user_data, int result, const ipc_message_t *msg)
+{
+  uint32_t tail = ctx->rings->cq_tail;
+  async_cqe_t *cqe = &ctx->cq[tail & (ctx->cq_entries - 1)];
+  cqe->user_data = user_data;
+  cqe->result = result;
+  cqe->msg = msg ? *msg : (ipc_message_t) { 0 };
+  __atomic_store_n(&ctx->rings->cq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void execute(async_ctx_t *ctx, const async_sqe_t *sqe)
+{
+  Port *port = port_from_id(sqe->port);
+  ipc_message_t msg;
+
+  switch (sqe->opcode)
+  {
+    case ASYNC_OP_NOP:
+    {
+      complete(ctx, sqe->user_data, 0, NULL);
+      break;
+    }
+
+    case ASYNC_OP_SEND:
+    {
+      complete(ctx, sqe->user_data, port ? send_try(port, &sqe->msg) : -1, NULL);
+      break;
+    }
+
+    case ASYNC_OP_RECV:
+    {
+      int result = port ? recv_try(port, &msg) : -1;
+      if (result == -3)
+      {
+        ctx->pending[ctx->pending_count].port = sqe->port;
+        ctx->pending[ctx->pending_count].user_data = sqe->user_data;
+        ctx->pending_count++;
+        break;
+      }
+
+      complete(ctx, sqe->user_data, result, result == 0 ? &msg : NULL);
+      break;
+    }
+
+    default:
+    {
+      complete(ctx, sqe->user_data, -1, NULL); // Unknown opcode
+      break;
+    }
+  }
+
+  port_put(port);
+}
+
+// Take every submission there's completion room for, returns how many
+static uint32_t submit(async_ctx_t *ctx)
+{
+  async_rings_t *rings = ctx->rings;
+  uint32_t head = rings->sq_head;
+  uint32_t taken = 0;
+
+  while (head != __atomic_load_n(&rings->sq_tail, __ATOMIC_ACQUIRE) && cq_room(ctx) > 0)
+  {
+    // Copied first, userspace may reuse the slot as soon as sq_head moves
+    async_sqe_t sqe = ctx->sq[head & (ctx->sq_entries - 1)];
+    __atomic_store_n(&rings->sq_head, ++head, __ATOMIC_RELEASE);
+    execute(ctx, &sqe);
+    taken++;
+  }
+
+  return taken;
+}
+
+// Retry the pending receives in order, returns how many completed
+static uint32_t retry_pending(async_ctx_t *ctx)
+{
+  uint32_t kept = 0;
+  uint32_t done = 0;
+
+  for (uint32_t i = 0; i < ctx->pending_count; i++)
+  {
+    async_pending_t pending = ctx->pending[i];
+    Port *port = port_from_id(pending.port);
+    ipc_message_t msg;
+
+    // The port may have been destroyed meanwhile
+    int result = port ? recv_try(port, &msg) : -1;
+    port_put(port);
+    if (result == -3)
+    {
+      ctx->pending[kept++] = pending;
+      continue;
+    }
+
+    complete(ctx, pending.user_data, result, result == 0 ? &msg : NULL);
+    done++;
+  }
+
+  ctx->pending_count = kept;
+  return done;
+}
+
+static void ports_put(Port **ports, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    port_put(ports[i]);
+  }
+}
+
+// Append the ports ctx's pending receives wait on to ports, which has room
+// for max, with a reference each. Returns the new count, or -1 with nothing
+// added if they don't fit or one of the ports is gone (the next retry
+// completes that receive).
+static int pending_ports(async_ctx_t *ctx, Port **ports, int count, int max)
+{
+  int first = count;
+  for (uint32_t i = 0; i < ctx->pending_count; i++)
+  {
+    Port *port = count == max ? NULL : port_from_id(ctx->pending[i].port);
+    if (!port)
+    {
+      ports_put(ports + first, count - first);
+      return -1;
+    }
+    ports[count++] = port;
+  }
+  return count;
+}
+
+// Nothing happened for a while. Ask for the doorbell, then sleep until it
+// rings or a port a pending receive waits on gets a message.
+static void poller_sleep(async_ctx_t **ctxs, uint32_t count)
+{
+  Port *ports[RECV_ANY_MAX_PORTS];
+  int nports = 1;
+  ports[0] = poller_doorbell;
+
+  for (uint32_t i = 0; i < count && nports >= 0; i++)
+  {
+    int added = pending_ports(ctxs[i], ports, nports, RECV_ANY_MAX_PORTS);
+    if (added < 0)
+    {
+      ports_put(ports + 1, nports - 1);
+    }
+    nports = added;
+  }
+
+  // Too many to wait on, keep polling
+  if (nports < 0)
+  {
+    thread_yield();
+    return;
+  }
+
+  // Pairs with the fence userspace puts between sq_tail and reading flags,
+  // either it sees the flag or we see its submission
+  for (uint32_t i = 0; i < count; i++)
+  {
+    __atomic_store_n(&ctxs[i]->rings->flags, ASYNC_NEED_WAKEUP, __ATOMIC_RELAXED);
+  }
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  int submitted = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    submitted |= __atomic_load_n(&ctxs[i]->rings->sq_tail, __ATOMIC_ACQUIRE) != ctxs[i]->rings->sq_head;
+  }
+
+  if (!submitted)
+  {
+    port_poll_any(ports, nports);
+  }
+  ports_put(ports + 1, nports - 1);
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    __atomic_store_n(&ctxs[i]->rings->flags, 0, __ATOMIC_RELAXED);
+  }
+
+  ipc_message_t ring;
+  while (recv_try(poller_doorbell, &ring) == 0)
+  {
+  }
+}
+
+// Kernel thread taking submissions for every ASYNC_SETUP_POLL process
+static void async_poller(void)
+{
+  uint32_t idle = 0;
+
+  for (;;)
+  {
+    async_ctx_t *ctxs[ASYNC_POLL_MAX];
+    uint64_t flags = spin_lock_irqsave(&async_lock);
+    uint32_t count = polled_count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      ctxs[i] = polled[i];
+      ctxs[i]->refs++;
+    }
+    spin_unlock_irqrestore(&async_lock, flags);
+
+    uint32_t work = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      work += submit(ctxs[i]) + retry_pending(ctxs[i]);
+    }
+
+    if (work)
+    {
+      idle = 0;
+    } else if (++idle >= ASYNC_POLL_IDLE_ROUNDS)
+    {
+      poller_sleep(ctxs, count);
+      idle = 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      async_put(ctxs[i]);
+    }
+    thread_yield();
+  }
+}
+
+// Hand ctx to the poller, starting it the first time. Returns 0 on success.
+static int poller_add(async_ctx_t *ctx)
+{
+  uint64_t flags = spin_lock_irqsave(&async_lock);
+  int start = !poller_doorbell;
+  if (start)
+  {
+    spin_unlock_irqrestore(&async_lock, flags);
+    Port *doorbell = port_create();
+    if (!doorbell)
+    {
+      return -1;
+    }
+
+    flags = spin_lock_irqsave(&async_lock);
+    if (poller_doorbell)
+    {
+      // Somebody else got there first
+      spin_unlock_irqrestore(&async_lock, flags);
+      port_destroy(doorbell);
+      return poller_add(ctx);
+    }
+    poller_doorbell = port_get(doorbell);
+  }
+
+  if (polled_count == ASYNC_POLL_MAX)
+  {
+    spin_unlock_irqrestore(&async_lock, flags);
+    return -1;
+  }
+
+  ctx->refs++;
+  polled[polled_count++] = ctx;
+  spin_unlock_irqrestore(&async_lock, flags);
+
+  if (start)
+  {
+    thread_create(async_poller);
+    serial_print("Async: Started kernel poller\n");
+  } else
+  {
+    send(poller_doorbell, 0, 0, 0, 0, 0);
+  }
+  return 0;
+}
+
+int64_t async_setup(uint32_t entries, uint32_t flags)
+{
+  Thread *self = thread_current();
+  address_space_t *as = self ? self->address_space : NULL;
+  if (!as || as->async || entries == 0 || entries > ASYNC_MAX_ENTRIES || (flags & ~ASYNC_SETUP_POLL))
+  {
+    return -1;
+  }
+
+  uint32_t sq_entries = 1;
+  while (sq_entries < entries)
+  {
+    sq_entries <<= 1;
+  }
+  uint32_t cq_entries = sq_entries * 2;
+
+  uint64_t sq_offset = ASYNC_ALIGN(sizeof(async_rings_t));
+  uint64_t cq_offset = ASYNC_ALIGN(sq_offset + sq_entries * sizeof(async_sqe_t));
+  uint64_t size = cq_offset + cq_entries * sizeof(async_cqe_t);
+  uint32_t order = 0;
+  while (((uint64_t) PAGE_SIZE << order) < size)
+  {
+    order++;
+  }
+  size = (uint64_t) PAGE_SIZE << order;
+
+  async_ctx_t *ctx = kmalloc(sizeof(async_ctx_t));
+  if (!ctx)
+  {
+    return -1;
+  }
+
+  ctx->frames = pmm_alloc_pages(order);
+  ctx->order = order;
+  ctx->pending = kmalloc(cq_entries * sizeof(async_pending_t));
+  ctx->pending_count = 0;
+  ctx->refs = 1;
+  ctx->poll = (flags & ASYNC_SETUP_POLL) != 0;
+
+  uint64_t addr = vma_find_free(as, size, PAGE_SIZE);
+  if (!ctx->frames || !ctx->pending || !addr || !vma_create(as, addr, size, VM_REGION_ANON, VM_READ | VM_WRITE, NULL, 0))
+  {
+    async_free(ctx);
+    return -1;
+  }
+
+  // The kernel keeps the frames, the process only borrows the mapping
+  if (vmm_map_range(as, addr, (uint64_t) ctx->frames, size,
+          PAGE_PRESENT | PAGE_WRITE | PAGE_USER | PAGE_NO_EXECUTE | PAGE_UNOWNED)
+      != 0)
+  {
+    vma_unmap(as, addr, size);
+    async_free(ctx);
+    return -1;
+  }
+
+  uint8_t *base = (uint8_t *) ((uint64_t) ctx->frames + hhdm_offset);
+  for (uint64_t i = 0; i < size; i++)
+  {
+    base[i] = 0;
+  }
+
+  ctx->rings = (async_rings_t *) base;
+  ctx->sq = (async_sqe_t *) (base + sq_offset);
+  ctx->cq = (async_cqe_t *) (base + cq_offset);
+  ctx->sq_entries = sq_entries;
+  ctx->cq_entries = cq_entries;
+  ctx->user_addr = addr;
+  ctx->rings->sq_mask = sq_entries - 1;
+  ctx->rings->cq_mask = cq_entries - 1;
+  ctx->rings->sq_offset = sq_offset;
+  ctx->rings->cq_offset = cq_offset;
+
+  as->async = ctx;
+  if (ctx->poll && poller_add(ctx) != 0)
+  {
+    as->async = NULL;
+    vma_unmap(as, addr, size);
+    async_free(ctx);
+    return -1;
+  }
+
+  return (int64_t) addr;
+}
+
+int async_enter(uint32_t min_complete)
+{
+  Thread *self = thread_current();
+  async_ctx_t *ctx = self && self->address_space ? self->address_space->async : NULL;
+  if (!ctx)
+  {
+    return -1; // No rings set up
+  }
+
+  if (ctx->poll)
+  {
+    if (__atomic_load_n(&ctx->rings->flags, __ATOMIC_ACQUIRE) & ASYNC_NEED_WAKEUP)
+    {
+      send(poller_doorbell, 0, 0, 0, 0, 0);
+    }
+    return 0;
+  }
+
+  int taken = submit(ctx);
+  retry_pending(ctx);
+
+  while (ctx->rings->cq_tail - __atomic_load_n(&ctx->rings->cq_head, __ATOMIC_ACQUIRE) < min_complete
+      && ctx->pending_count)
+  {
+    // Past what we can sleep on we just give the senders a chance to run
+    Port *ports[RECV_ANY_MAX_PORTS];
+    int count = pending_ports(ctx, ports, 0, RECV_ANY_MAX_PORTS);
+    if (count > 0)
+    {
+      port_poll_any(ports, count);
+      ports_put(ports, count);
+    } else
+    {
+      thread_yield();
+    }
+    retry_pending(ctx);
+  }
+
+  return taken;
+}
+
+void async_clone(address_space_t *child, address_space_t *parent)
+{
+  async_ctx_t *ctx = parent->async;
+  if (ctx)
+  {
+    vma_unmap(child, ctx->user_addr, (uint64_t) PAGE_SIZE << ctx->order);
+  }
+}
+
+void async_destroy(address_space_t *as)
+{
+  async_ctx_t *ctx = as->async;
+  if (!ctx)
+  {
+    return;
+  }
+  as->async = NULL;
+
+  uint64_t flags = spin_lock_irqsave(&async_lock);
+  for (uint32_t i = 0; i < polled_count; i++)
+  {
+    if (polled[i] == ctx)
+    {
+      polled[i] = polled[--polled_count];
+      ctx->refs--;
+      break;
+    }
+  }
+  spin_unlock_irqrestore(&async_lock, flags);
+
+  async_put(ctx);
+}
@@ -2,12 +2,14 @@
 #include "ata.h"
 #include "pmm.h"
 #include "serial.h"
+#include "slab.h"
 
 #include <stddef.h>
 
 static ext2_superblock_t sb;
 static ext2_group_desc_t *group_desc = NULL;
 static uint32_t block_size;
+static kmem_cache_t *block_cache = NULL;
 static int ext2_ready = 0;
 
 static int ext2_strlen(const char *str)
@@ -76,7 +78,7 @@ static int ext2_read_inode(uint32_t inode_num, ext2_inode_t *inode)
 
   uint32_t block = inode_table + (offset / block_size);
   uint32_t block_offset = offset % block_size;
-  void *block_buffer = pmm_alloc_page();
+  void *block_buffer = kmem_cache_alloc(block_cache);
   if (!block_buffer)
   {
     serial_print("ext2: Failed to allocate buffer\n");
@@ -86,7 +88,7 @@ static int ext2_read_inode(uint32_t inode_num, ext2_inode_t *inode)
   if (ext2_read_block(block, block_buffer) != 0)
   {
     serial_print("ext2: Failed to read inode block\n");
-    pmm_free_page(block_buffer);
+    kmem_cache_free(block_cache, block_buffer);
     return -1;
   }
 
@@ -97,7 +99,7 @@ static int ext2_read_inode(uint32_t inode_num, ext2_inode_t *inode)
     dst[i] = src[i];
   }
 
-  pmm_free_page(block_buffer);
+  kmem_cache_free(block_cache, block_buffer);
   return 0;
 }
 
@@ -121,7 +123,7 @@ static int ext2_read_inode_data(ext2_inode_t *inode, void *buffer, uint32_t max_
       break;
     }
 
-    void *block_buffer = pmm_alloc_page();
+    void *block_buffer = kmem_cache_alloc(block_cache);
     if (!block_buffer)
     {
       return -1;
@@ -129,7 +131,7 @@ static int ext2_read_inode_data(ext2_inode_t *inode, void *buffer, uint32_t max_
 
     if (ext2_read_block(inode->i_block[i], block_buffer) != 0)
     {
-      pmm_free_page(block_buffer);
+      kmem_cache_free(block_cache, block_buffer);
       return -1;
     }
 
@@ -141,7 +143,7 @@ static int ext2_read_inode_data(ext2_inode_t *inode, void *buffer, uint32_t max_
     }
 
     remaining -= to_copy;
-    pmm_free_page(block_buffer);
+    kmem_cache_free(block_cache, block_buffer);
   }
 
   return size - remaining;
@@ -187,8 +189,17 @@ int ext2_init()
 
   uint32_t num_groups = (sb.s_blocks_count + sb.s_blocks_per_group - 1) / sb.s_blocks_per_group;
 
+  // Sized to the filesystem block so a 1 KB block no longer costs a whole page
+  block_cache = kmem_cache_create("ext2_block", block_size, 64, NULL);
+  if (!block_cache)
+  {
+    serial_print("ext2: Failed to create block buffer cache\n");
+    return -1;
+  }
+  kmem_cache_set_owner(block_cache, PMM_OWNER_EXT2);
+
   uint32_t bgdt_block = (block_size == 1024) ? 2 : 1;
-  group_desc = pmm_alloc_page();
+  group_desc = kmem_cache_alloc(block_cache);
   if (!group_desc)
   {
     serial_print("ext2: Failed to allocate memory for group descriptors\n");
@@ -198,7 +209,7 @@ int ext2_init()
   if (ext2_read_block(bgdt_block, group_desc) != 0)
   {
     serial_print("ext2: Failed to read block group descriptor table\n");
-    pmm_free_page(group_desc);
+    kmem_cache_free(block_cache, group_desc);
     group_desc = NULL;
     return -1;
   }
@@ -225,12 +236,13 @@ void ext2_list_root(void)
     return;
   }
 
-  void *dir_data = pmm_alloc_page();
+  void *dir_data = pmm_alloc_page_nozero();
   if (!dir_data)
   {
     serial_print("ext2: Failed to allocate buffer\n");
     return;
   }
+  pmm_set_owner(dir_data, PMM_OWNER_EXT2);
 
   int bytes_read = ext2_read_inode_data(&root_inode, dir_data, 4096);
   if (bytes_read < 0)
@@ -279,7 +291,8 @@ void ext2_list_root(void)
 }
 
 
-int ext2_read_file(const char *path, void *buffer, uint32_t max_size)
+// Find a regular file in the root directory
+static int ext2_lookup(const char *path, ext2_inode_t *file_inode)
 {
   if (!ext2_ready)
   {
@@ -308,11 +321,12 @@ int ext2_read_file(const char *path, void *buffer, uint32_t max_size)
     return -1;
   }
 
-  void *dir_data = pmm_alloc_page();
+  void *dir_data = pmm_alloc_page_nozero();
   if (!dir_data)
   {
     return -1;
   }
+  pmm_set_owner(dir_data, PMM_OWNER_EXT2);
 
   int bytes_read = ext2_read_inode_data(&root_inode, dir_data, 4096);
   if (bytes_read < 0)
@@ -349,17 +363,38 @@ int ext2_read_file(const char *path, void *buffer, uint32_t max_size)
     return -1;
   }
 
-  ext2_inode_t file_inode;
-  if (ext2_read_inode(target_inode, &file_inode) != 0)
+  if (ext2_read_inode(target_inode, file_inode) != 0)
   {
     return -1;
   }
 
-  if ((file_inode.i_mode & 0xF000) != EXT2_S_IFREG)
+  if ((file_inode->i_mode & 0xF000) != EXT2_S_IFREG)
   {
     serial_print("ext2: Not a regular file\n");
     return -1;
   }
 
+  return 0;
+}
+
+int ext2_read_file(const char *path, void *buffer, uint32_t max_size)
+{
+  ext2_inode_t file_inode;
+  if (ext2_lookup(path, &file_inode) != 0)
+  {
+    return -1;
+  }
+
   return ext2_read_inode_data(&file_inode, buffer, max_size);
 }
+
+int64_t ext2_file_size(const char *path)
+{
+  ext2_inode_t file_inode;
+  if (ext2_lookup(path, &file_inode) != 0)
+  {
+    return -1;
+  }
+
+  return file_inode.i_size;
+}
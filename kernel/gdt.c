@@ -1,12 +1,14 @@
 #include "gdt.h"
+#include "cpu.h"
 #include "serial.h"
 
 #include <stddef.h>
 
-#define GDT_ENTRIES 7
+#define GDT_ENTRIES (GDT_TSS + 2 * MAX_CPUS)
 static gdt_entry_t gdt[GDT_ENTRIES];
 static gdt_ptr_t gdt_pointer;
-static tss_t tss;
+static tss_t tss[MAX_CPUS];
+static uint8_t double_fault_stacks[MAX_CPUS][4096] __attribute__((aligned(16)));
 
 static void gdt_set_entry(int index, uint32_t base, uint32_t limit, uint8_t access, uint32_t granularity)
 {
@@ -55,27 +57,32 @@ void gdt_init()
   gdt_set_entry(GDT_KERNEL_DATA, 0, 0xFFFFF, GDT_ACCESS_PRESENT | GDT_ACCESS_RING0 | GDT_ACCESS_SEGMENT | GDT_ACCESS_RW,
       GDT_GRANULARITY_4K);
 
+  gdt_set_entry(GDT_USER_DATA, 0, 0xFFFFF, GDT_ACCESS_PRESENT | GDT_ACCESS_RING3 | GDT_ACCESS_SEGMENT | GDT_ACCESS_RW,
+      GDT_GRANULARITY_4K);
+
   gdt_set_entry(GDT_USER_CODE, 0, 0xFFFFF,
       GDT_ACCESS_PRESENT | GDT_ACCESS_RING3 | GDT_ACCESS_SEGMENT | GDT_ACCESS_EXECUTABLE | GDT_ACCESS_RW,
       GDT_GRANULARITY_4K | GDT_GRANULARITY_64BIT);
 
-  gdt_set_entry(GDT_USER_DATA, 0, 0xFFFFF, GDT_ACCESS_PRESENT | GDT_ACCESS_RING3 | GDT_ACCESS_SEGMENT | GDT_ACCESS_RW,
-      GDT_GRANULARITY_4K);
-
-  for (int i = 0; i < sizeof(tss_t); i++)
+  // Every CPU gets its own TSS (rsp0 follows whatever it runs) and its own
+  // double fault stack
+  for (int cpu = 0; cpu < MAX_CPUS; cpu++)
   {
-    ((uint8_t *) &tss)[i] = 0;
+    for (int i = 0; i < sizeof(tss_t); i++)
+    {
+      ((uint8_t *) &tss[cpu])[i] = 0;
+    }
+
+    tss[cpu].rsp0 = 0;
+    tss[cpu].ist1 = (uint64_t) (double_fault_stacks[cpu] + sizeof(double_fault_stacks[cpu]));
+    tss[cpu].iomap_base = sizeof(tss_t);
+    gdt_set_tss(GDT_TSS + 2 * cpu, (uint64_t) &tss[cpu], sizeof(tss_t) - 1);
   }
 
-  tss.rsp0 = 0;
-  tss.iomap_base = sizeof(tss_t);
-  gdt_set_tss(GDT_TSS, (uint64_t) &tss, sizeof(tss_t) - 1);
-
   gdt_pointer.limit = sizeof(gdt) - 1;
   gdt_pointer.base = (uint64_t) &gdt;
 
-  gdt_load(&gdt_pointer);
-  tss_load(TSS_SEG);
+  gdt_init_cpu(0);
 
   serial_print("\nGDT Debug:\n");
   for (int i = 0; i < 5; i++)
@@ -91,4 +98,14 @@ void gdt_init()
   serial_print("\n");
 }
 
-void gdt_set_kernel_stack(uint64_t stack) { tss.rsp0 = stack; }
+void gdt_init_cpu(uint32_t cpu)
+{
+  gdt_load(&gdt_pointer);
+  tss_load(TSS_SEG(cpu));
+}
+
+void gdt_set_kernel_stack(uint64_t stack)
+{
+  tss[cpu_current_id()].rsp0 = stack;
+  cpu_current()->syscall_rsp = stack;
+}
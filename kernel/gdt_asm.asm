@@ -10,9 +10,9 @@ gdt_load:
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov ss, ax
+    ; FS and GS are left alone, loading a selector would clobber the GS base
+    ; that points at this CPU's cpu_t
 
     pop rdi
     mov rax, 0x08
@@ -1,7 +1,11 @@
 #include "idt.h"
 
+#include "gdt.h"
+#include "lapic.h"
 #include "pit.h"
 #include "serial.h"
+#include "thread.h"
+#include "vma.h"
 
 #include <stddef.h>
 
@@ -75,6 +79,7 @@ void idt_init()
   idt_set_gate(29, (uint64_t) isr_stub_29, 0x08, IDT_TYPE_INTERRUPT_GATE);
   idt_set_gate(30, (uint64_t) isr_stub_30, 0x08, IDT_TYPE_INTERRUPT_GATE);
   idt_set_gate(31, (uint64_t) isr_stub_31, 0x08, IDT_TYPE_INTERRUPT_GATE);
+  idt[EXCEPTION_DOUBLE_FAULT].ist = IST_DOUBLE_FAULT;
 
   idt_set_gate(32, (uint64_t) isr_stub_32, 0x08, IDT_TYPE_INTERRUPT_GATE);
   idt_set_gate(33, (uint64_t) isr_stub_33, 0x08, IDT_TYPE_INTERRUPT_GATE);
@@ -93,14 +98,56 @@ void idt_init()
   idt_set_gate(46, (uint64_t) isr_stub_46, 0x08, IDT_TYPE_INTERRUPT_GATE);
   idt_set_gate(47, (uint64_t) isr_stub_47, 0x08, IDT_TYPE_INTERRUPT_GATE);
 
+  idt_set_gate(IRQ_LAPIC_TIMER, (uint64_t) isr_stub_48, 0x08, IDT_TYPE_INTERRUPT_GATE);
+  idt_set_gate(IRQ_SPURIOUS, (uint64_t) isr_stub_255, 0x08, IDT_TYPE_INTERRUPT_GATE);
+
   idt_pointer.limit = sizeof(idt) - 1;
   idt_pointer.base = (uint64_t) &idt;
 
   idt_load(&idt_pointer);
 }
 
+void idt_init_cpu() { idt_load(&idt_pointer); }
+
+// Demand paging, returns 1 if the faulting access can be retried
+static int handle_page_fault(registers_t *regs)
+{
+  uint64_t cr2;
+  __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+
+  // The kernel touching user memory (syscall buffers) is demand paged too
+  if (vma_handle_fault(vmm_get_current_address_space(), cr2, regs->error_code) == 0)
+  {
+    return 1;
+  }
+
+  // A bad syscall buffer is the calling thread's fault, not the kernel's.
+  // Nothing copies user memory with a lock held, so it can simply go away.
+  Thread *t = thread_current();
+  if ((regs->frame.cs & 3) == 0 && (cr2 >= USER_SPACE_END || !t || !t->address_space))
+  {
+    return 0;
+  }
+
+  serial_print("Page fault: Killing user thread, address ");
+  serial_print_hex(cr2);
+  serial_print(" RIP=");
+  serial_print_hex(regs->frame.rip);
+  serial_print(" error ");
+  serial_print_hex(regs->error_code);
+  serial_print("\n");
+
+  thread_exit();
+  return 0;
+}
+
 void exception_handler(registers_t *regs)
 {
+  if (regs->int_no == EXCEPTION_PAGE_FAULT && handle_page_fault(regs))
+  {
+    return;
+  }
+
   serial_print("\n=== CPU EXCEPTION ===\n");
   serial_print("Exception: ");
 
@@ -143,12 +190,19 @@ void exception_handler(registers_t *regs)
   serial_print(" SS=");
   serial_print_hex(regs->frame.ss);
 
-  if (regs->int_no == EXCEPTION_PAGE_FAULT)
+  if (regs->int_no == EXCEPTION_PAGE_FAULT || regs->int_no == EXCEPTION_DOUBLE_FAULT)
   {
     uint64_t cr2;
     __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
     serial_print("\nFaulting Address (CR2): ");
     serial_print_hex(cr2);
+
+    // A fault on a guard page usually turns into a double fault, since the
+    // CPU can't push the exception frame onto the overflowed stack either
+    if (thread_is_stack_guard(cr2))
+    {
+      serial_print("\nKernel stack overflow into guard page");
+    }
   }
   serial_print("\n\nSystem Halted.\n");
 
@@ -160,19 +214,39 @@ void exception_handler(registers_t *regs)
 
 void irq_handler(registers_t *regs)
 {
-  if (regs->int_no >= 40)
+  // Only the legacy PIC range is acknowledged at the PIC
+  if (regs->int_no >= 40 && regs->int_no < IRQ_LAPIC_TIMER)
   {
     __asm__ volatile("outb %0, %1" : : "a"((uint8_t) 0x20), "Nd"((uint16_t) 0xA0));
   }
-  __asm__ volatile("outb %0, %1" : : "a"((uint8_t) 0x20), "Nd"((uint16_t) 0x20));
+  if (regs->int_no < IRQ_LAPIC_TIMER)
+  {
+    __asm__ volatile("outb %0, %1" : : "a"((uint8_t) 0x20), "Nd"((uint16_t) 0x20));
+  }
+
   switch (regs->int_no)
   {
     case IRQ_TIMER:
     {
+      // Only keeps time, every CPU's own LAPIC timer drives its scheduler
       pit_tick();
       break;
     }
 
+    case IRQ_LAPIC_TIMER:
+    {
+      // May switch threads, so the EOI has to be out already
+      lapic_eoi();
+      thread_tick();
+      break;
+    }
+
+    case IRQ_SPURIOUS:
+    {
+      // Never acknowledged
+      break;
+    }
+
     case IRQ_KEYBOARD:
     {
       // TODO:
@@ -75,7 +75,15 @@ ISR_NO_ERROR 45
 ISR_NO_ERROR 46
 ISR_NO_ERROR 47
 
+ISR_NO_ERROR 48
+ISR_NO_ERROR 255
+
 isr_common:
+    ; Coming from ring 3 (saved CS at rsp + 24), switch to the kernel GS base
+    test qword [rsp + 24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
     push rax
     push rcx
     push rdx
@@ -125,4 +133,8 @@ isr_common:
 
     add rsp, 16
 
+    test qword [rsp + 8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     iretq
\ No newline at end of file
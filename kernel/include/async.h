@@ -0,0 +1,80 @@
+#ifndef KERNEL_ASYNC_H
+#define KERNEL_ASYNC_H
+
+#include <stdint.h>
+
+#include "ipc.h"
+#include "vmm.h"
+
+// Submission and completion rings shared between a process and the kernel.
+// Userspace writes submission entries and advances sq_tail, the kernel takes
+// them in order and posts a completion for each at cq_tail. Indices only ever
+// grow, masks turn them into slots.
+
+// Largest submission ring, the completion ring is twice its size
+#define ASYNC_MAX_ENTRIES 256
+
+// Processes that can share the kernel poller
+#define ASYNC_POLL_MAX 16
+
+// SYS_ASYNC_SETUP flags
+#define ASYNC_SETUP_POLL (1 << 0) // A kernel thread takes submissions, no doorbell while it's awake
+
+// async_rings_t flags
+#define ASYNC_NEED_WAKEUP (1 << 0) // The poller sleeps, ring the doorbell after submitting
+
+#define ASYNC_OP_NOP 0
+#define ASYNC_OP_SEND 1 // Never blocks, a full queue completes with -7
+#define ASYNC_OP_RECV 2 // Completes once a message arrives
+
+typedef struct async_sqe
+{
+  uint32_t opcode; // ASYNC_OP_*
+  uint32_t port;
+  uint64_t user_data; // Handed back in the completion
+  ipc_message_t msg; // ASYNC_OP_SEND only
+  uint32_t reserved;
+} async_sqe_t;
+
+typedef struct async_cqe
+{
+  uint64_t user_data;
+  int32_t result; // What the synchronous call would have returned
+  ipc_message_t msg; // ASYNC_OP_RECV only
+} async_cqe_t;
+
+// Start of the mapping SYS_ASYNC_SETUP returns, the rings follow at their
+// offsets. Each side writes only its own cache line.
+typedef struct async_rings
+{
+  // Written by the kernel
+  uint32_t sq_head;
+  uint32_t cq_tail;
+  uint32_t flags;
+
+  // Written by userspace
+  uint32_t sq_tail __attribute__((aligned(64)));
+  uint32_t cq_head;
+
+  uint32_t sq_mask __attribute__((aligned(64)));
+  uint32_t cq_mask;
+  uint32_t sq_offset; // Bytes from the start of the mapping
+  uint32_t cq_offset;
+} async_rings_t;
+
+// Map rings for the current process with entries submission slots, rounded
+// up to a power of two. Returns their user address, or -1.
+int64_t async_setup(uint32_t entries, uint32_t flags);
+
+// The doorbell. Takes every submitted entry there is completion room for and
+// waits until min_complete completions are ready or nothing is left pending.
+// With a poller it only wakes it. Returns the number of entries taken.
+int async_enter(uint32_t min_complete);
+
+// A spawned child doesn't get its parent's rings
+void async_clone(address_space_t *child, address_space_t *parent);
+
+// Tear down as's rings, called before the address space goes away
+void async_destroy(address_space_t *as);
+
+#endif
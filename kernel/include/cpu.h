@@ -0,0 +1,86 @@
+#ifndef KERNEL_CPU_H
+#define KERNEL_CPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_CPUS 16
+
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102 // Swapped in by swapgs
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081 // SYSCALL/SYSRET segment bases
+#define MSR_LSTAR 0xC0000082 // SYSCALL entry point
+#define MSR_SFMASK 0xC0000084 // RFLAGS bits SYSCALL clears
+
+struct Thread;
+
+// Per-CPU state. The GS base points at it whenever kernel code runs, user GS
+// is parked in MSR_KERNEL_GS_BASE and swapped on every ring transition.
+typedef struct cpu
+{
+  struct cpu *self; // Must stay first, cpu_current() loads it through GS
+  uint32_t id; // Index into cpus[], 0 is the BSP
+  uint32_t lapic_id;
+  struct Thread *thread; // Running thread, NULL until the scheduler starts here
+  struct Thread *idle; // Runs when neither this CPU nor any other has work
+  struct Thread *prev; // Thread being switched away from, until the switch completes
+  uint32_t need_resched; // A thread more urgent than the running one was queued here
+  uint64_t kernel_tlb_gen; // Kernel mapping generation this TLB has caught up with
+  uint64_t syscall_rsp; // Kernel stack SYSCALL switches to, like TSS.rsp0
+  uint64_t user_rsp; // Scratch for the user stack until SYSCALL entry pushes it
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+
+static inline cpu_t *cpu_current(void)
+{
+  cpu_t *cpu;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+// Index of the CPU executing this code. Only stable while interrupts are
+// disabled, a preempted thread may resume elsewhere.
+static inline uint32_t cpu_current_id(void)
+{
+  uint32_t id;
+  __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(cpu_t, id)));
+  return id;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+  __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t read_cr4(void)
+{
+  uint64_t value;
+  __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+  return value;
+}
+
+static inline void write_cr4(uint64_t value) { __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory"); }
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+  uint32_t low, high;
+  __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+  return ((uint64_t) high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+  __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+static inline uint64_t rdtsc(void)
+{
+  uint32_t low, high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t) high << 32) | low;
+}
+
+#endif
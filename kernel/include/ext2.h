@@ -126,5 +126,6 @@ int ext2_init(void);
 void ext2_list_root(void);
 
 int ext2_read_file(const char *path, void *buffer, uint32_t max_size);
+int64_t ext2_file_size(const char *path);
 
 #endif
@@ -41,15 +41,20 @@ typedef struct
 #define GDT_NULL 0
 #define GDT_KERNEL_CODE 1
 #define GDT_KERNEL_DATA 2
-#define GDT_USER_CODE 3
-#define GDT_USER_DATA 4
-#define GDT_TSS 5
+// SYSRET loads user SS and CS from consecutive entries, data first
+#define GDT_USER_DATA 3
+#define GDT_USER_CODE 4
+#define GDT_TSS 5 // One two-entry descriptor per CPU from here on
+
+// Interrupt stack table slot for double faults, which can't trust the
+// current stack (it may have just overflowed into its guard page)
+#define IST_DOUBLE_FAULT 1
 
 #define KERNEL_CS (GDT_KERNEL_CODE << 3)
 #define KERNEL_DS (GDT_KERNEL_DATA << 3)
 #define USER_CS ((GDT_USER_CODE << 3) | 3)
 #define USER_DS ((GDT_USER_DATA << 3) | 3)
-#define TSS_SEG (GDT_TSS << 3)
+#define TSS_SEG(cpu) ((GDT_TSS + 2 * (cpu)) << 3)
 
 #define GDT_ACCESS_PRESENT (1 << 7)
 #define GDT_ACCESS_RING0 (0 << 5)
@@ -62,6 +67,9 @@ typedef struct
 #define GDT_GRANULARITY_64BIT (1 << 5)
 
 void gdt_init(void);
+// Load the shared GDT and this CPU's TSS on an application processor
+void gdt_init_cpu(uint32_t cpu);
+// Stack the current CPU switches to when entering ring 0 from user mode
 void gdt_set_kernel_stack(uint64_t stack);
 
 extern void gdt_load(gdt_ptr_t *gdt_ptr);
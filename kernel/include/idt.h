@@ -47,6 +47,10 @@ typedef struct
 #define IRQ_TIMER 32
 #define IRQ_KEYBOARD 33
 
+// Local APIC vectors, past the PIC's range
+#define IRQ_LAPIC_TIMER 48
+#define IRQ_SPURIOUS 255
+
 typedef struct
 {
   uint64_t rip;
@@ -65,6 +69,8 @@ typedef struct
 } __attribute__((packed)) registers_t;
 
 void idt_init(void);
+// Load the shared IDT on an application processor
+void idt_init_cpu(void);
 void idt_set_gate(uint8_t num, uint64_t handler, uint16_t selector, uint8_t type_attr);
 
 void exception_handler(registers_t *regs);
@@ -122,4 +128,7 @@ extern void isr_stub_45(void);
 extern void isr_stub_46(void);
 extern void isr_stub_47(void);
 
+extern void isr_stub_48(void);
+extern void isr_stub_255(void);
+
 #endif
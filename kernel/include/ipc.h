@@ -0,0 +1,64 @@
+#ifndef KERNEL_IPC_H
+#define KERNEL_IPC_H
+
+#include <stdint.h>
+
+// Port types shared with userspace
+
+// What send() does when a port's queue is full
+typedef enum
+{
+  PORT_OVERFLOW_FAIL = 0, // Return -7 and drop the new message
+  PORT_OVERFLOW_BLOCK, // Wait until a receiver makes room
+  PORT_OVERFLOW_DROP_OLDEST, // Throw away the oldest queued message
+  PORT_OVERFLOW_COUNT
+} port_overflow_t;
+
+// Largest queue a port can be configured with
+#define PORT_MAX_CAPACITY 4096
+
+// Port configuration flags
+#define PORT_RING (1 << 0) // Lock-free ring for one sending and one receiving thread
+
+
+// Message layout in SYS_SEND_BATCH and SYS_RECV_BATCH arrays
+typedef struct ipc_message
+{
+  uint32_t id;
+  uint32_t data[4];
+} ipc_message_t;
+
+// Most messages a single batch call moves
+#define IPC_BATCH_MAX 256
+
+// Most ports a single SYS_RECV_ANY waits on
+#define RECV_ANY_MAX_PORTS 16
+
+// SYS_SEND_GRANT flags
+#define GRANT_SHARE (1 << 0) // Keep the pages too, both sides see them copy-on-write
+
+// Largest range a single message can carry
+#define IPC_GRANT_MAX_SIZE (1024 * 1024)
+
+// Where SYS_RECV_GRANT mapped the pages that came with a message, length is
+// 0 if there were none
+typedef struct ipc_grant
+{
+  uint64_t addr;
+  uint64_t length;
+} ipc_grant_t;
+
+// Snapshot returned by SYS_PORT_STATS
+typedef struct port_stats
+{
+  uint32_t depth; // Messages queued right now
+  uint32_t capacity;
+  uint32_t high_water; // Deepest the queue has been, not tracked on ring ports
+  uint32_t overflow; // port_overflow_t
+  uint64_t sent; // Messages queued since the port was created
+  uint64_t received;
+  uint64_t dropped; // Rejected or thrown away by the overflow policy
+  uint64_t blocked_sends; // Times a sender had to wait for room
+} port_stats_t;
+
+#endif
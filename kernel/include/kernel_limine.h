@@ -9,5 +9,6 @@ extern volatile struct limine_module_request module_request;
 void limine_parse_info(void);
 struct limine_memmap_request limine_get_memmap_request(void);
 struct limine_executable_address_request limine_get_executable_address_request(void);
+struct limine_mp_request limine_get_mp_request(void);
 
 #endif
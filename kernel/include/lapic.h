@@ -0,0 +1,35 @@
+#ifndef KERNEL_LAPIC_H
+#define KERNEL_LAPIC_H
+
+#include <stdint.h>
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1ULL << 11)
+
+#define LAPIC_REG_ID 0x020
+#define LAPIC_REG_TPR 0x080
+#define LAPIC_REG_EOI 0x0B0
+#define LAPIC_REG_SPURIOUS 0x0F0
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SPURIOUS_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+// PIT ticks the timer is measured against
+#define LAPIC_CALIBRATION_TICKS 10
+
+// Map the local APIC, calibrate its timer against the PIT and start it on the
+// BSP. Interrupts must be enabled so the PIT keeps ticking.
+int lapic_init(void);
+// Enable the local APIC and its timer on an application processor
+void lapic_init_cpu(void);
+
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+#endif
@@ -36,6 +36,7 @@
 
 void pit_init(uint32_t frequency);
 uint64_t pit_get_ticks(void);
+uint32_t pit_get_frequency(void);
 void pit_sleep(uint32_t milliseconds);
 
 void pit_tick(void);
@@ -6,9 +6,85 @@
 
 #define PAGE_SIZE 4096
 
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MiB)
+#define PMM_MAX_ORDER 10
+#define PMM_HUGE_PAGE_ORDER 9 // 2 MiB, suitable for a PAGE_HUGE PD entry
+
+// Who a block of physical memory was handed out to. Blocks start out as
+// PMM_OWNER_KERNEL and subsystems retag them with pmm_set_owner().
+typedef enum
+{
+  PMM_OWNER_KERNEL = 0,
+  PMM_OWNER_PAGE_TABLE,
+  PMM_OWNER_HEAP, // Slab caches and large kmalloc blocks
+  PMM_OWNER_EXT2,
+  PMM_OWNER_USER,
+  PMM_OWNER_KERNEL_STACK,
+  PMM_OWNER_COUNT
+} pmm_owner_t;
+
+// Snapshot returned by pmm_get_stats() and SYS_MEM_STATS, counts are in pages
+typedef struct pmm_stats
+{
+  uint64_t total_pages;
+  uint64_t free_pages; // Everything below plus the buddy free lists
+  uint64_t used_pages;
+  uint64_t peak_used_pages; // High water mark of pages out of the buddy lists
+  uint64_t cached_pages; // Sitting in per-CPU magazines
+  uint64_t zero_pool_pages;
+  uint64_t uncarved_pages;
+
+  // Free blocks per order, uncarved extents counted as they would be carved
+  uint64_t free_blocks[PMM_MAX_ORDER + 1];
+
+  uint64_t allocs; // Since boot
+  uint64_t frees;
+  uint64_t alloc_rate; // Per second since the previous snapshot
+  uint64_t free_rate;
+
+  uint64_t owner_pages[PMM_OWNER_COUNT];
+
+  // Permille of free memory that can't satisfy a 2 MiB allocation
+  uint32_t fragmentation;
+} pmm_stats_t;
+
 void pmm_init(void);
+
+// Returns a zero-filled page, preferably straight from the pre-zeroed pool
 void *pmm_alloc_page(void);
+
+// Returns a page with undefined contents, for callers that overwrite it
+void *pmm_alloc_page_nozero(void);
 void pmm_free_page(void *page);
+
+// Free many single pages at once, taking the global lock at most once
+void pmm_free_page_batch(void *const *pages, uint32_t count);
+
+// Contiguous, naturally aligned 2^order pages with undefined contents
+void *pmm_alloc_pages(uint32_t order);
+void pmm_free_pages(void *addr, uint32_t order);
+
+// Zero up to max_pages free pages into the pool, returns how many were added
+uint32_t pmm_zero_pool_refill(uint32_t max_pages);
+
+// Kernel thread entry that keeps the pre-zeroed pool topped up
+void pmm_zero_worker(void);
+
+// Turn an allocated block into 2^order pages that are freed one at a time
+void pmm_split_pages(void *addr, uint32_t order);
+
+// Take another reference to an allocated block, so it survives until every
+// holder has freed it. Returns -1 if addr isn't allocated or the count is
+// saturated.
+int pmm_ref_pages(void *addr);
+uint32_t pmm_page_refs(void *addr);
+
+// Retag an allocated block, addr must be what the allocator returned
+void pmm_set_owner(void *addr, pmm_owner_t owner);
+
+void pmm_get_stats(pmm_stats_t *stats);
+void pmm_dump_stats(void);
+void pmm_print_magazine_stats(void);
 uint64_t pmm_get_total_memory(void);
 uint64_t pmm_get_free_memory(void);
 uint64_t pmm_get_used_memory(void);
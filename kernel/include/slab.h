@@ -0,0 +1,63 @@
+#ifndef KERNEL_SLAB_H
+#define KERNEL_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pmm.h"
+#include "spinlock.h"
+
+#define KMEM_NAME_LEN 24
+
+// Largest request served from the kmalloc size classes, bigger ones get
+// whole pages from the PMM
+#define KMALLOC_MAX_CLASS_SIZE 2048
+
+typedef struct kmem_slab kmem_slab_t;
+
+typedef struct kmem_cache
+{
+  char name[KMEM_NAME_LEN];
+  uint32_t object_size; // Requested size rounded up to the alignment
+  uint32_t align;
+  uint32_t slab_order; // Each slab is 2^slab_order contiguous pages
+  uint32_t objects_per_slab;
+  uint32_t header_size; // Slab header plus free index stack, objects follow
+  void (*ctor)(void *obj);
+  pmm_owner_t owner; // Slab pages are charged to this PMM owner
+
+  spinlock_t lock;
+  kmem_slab_t *partial;
+  kmem_slab_t *full;
+  kmem_slab_t *empty;
+
+  // Statistics
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t active_objects;
+  uint64_t peak_active_objects;
+  uint64_t total_objects;
+  uint64_t slab_count;
+
+  struct kmem_cache *next;
+} kmem_cache_t;
+
+void slab_init(void);
+
+// Objects are constructed once when their slab is created and must be
+// handed back to kmem_cache_free() in their constructed state.
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, void (*ctor)(void *obj));
+void kmem_cache_destroy(kmem_cache_t *cache);
+void kmem_cache_set_owner(kmem_cache_t *cache, pmm_owner_t owner);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+// Release cached empty slabs back to the PMM, returns pages freed
+uint64_t kmem_cache_shrink(kmem_cache_t *cache);
+
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+void kmem_print_stats(void);
+
+#endif
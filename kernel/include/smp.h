@@ -0,0 +1,12 @@
+#ifndef KERNEL_SMP_H
+#define KERNEL_SMP_H
+
+#include <stdint.h>
+
+// Point GS at the BSP's cpu_t, must run before anything uses per-CPU state
+void smp_init_bsp(void);
+
+// Start the application processors, each enters the scheduler once it's set up
+void smp_init(void);
+
+#endif
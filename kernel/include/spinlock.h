@@ -0,0 +1,59 @@
+#ifndef KERNEL_SPINLOCK_H
+#define KERNEL_SPINLOCK_H
+
+#include <stdint.h>
+
+#define RFLAGS_IF (1ULL << 9)
+
+typedef struct
+{
+  volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+// Disable interrupts on the local CPU, returning the previous RFLAGS
+static inline uint64_t irq_save(void)
+{
+  uint64_t flags;
+  __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+  if (flags & RFLAGS_IF)
+  {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+
+static inline void spin_init(spinlock_t *lock) { lock->locked = 0; }
+
+static inline void spin_lock(spinlock_t *lock)
+{
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+  {
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+    {
+      __asm__ volatile("pause");
+    }
+  }
+}
+
+static inline void spin_unlock(spinlock_t *lock) { __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE); }
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock)
+{
+  uint64_t flags = irq_save();
+  spin_lock(lock);
+  return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags)
+{
+  spin_unlock(lock);
+  irq_restore(flags);
+}
+
+#endif
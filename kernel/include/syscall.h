@@ -3,6 +3,10 @@
 
 #include <stdint.h>
 
+#include "async.h"
+#include "ipc.h"
+#include "pmm.h"
+
 #define SYS_SEND 1
 #define SYS_RECV 2
 #define SYS_THREAD_EXIT 3
@@ -12,26 +16,82 @@
 #define SYS_MAP_MEMORY 7
 #define SYS_UNMAP_MEMORY 8
 #define SYS_DEBUG_PRINT 9
+#define SYS_MEM_STATS 10
+#define SYS_SPAWN 11
+#define SYS_SET_PRIORITY 12
+#define SYS_CALL 13
+#define SYS_REPLY 14
+#define SYS_REPLY_RECV 15
+#define SYS_PORT_CONFIGURE 16
+#define SYS_PORT_STATS 17
+#define SYS_SEND_GRANT 18
+#define SYS_RECV_GRANT 19
+#define SYS_RECV_ANY 20
+#define SYS_SEND_BATCH 21
+#define SYS_RECV_BATCH 22
+#define SYS_ASYNC_SETUP 23
+#define SYS_ASYNC_ENTER 24
+#define SYS_NULL 25 // Does nothing, measures the cost of getting in and out
+
+// SYS_SET_PRIORITY classes, matching ThreadClass
+#define SCHED_LATENCY 0 // Runs first, right away when a message wakes it, dropped to normal if it doesn't block
+#define SCHED_NORMAL 1
+#define SCHED_BACKGROUND 2 // Only runs when nothing else is runnable
+
+// SYS_MAP_MEMORY protection, any combination
+#define PROT_READ (1 << 0)
+#define PROT_WRITE (1 << 1)
+#define PROT_EXEC (1 << 2) // Without it the pages are mapped NX
+
+// SYS_MAP_MEMORY flags
+#define MAP_ANONYMOUS (1 << 0) // Zero-filled, otherwise arg5 names a file
+#define MAP_FIXED (1 << 1) // Map exactly at addr instead of picking a spot
+#define MAP_HUGE (1 << 2) // Use 2 MiB pages, addr and length become 2 MiB aligned
+#define MAP_POPULATE (1 << 3) // Back anonymous mappings right away instead of on first touch
+
+// SYS_MEM_STATS flags
+#define MEM_STATS_DUMP (1 << 0) // Also print the statistics on serial
+
+// Userspace enters through SYSCALL, which hands back the user RIP and RFLAGS
+// in rcx and r11. The int 0x80 gate stays for everything else.
+#ifdef USERSPACE
+#define SYSCALL_INSN "syscall"
+#define SYSCALL_CLOBBERS "rcx", "r11", "memory"
+#else
+#define SYSCALL_INSN "int $0x80"
+#define SYSCALL_CLOBBERS "memory"
+#endif
 
 static inline uint64_t syscall0(uint64_t num)
 {
   int64_t ret;
-  __asm__ volatile("int $0x80" : "=a"(ret) : "a"(num) : "memory");
+  __asm__ volatile(SYSCALL_INSN : "=a"(ret) : "a"(num) : SYSCALL_CLOBBERS);
   return ret;
 }
 
+// Always through the interrupt gate, which leaves the argument registers
+// clobbered
+static inline uint64_t syscall0_int80(uint64_t num)
+{
+  int64_t ret;
+  __asm__ volatile("int $0x80"
+      : "=a"(ret)
+      : "a"(num)
+      : "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory");
+  return ret;
+}
 
 static inline int64_t syscall1(uint64_t num, uint64_t arg1)
 {
   int64_t ret;
-  __asm__ volatile("int $0x80" : "=a"(ret) : "a"(num), "D"(arg1) : "memory");
+  __asm__ volatile(SYSCALL_INSN : "=a"(ret) : "a"(num), "D"(arg1) : SYSCALL_CLOBBERS);
   return ret;
 }
 
 static inline int64_t syscall2(uint64_t num, uint64_t arg1, uint64_t arg2)
 {
   int64_t ret;
-  __asm__ volatile("int $0x80" : "=a"(ret) : "a"(num), "D"(arg1), "S"(arg2) : "memory");
+  __asm__ volatile(SYSCALL_INSN : "=a"(ret) : "a"(num), "D"(arg1), "S"(arg2) : SYSCALL_CLOBBERS);
   return ret;
 }
 
@@ -42,10 +102,10 @@ static inline int64_t syscall6(
   register uint64_t r10 __asm__("r10") = arg4;
   register uint64_t r8 __asm__("r8") = arg5;
   register uint64_t r9 __asm__("r9") = arg6;
-  __asm__ volatile("int $0x80"
+  __asm__ volatile(SYSCALL_INSN
       : "=a"(ret)
       : "a"(num), "D"(arg1), "S"(arg2), "d"(arg3), "r"(r10), "r"(r8), "r"(r9)
-      : "memory");
+      : SYSCALL_CLOBBERS);
   return ret;
 }
 
@@ -57,6 +117,65 @@ static inline int user_send(uint32_t port_id, uint32_t msg_id, uint32_t d0, uint
 
 static inline int user_recv(uint32_t port_id, void *msg_out) { return syscall2(SYS_RECV, port_id, (uint64_t) msg_out); }
 
+// Send count messages in one trap, returns how many were queued
+static inline int user_send_batch(uint32_t port_id, const void *msgs, uint32_t count)
+{
+  return syscall6(SYS_SEND_BATCH, port_id, (uint64_t) msgs, count, 0, 0, 0);
+}
+
+// Wait for one message, then take up to count - 1 more that are already
+// queued. Returns how many were received.
+static inline int user_recv_batch(uint32_t port_id, void *msgs, uint32_t count)
+{
+  return syscall6(SYS_RECV_BATCH, port_id, (uint64_t) msgs, count, 0, 0, 0);
+}
+
+// Wait for a message on any of count ports, returns the index of the one it
+// came from
+static inline int user_recv_any(const uint32_t *port_ids, uint32_t count, void *msg_out)
+{
+  return syscall6(SYS_RECV_ANY, (uint64_t) port_ids, count, (uint64_t) msg_out, 0, 0, 0);
+}
+
+// Send msg with the pages of [addr, addr + length), which leave this address
+// space unless flags has GRANT_SHARE
+static inline int user_send_grant(uint32_t port_id, const void *msg, void *addr, uint64_t length, uint32_t flags)
+{
+  return syscall6(SYS_SEND_GRANT, port_id, (uint64_t) msg, (uint64_t) addr, length, flags, 0);
+}
+
+// Receive into msg_out, grant says where pages sent along were mapped
+static inline int user_recv_grant(uint32_t port_id, void *msg_out, ipc_grant_t *grant)
+{
+  return syscall6(SYS_RECV_GRANT, port_id, (uint64_t) msg_out, (uint64_t) grant, 0, 0, 0);
+}
+
+// Map submission/completion rings, returns the async_rings_t at their start
+// or a negative value on failure
+static inline void *user_async_setup(uint32_t entries, uint32_t flags)
+{
+  return (void *) syscall2(SYS_ASYNC_SETUP, entries, flags);
+}
+
+// Submit what's queued and wait for min_complete completions, returns how
+// many submissions were taken
+static inline int user_async_enter(uint32_t min_complete) { return syscall1(SYS_ASYNC_ENTER, min_complete); }
+
+// Send msg and wait for the reply, which overwrites it
+static inline int user_call(uint32_t port_id, void *msg) { return syscall2(SYS_CALL, port_id, (uint64_t) msg); }
+
+// Answer the last call() received
+static inline int user_reply(uint32_t msg_id, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3)
+{
+  return syscall6(SYS_REPLY, msg_id, d0, d1, d2, d3, 0);
+}
+
+// Answer the last call() with msg and wait for the next message into msg
+static inline int user_reply_recv(uint32_t port_id, void *msg)
+{
+  return syscall2(SYS_REPLY_RECV, port_id, (uint64_t) msg);
+}
+
 static inline void user_exit(int code)
 {
   syscall1(SYS_THREAD_EXIT, code);
@@ -65,12 +184,57 @@ static inline void user_exit(int code)
 
 static inline void user_yield(void) { syscall0(SYS_THREAD_YIELD); }
 
+static inline int user_null(void) { return syscall0(SYS_NULL); }
+
 static inline int user_port_create(void) { return syscall0(SYS_PORT_CREATE); }
 
+// Bound a port's queue and pick what send() does once it's full (PORT_OVERFLOW_*),
+// flags can make it a PORT_RING
+static inline int user_port_configure(uint32_t port_id, uint32_t capacity, uint32_t overflow, uint32_t flags)
+{
+  return syscall6(SYS_PORT_CONFIGURE, port_id, capacity, overflow, flags, 0, 0);
+}
+
+static inline int user_port_stats(uint32_t port_id, port_stats_t *stats)
+{
+  return syscall2(SYS_PORT_STATS, port_id, (uint64_t) stats);
+}
+
 static inline void user_debug_print(const char *str) { syscall1(SYS_DEBUG_PRINT, (uint64_t) str); }
+
+// Returns the mapped address, or a negative value on failure
+static inline void *user_map_memory(void *addr, uint64_t length, uint32_t prot, uint32_t flags, const char *path,
+    uint64_t offset)
+{
+  return (void *) syscall6(SYS_MAP_MEMORY, (uint64_t) addr, length, prot, flags, (uint64_t) path, offset);
+}
+
+static inline int user_unmap_memory(void *addr, uint64_t length)
+{
+  return syscall2(SYS_UNMAP_MEMORY, (uint64_t) addr, length);
+}
+
+// Start entry on user_stack in a copy-on-write clone of this address space
+static inline int user_spawn(void (*entry)(void), void *user_stack)
+{
+  return syscall2(SYS_SPAWN, (uint64_t) entry, (uint64_t) user_stack);
+}
+
+// Move the calling thread into a SCHED_* class, priority 0 is the most urgent
+static inline int user_set_priority(uint32_t sched_class, uint32_t priority)
+{
+  return syscall2(SYS_SET_PRIORITY, sched_class, priority);
+}
+
+static inline int user_mem_stats(pmm_stats_t *stats, uint32_t flags)
+{
+  return syscall2(SYS_MEM_STATS, (uint64_t) stats, flags);
+}
 #endif
 
 void syscall_init(void);
+// Point this CPU's SYSCALL instruction at the kernel, every CPU needs it
+void syscall_init_cpu(void);
 int64_t syscall_handler(
     uint64_t num, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6);
 
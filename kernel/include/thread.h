@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 
+#include "ipc.h"
+#include "vmm.h"
+
 typedef enum
 {
   THREAD_RUNNING,
@@ -10,6 +13,15 @@ typedef enum
   THREAD_DEAD,
 } ThreadState;
 
+// Scheduling classes, each owns a band of run queue levels
+typedef enum
+{
+  THREAD_CLASS_LATENCY, // Runs ahead of everything, right away when a message wakes it, until it runs past THREAD_LATENCY_BUDGET_MS
+  THREAD_CLASS_NORMAL,
+  THREAD_CLASS_BACKGROUND, // Only runs when nothing else is runnable
+  THREAD_CLASS_COUNT,
+} ThreadClass;
+
 typedef struct Thread Thread;
 typedef struct Port Port;
 typedef struct Message Message;
@@ -21,16 +33,58 @@ typedef struct Message
   uint32_t id;
   uint32_t data[MESSAGE_DATA_SIZE];
   struct Message *next;
+  Thread *caller; // Sent by call(), waiting for the receiver's reply()
+  struct vm_grant *grant; // Pages sent along by send_grant()
 } Message;
 
+// Default queue capacity of a new port
 #define MAX_MESSAGE_QUEUE 16
 
+// Default time slice, a thread that doesn't yield is preempted after this
+#define THREAD_TIME_SLICE_MS 20
+
+// Default kernel stack size, an unmapped guard page always sits below it
+#define THREAD_STACK_SIZE (16 * 1024)
+
+// Run queue levels, 0 runs first. Latency threads get levels 0-7, normal
+// ones 8-23 and background work 24-31.
+#define THREAD_PRIORITY_LEVELS 32
+#define THREAD_LATENCY_BASE 0
+#define THREAD_NORMAL_BASE 8
+#define THREAD_BACKGROUND_BASE 24
+#define THREAD_PRIORITY_DEFAULT 16
+
+// A latency thread that runs this long without blocking is moved to the
+// normal class, and can't go back until it has blocked once
+#define THREAD_LATENCY_BUDGET_MS 20
+
+// A thread blocked receiving on a port, linked into the port's receivers.
+// recv_any() waits with one per port, all on the waiting thread's stack.
+typedef struct port_waiter
+{
+  Thread *thread;
+  Port *port;
+  struct port_waiter *prev;
+  struct port_waiter *next;
+} port_waiter_t;
+
 typedef struct Port
 {
+  uint32_t id;
   Message *queue_head;
   Message *queue_tail;
-  int message_count;
-  Thread *blocked_thread;
+  uint32_t message_count;
+  port_waiter_t *recv_waiters; // Blocked receivers, FIFO, each message wakes the first
+  port_waiter_t *recv_waiters_tail;
+
+  uint32_t capacity; // Queue bound, overflow decides what happens past it
+  port_overflow_t overflow;
+  Thread *send_waiters; // Senders waiting for room, FIFO through wait_next
+  Thread *send_waiters_tail;
+  port_stats_t stats; // depth, capacity and overflow are filled in on read
+  struct port_ring *ring; // Set with PORT_RING, replaces the message queue
+  uint32_t refs; // One for the port table plus one per user, freed at 0
+  uint8_t dead; // Destroyed, everything but dropping references fails with -5
 } Port;
 
 typedef struct Thread
@@ -38,25 +92,133 @@ typedef struct Thread
   uint64_t rsp;
   ThreadState state;
   Port *waiting_on_port;
-  Thread *next;
+  port_waiter_t *waits; // Receiving on these ports while blocked
+  uint32_t wait_count;
+  int wake_status; // Result for a blocked recv() or call(), negative on failure
+  Thread *wait_next; // Link in a port's wait queue while blocked
+  Thread *reply_to; // Received a call() from it, owes it a reply()
+  uint8_t parked; // Blocked in thread_park(), protected by park_lock
+  uint8_t unpark_pending; // thread_unpark() came first, the next park returns at once
+  Message reply; // Filled in by reply() while blocked in call()
+  Thread *next; // Run queue link
+  uint8_t priority; // Run queue level, inside the band of sched_class
+  uint8_t sched_class; // ThreadClass
+  uint8_t queued; // On run_queues[cpu], protected by that queue's lock
+  volatile uint8_t on_cpu; // Some CPU is still running on its stack
+  uint32_t cpu; // CPU it runs on or last ran on, wakeups queue it there
+
+  uint64_t stack_top; // Fixed top of this thread's kernel stack slot
+  uint32_t stack_pages; // Pages mapped below stack_top
+  uint32_t generation; // Bumped every time this slot is handed to a new thread
 
   uint64_t kernel_rsp;
   uint64_t user_rsp;
   int is_user_mode;
+
+  // NULL for kernel threads, which borrow whatever address space is loaded
+  address_space_t *address_space;
+
+  void (*entry)(void); // Kernel threads only
+  uint32_t slice_left; // Timer ticks until preemption
+  uint32_t latency_ticks; // Ticks run in the latency class since it last blocked
+  uint64_t voluntary_switches; // Yielded or blocked
+  uint64_t involuntary_switches; // Preempted by the timer
+  uint64_t handoffs; // Voluntary switches straight to an IPC partner
 } Thread;
 
 void thread_init(void);
 void thread_create(void (*entry)(void));
-void thread_create_user(void (*entry)(void), void *user_stack);
+// Returns 0 on success, the thread owns as from then on
+int thread_create_user(void (*entry)(void), void *user_stack, address_space_t *as);
 void thread_yield(void);
+// Block the running thread until thread_unpark() is called on it
+void thread_park(void);
+// Wake t out of thread_park(), or make its next park return right away
+void thread_unpark(Thread *t);
+void thread_exit(void);
+// Enter the scheduler on this CPU, never returns
 void scheduler_start(void);
 
+// Completes a context switch on the new thread's stack, lets the previous
+// thread run elsewhere. New threads call it before anything else.
+void thread_finish_switch(void);
+
+// Called on every timer interrupt, switches away once the slice runs out
+void thread_tick(void);
+void thread_set_time_slice(uint32_t milliseconds);
+
+// Move the calling thread into cls at priority (0 is the most urgent, values
+// past the class's band are clamped). Returns 0, or -1 for an unknown class.
+int thread_set_priority(ThreadClass cls, uint32_t priority);
+
+// Kernel stack size for threads created from now on, rounded up to pages
+// and capped by the stack slot size
+void thread_set_stack_size(uint32_t bytes);
+
+// Whether addr is in the unmapped guard area of a kernel stack slot
+int thread_is_stack_guard(uint64_t addr);
+
+// The port table holds the only reference, kernel code keeping the pointer
+// takes its own with port_get()
 Port *port_create(void);
+// Fail everything waiting on port and take it out of the table. It's freed
+// once the last reference is dropped.
 void port_destroy(Port *port);
+Port *port_get(Port *port);
+void port_put(Port *port);
 int send(Port *port, uint32_t id, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3);
 int recv(Port *port, Message *msg_out);
 
+// Block until one of the ports has a message queued, without taking it.
+// Returns the port's index.
+int port_poll_any(Port *const *ports, uint32_t count);
+
+// Never block: send_try() returns -7 on a full queue whatever the overflow
+// policy, recv_try() returns -3 on an empty one. A call received this way
+// fails with -6 for its caller. Ring ports are turned down.
+int send_try(Port *port, const ipc_message_t *msg);
+int recv_try(Port *port, ipc_message_t *msg_out);
+
+// Move up to IPC_BATCH_MAX messages in one go, returning how many made it.
+// Only the first one waits, for room or for a message. After that the batch
+// stops at a full or empty queue, and recv_batch() also stops after a call
+// so it can be replied to. Fails with the error of the first message if
+// nothing moved.
+int send_batch(Port *port, const ipc_message_t *msgs, uint32_t count);
+int recv_batch(Port *port, ipc_message_t *msgs, uint32_t count);
+
+// Wait on up to RECV_ANY_MAX_PORTS ports at once. Returns the index in ports
+// of the one the message came from, earlier ports win when several have one.
+int recv_any(Port *const *ports, uint32_t count, Message *msg_out);
+
+// Bulk IPC. send_grant() moves the pages of [addr, addr + length) out of the
+// sender's address space along with msg, GRANT_SHARE in flags shares them
+// copy-on-write instead. recv_grant() maps them into the receiver's address
+// space and says where in grant, plain recv() frees them. A message that
+// can't be queued gives shared pages back, moved ones are mapped back at
+// addr read/write.
+int send_grant(Port *port, const Message *msg, uint64_t addr, uint64_t length, uint32_t flags);
+int recv_grant(Port *port, Message *msg_out, ipc_grant_t *grant);
+
+// Synchronous IPC. call() sends msg and blocks until the receiver replies,
+// the reply is written back to msg. A receiver blocked on the port gets the
+// CPU and the rest of the caller's time slice directly, and reply() hands it
+// back the same way. reply_recv() replies and waits for the next request in
+// one step, msg holds the reply on entry and the request on return.
+int call(Port *port, Message *msg);
+int reply(uint32_t id, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3);
+int reply_recv(Port *port, Message *msg);
+
+// Set the queue bound and overflow policy, returns -1 if either is invalid.
+// PORT_RING in flags turns an idle port into a ring with capacity rounded up
+// to a power of two. The first thread to send and the first to receive own
+// its two ends from then on, anyone else gets -8. Ring ports can't carry
+// calls, drop their oldest message or be reconfigured.
+int port_configure(Port *port, uint32_t capacity, port_overflow_t overflow, uint32_t flags);
+void port_get_stats(Port *port, port_stats_t *stats);
+
 uint32_t port_to_id(Port *port);
+// Look up a live port and take a reference, drop it with port_put()
 Port *port_from_id(uint32_t id);
 
 Thread *thread_current(void);
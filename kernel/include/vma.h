@@ -0,0 +1,109 @@
+#ifndef KERNEL_VMA_H
+#define KERNEL_VMA_H
+
+#include <stdint.h>
+
+#include "pmm.h"
+#include "vmm.h"
+
+// Everything below this is user space. The last page below the canonical
+// hole stays unmapped, so a syscall at its very end can't leave a
+// non-canonical return address for sysret.
+#define USER_SPACE_END (0x0000800000000000ULL - PAGE_SIZE)
+
+// Unmapped pages kept below every stack region to catch overflows
+#define VM_STACK_GUARD_PAGES 1
+
+#define VM_READ (1 << 0)
+#define VM_WRITE (1 << 1)
+#define VM_EXEC (1 << 2)
+#define VM_HUGE (1 << 3) // Back with 2 MiB pages where possible, anonymous only
+
+// Where vma_find_free() starts looking for room
+#define VM_MMAP_BASE 0x0000100000000000ULL
+
+typedef enum
+{
+  VM_REGION_ANON, // Zero-filled on first touch
+  VM_REGION_FILE, // Copied from a file buffer on first touch, zero past its end
+  VM_REGION_STACK, // Anonymous, with a guard gap below it
+} vm_region_type_t;
+
+// File contents shared by the regions mapping them, held in kernel memory
+typedef struct vm_file
+{
+  const uint8_t *data;
+  uint64_t size;
+  uint32_t refs;
+  int owned; // data came from kmalloc() and is freed with the last reference
+} vm_file_t;
+
+typedef struct vm_region
+{
+  uint64_t start; // Page aligned
+  uint64_t end; // Page aligned, exclusive
+  vm_region_type_t type;
+  uint32_t prot;
+
+  vm_file_t *file;
+  uint64_t file_offset; // Offset into the file of the byte mapped at start
+
+  struct vm_region *next; // Sorted by address
+} vm_region_t;
+
+// Frames taken out of one address space to be mapped into another. entries
+// holds the old leaf entry of every page, 0 where nothing was mapped.
+typedef struct vm_grant
+{
+  uint64_t pages;
+  uint64_t entries[];
+} vm_grant_t;
+
+void vma_init(void);
+
+vm_file_t *vm_file_create(const void *data, uint64_t size, int owned);
+void vm_file_put(vm_file_t *file);
+
+// Reserve [start, start + length) in as. Nothing is mapped until touched.
+// Returns NULL if the range is invalid or overlaps another region (or its
+// stack guard).
+vm_region_t *vma_create(address_space_t *as, uint64_t start, uint64_t length, vm_region_type_t type, uint32_t prot,
+    vm_file_t *file, uint64_t file_offset);
+vm_region_t *vma_find(address_space_t *as, uint64_t addr);
+
+// Lowest free, align-aligned range of length bytes above VM_MMAP_BASE, or 0
+uint64_t vma_find_free(address_space_t *as, uint64_t length, uint64_t align);
+
+// Drop [start, start + length) from whatever regions cover it, unmapping and
+// freeing the frames behind it. Huge regions can only be cut at 2 MiB
+// boundaries. Returns 0 on success.
+int vma_unmap(address_space_t *as, uint64_t start, uint64_t length);
+
+// Forget every region of as, mapped frames are left to the caller
+void vma_destroy_all(address_space_t *as);
+
+// Give child (which has no regions yet) a copy of parent's region list.
+// Returns 0 on success.
+int vma_clone(address_space_t *child, address_space_t *parent);
+
+// Map every page of an anonymous or stack region up front, in physically
+// contiguous runs. Returns 0 on success.
+int vma_populate(address_space_t *as, vm_region_t *region);
+
+// Take the pages of [start, start + length), which must lie in one region
+// without huge pages. They are unmapped from as, or with share stay mapped
+// copy-on-write in both. Returns NULL if the range can't be granted.
+vm_grant_t *vma_grant_take(address_space_t *as, uint64_t start, uint64_t length, int share);
+
+// Map grant as a new read/write anonymous region at *addr, or wherever there's
+// room if *addr is 0, and store where it went. The grant is consumed either
+// way. Returns 0 on success.
+int vma_grant_map(address_space_t *as, vm_grant_t *grant, uint64_t *addr);
+
+// Drop a grant nobody mapped, freeing its frames
+void vma_grant_free(vm_grant_t *grant);
+
+// Resolve a page fault at addr, returns 0 if the faulting access can be retried
+int vma_handle_fault(address_space_t *as, uint64_t addr, uint64_t error_code);
+
+#endif
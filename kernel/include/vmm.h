@@ -12,6 +12,8 @@
 #define PAGE_DIRTY (1ULL << 6)
 #define PAGE_HUGE (1ULL << 7)
 #define PAGE_GLOBAL (1ULL << 8)
+#define PAGE_UNOWNED (1ULL << 9) // Software bit: the frame isn't ours to free on teardown
+#define PAGE_COW (1ULL << 10) // Software bit: writable, but shared read-only until the first write
 #define PAGE_NO_EXECUTE (1ULL << 63)
 
 typedef struct
@@ -19,18 +21,52 @@ typedef struct
   uint64_t entries[512];
 } __attribute__((packed)) page_table_t;
 
+struct vm_region;
+struct async_ctx;
+
 typedef struct
 {
   page_table_t *pml4;
   uint64_t cr3_value;
+  uint16_t pcid; // Always 0 for the kernel address space or without PCID support
+  uint32_t tlb_stale; // CPUs whose next switch to this address space must flush its PCID
+  struct vm_region *regions; // User address ranges that can be demand paged
+  struct async_ctx *async; // Submission/completion rings set up by SYS_ASYNC_SETUP
 } address_space_t;
 
 void vmm_init(void);
+
+// Per-CPU paging setup (NX, global pages, PCIDs) for application processors
+void vmm_init_cpu(void);
+
+// Map device registers uncached into the kernel half, returns their address
+void *vmm_map_mmio(uint64_t phys, uint64_t size);
 address_space_t *vmm_create_address_space(void);
-void vmm_destroy_address_space(address_space_t *as);
+// Frees the user half's page tables and every frame it owns, returns the
+// number of pages given back
+uint64_t vmm_destroy_address_space(address_space_t *as);
+
+// New address space with the same regions and contents as parent. User
+// frames are shared copy-on-write, so only page tables get copied.
+address_space_t *vmm_clone_address_space(address_space_t *parent);
 int vmm_map_page(address_space_t *as, uint64_t virt, uint64_t phys, uint64_t flags);
 void vmm_unmap_page(address_space_t *as, uint64_t virt);
+
+// Map a physically contiguous range with a single walk per page table and
+// one TLB flush at the end. PAGE_HUGE maps it with 2 MiB pages, in which
+// case everything has to be 2 MiB aligned.
+int vmm_map_range(address_space_t *as, uint64_t virt, uint64_t phys, uint64_t length, uint64_t flags);
+
+// Unmap every page in the range, calling release (if any) with each old leaf
+// entry once its translation is gone from the TLB. Huge pages only partly
+// covered by the range stay mapped. Returns the number of 4 KiB pages
+// unmapped.
+uint64_t vmm_unmap_range(address_space_t *as, uint64_t virt, uint64_t length, void (*release)(uint64_t entry));
+
+// Leaf entry translating virt, or 0 if nothing maps it
+uint64_t vmm_get_mapping(address_space_t *as, uint64_t virt);
 void vmm_switch_address_space(address_space_t *as);
 address_space_t *vmm_get_kernel_address_space(void);
+address_space_t *vmm_get_current_address_space(void);
 
 #endif
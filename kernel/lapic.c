@@ -0,0 +1,96 @@
+#include "lapic.h"
+
+#include "cpu.h"
+#include "idt.h"
+#include "pit.h"
+#include "pmm.h"
+#include "serial.h"
+#include "vmm.h"
+
+#include <stddef.h>
+
+static volatile uint32_t *lapic = NULL;
+
+// Timer counts per PIT tick, every CPU's timer fires at the PIT's rate
+static uint32_t timer_count = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) { return lapic[reg / 4]; }
+
+static inline void lapic_write(uint32_t reg, uint32_t value) { lapic[reg / 4] = value; }
+
+static void lapic_enable(void)
+{
+  wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+  lapic_write(LAPIC_REG_TPR, 0);
+  lapic_write(LAPIC_REG_SPURIOUS, LAPIC_SPURIOUS_ENABLE | IRQ_SPURIOUS);
+}
+
+static void lapic_start_timer(void)
+{
+  lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  lapic_write(LAPIC_REG_LVT_TIMER, IRQ_LAPIC_TIMER | LAPIC_TIMER_PERIODIC);
+  lapic_write(LAPIC_REG_TIMER_INITIAL, timer_count);
+}
+
+// Let the timer count down over a few PIT ticks and see how far it got
+static uint32_t calibrate_timer(void)
+{
+  lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+
+  // Start right on a tick edge so only whole ticks are measured
+  uint64_t start = pit_get_ticks();
+  while (pit_get_ticks() == start)
+  {
+    __asm__ volatile("pause");
+  }
+
+  start = pit_get_ticks();
+  lapic_write(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+  while (pit_get_ticks() < start + LAPIC_CALIBRATION_TICKS)
+  {
+    __asm__ volatile("pause");
+  }
+
+  uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+  lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+
+  return elapsed / LAPIC_CALIBRATION_TICKS;
+}
+
+int lapic_init()
+{
+  uint64_t base = rdmsr(MSR_APIC_BASE) & 0x000FFFFFFFFFF000ULL;
+  lapic = vmm_map_mmio(base, PAGE_SIZE);
+  if (!lapic)
+  {
+    serial_print("LAPIC: Error: Failed to map registers!\n");
+    return -1;
+  }
+
+  lapic_enable();
+  timer_count = calibrate_timer();
+  if (timer_count == 0)
+  {
+    timer_count = 1;
+  }
+
+  serial_print("LAPIC: Timer runs ");
+  serial_print_dec(timer_count);
+  serial_print(" counts per tick at ");
+  serial_print_dec(pit_get_frequency());
+  serial_print(" Hz\n");
+
+  lapic_start_timer();
+  return 0;
+}
+
+void lapic_init_cpu()
+{
+  lapic_enable();
+  lapic_start_timer();
+}
+
+uint32_t lapic_id() { return lapic_read(LAPIC_REG_ID) >> 24; }
+
+void lapic_eoi() { lapic_write(LAPIC_REG_EOI, 0); }
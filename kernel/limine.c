@@ -25,6 +25,9 @@ __attribute__((used,
     section(".limine_requests"))) static volatile struct limine_executable_address_request executable_address_request
     = { .id = LIMINE_EXECUTABLE_ADDRESS_REQUEST_ID, .revision = 0, .response = NULL };
 
+__attribute__((used, section(".limine_requests"))) static volatile struct limine_mp_request mp_request
+    = { .id = LIMINE_MP_REQUEST_ID, .revision = 0, .response = NULL, .flags = 0 };
+
 __attribute__((used, section(".limine_requests"))) volatile struct limine_module_request module_request
     = { .id = LIMINE_MODULE_REQUEST_ID, .revision = 0, .response = NULL };
 
@@ -109,3 +112,4 @@ void limine_parse_info(void)
 
 struct limine_memmap_request limine_get_memmap_request() { return memmap_request; }
 struct limine_executable_address_request limine_get_executable_address_request() { return executable_address_request; }
+struct limine_mp_request limine_get_mp_request() { return mp_request; }
@@ -5,13 +5,22 @@
 #include "gdt.h"
 #include "idt.h"
 #include "kernel_limine.h"
+#include "lapic.h"
 #include "pit.h"
 #include "pmm.h"
 #include "serial.h"
+#include "slab.h"
+#include "smp.h"
 #include "syscall.h"
 #include "thread.h"
+#include "vma.h"
 #include "vmm.h"
 
+#define INIT_MAX_SIZE (256 * 1024)
+
+#define USER_STACK_TOP 0x00007FFFFFFFF000ULL
+#define USER_STACK_SIZE (64 * 1024)
+
 static void hcf(void)
 {
   for (;;)
@@ -101,6 +110,8 @@ void thread_sender()
 
 void kernel_main(void)
 {
+  // Per-CPU state lives behind GS, set it up before anything touches it
+  smp_init_bsp();
   serial_init();
 
   serial_print("PlasmaOS Kernel v0.1.0\n");
@@ -128,9 +139,15 @@ void kernel_main(void)
   serial_print("  - Initilizing PMM (Physical Memory Manager)...\n");
   pmm_init();
 
+  serial_print("  - Initializing slab allocator...\n");
+  slab_init();
+
   serial_print("  - Initializing VMM (Virtual Memory Manager)...\n");
   vmm_init();
 
+  serial_print("  - Initializing local APIC timer...\n");
+  lapic_init();
+
   serial_print("\nMemory Management Complete!\n");
   serial_print("  * Free memory: ");
   serial_print_dec(pmm_get_free_memory() / 1024 / 1024);
@@ -156,11 +173,28 @@ void kernel_main(void)
   serial_print("  Reallocated: ");
   serial_print_hex((uint64_t) page4);
   serial_print("\n");
+
+  void *huge = pmm_alloc_pages(PMM_HUGE_PAGE_ORDER);
+  serial_print("  Allocated 2 MiB block: ");
+  serial_print_hex((uint64_t) huge);
+  serial_print("\n");
+
+  if (!huge || ((uint64_t) huge & ((PAGE_SIZE << PMM_HUGE_PAGE_ORDER) - 1)))
+  {
+    serial_print("ERROR: 2 MiB block missing or misaligned!\n");
+    hcf();
+  }
+
+  pmm_free_pages(huge, PMM_HUGE_PAGE_ORDER);
+  serial_print("  Freed 2 MiB block\n");
   serial_print("Memory allocation test passed!\n\n");
 
   serial_print("\nInitializing threading subsystem...\n");
   thread_init();
 
+  serial_print("Starting page zeroing worker...\n");
+  thread_create(pmm_zero_worker);
+
   serial_print("Initializing syscall interface...\n");
   syscall_init();
   serial_print("Syscalls initialized\n\n");
@@ -175,7 +209,8 @@ void kernel_main(void)
   serial_print("\n");
 
   serial_print("Creating IPC test port...\n");
-  test_port = port_create();
+  // Our own reference, userspace could destroy it by ID
+  test_port = port_get(port_create());
 
   if (!test_port)
   {
@@ -191,11 +226,15 @@ void kernel_main(void)
   size_t init_size = 0;
   int loaded_from_disk = 0;
 
-  void *disk_buffer = pmm_alloc_page();
+  // Stays alive as long as init's code region maps it
+  int64_t file_size = ext2_file_size("init.bin");
+  void *disk_buffer = file_size > 0 && file_size <= INIT_MAX_SIZE ? kmalloc(file_size) : NULL;
   if (disk_buffer)
   {
-    int size = ext2_read_file("init.bin", disk_buffer, 8192); // Up to 8KB
-    if (size > 0)
+    // A short read would leave init running zero-filled pages, use the
+    // module instead
+    int size = ext2_read_file("init.bin", disk_buffer, (uint32_t) file_size);
+    if (size == file_size)
     {
       serial_print("  Loaded init.bin from disk (");
       serial_print_dec(size);
@@ -208,13 +247,12 @@ void kernel_main(void)
 
   if (!loaded_from_disk)
   {
+    kfree(disk_buffer);
+    disk_buffer = NULL;
+
     if (module_request.response == NULL || module_request.response->module_count == 0)
     {
       serial_print("ERROR: Could not load init from disk or modules!\n");
-      if (disk_buffer)
-      {
-        pmm_free_page(disk_buffer);
-      }
       hcf();
     }
 
@@ -231,79 +269,46 @@ void kernel_main(void)
   uint64_t user_code_virt = 0x0000000000400000ULL;
   size_t pages_needed = (init_size + 0xFFF) / 0x1000;
 
-  serial_print("  Allocating and mapping ");
-  serial_print_dec(pages_needed);
-  serial_print(" pages for user code...\n");
-
-  address_space_t *kernel_as = vmm_get_kernel_address_space();
-
-  for (size_t i = 0; i < pages_needed; i++)
+  address_space_t *user_as = vmm_create_address_space();
+  if (!user_as)
   {
-    void *phys = pmm_alloc_page();
-    if (!phys)
-    {
-      serial_print("ERROR: Failed to allocate page for user code!\n");
-      hcf();
-    }
-
-    int map_result = vmm_map_page(
-        kernel_as, user_code_virt + (i * 0x1000), (uint64_t) phys, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
-
-    if (map_result != 0)
-    {
-      serial_print("ERROR: Failed to map user code page!\n");
-      hcf();
-    }
-  }
-
-  for (size_t i = 0; i < pages_needed; i++)
-  {
-    uint8_t *src = (uint8_t *) init_data + (i * 0x1000);
-    uint8_t *dst = (uint8_t *) (user_code_virt + (i * 0x1000));
-
-    for (size_t j = 0; j < 0x1000 && (i * 0x1000 + j) < init_size; j++)
-    {
-      dst[j] = src[j];
-    }
+    serial_print("ERROR: Failed to create init address space!\n");
+    hcf();
   }
 
-  if (loaded_from_disk)
+  // Nothing is mapped up front, pages are faulted in from the image on first
+  // touch
+  vm_file_t *init_file = vm_file_create(init_data, init_size, loaded_from_disk);
+  if (!init_file
+      || !vma_create(user_as, user_code_virt, pages_needed * 0x1000, VM_REGION_FILE, VM_READ | VM_WRITE | VM_EXEC,
+          init_file, 0))
   {
-    pmm_free_page(disk_buffer);
+    serial_print("ERROR: Failed to create user code region!\n");
+    hcf();
   }
+  vm_file_put(init_file);
 
-  serial_print("  User code mapped successfully at ");
+  serial_print("  User code region at ");
   serial_print_hex(user_code_virt);
-  serial_print("\n");
-
-  serial_print("  Allocating user stack...\n");
-  void *user_stack_phys = pmm_alloc_page();
-  if (!user_stack_phys)
-  {
-    serial_print("ERROR: Failed to allocate user stack!\n");
-    hcf();
-  }
+  serial_print(" (");
+  serial_print_dec(pages_needed);
+  serial_print(" pages, demand paged)\n");
 
-  uint64_t user_stack_virt = 0x00007FFFFFFFE000ULL;
+  uint64_t user_stack_virt = USER_STACK_TOP - USER_STACK_SIZE;
 
-  serial_print("  Mapping user stack to virtual address: ");
+  serial_print("  Reserving user stack at virtual address: ");
   serial_print_hex(user_stack_virt);
   serial_print("\n");
 
-  int map_result
-      = vmm_map_page(kernel_as, user_stack_virt, (uint64_t) user_stack_phys, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
-
-  if (map_result != 0)
+  if (!vma_create(user_as, user_stack_virt, USER_STACK_SIZE, VM_REGION_STACK, VM_READ | VM_WRITE, NULL, 0))
   {
-    serial_print("ERROR: Failed to map user stack! Error: ");
-    serial_print_dec(map_result);
-    serial_print("\n");
+    serial_print("ERROR: Failed to create user stack region!\n");
     hcf();
   }
 
-  void *user_stack_top = (void *) (user_stack_virt + 0x1000);
+  void *user_stack_top = (void *) USER_STACK_TOP;
 
-  serial_print("  User stack mapped successfully\n");
+  serial_print("  User stack reserved successfully\n");
 
   serial_print("Creating userspace thread...\n");
   serial_print("  Entry point: ");
@@ -313,9 +318,15 @@ void kernel_main(void)
   serial_print_hex((uint64_t) user_stack_top);
   serial_print("\n");
 
-  thread_create_user((void *) user_code_virt, user_stack_top);
+  thread_create_user((void *) user_code_virt, user_stack_top, user_as);
   serial_print("Userspace thread created\n\n");
 
+  pmm_dump_stats();
+  kmem_print_stats();
+
+  serial_print("Starting application processors...\n");
+  smp_init();
+
   serial_print("Starting scheduler...\n\n");
   scheduler_start();
 
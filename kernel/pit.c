@@ -60,6 +60,8 @@ void pit_tick() { pit_ticks++; }
 
 uint64_t pit_get_ticks() { return pit_ticks; }
 
+uint32_t pit_get_frequency() { return pit_frequency; }
+
 void pit_sleep(uint32_t milliseconds)
 {
   uint64_t target = pit_ticks + (milliseconds * pit_frequency / 1000);
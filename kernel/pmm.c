@@ -1,27 +1,282 @@
 #include "pmm.h"
 
+#include "cpu.h"
 #include "kernel_limine.h"
+#include "pit.h"
 #include "serial.h"
+#include "spinlock.h"
+#include "thread.h"
 
 #include <limine.h>
 #include <stddef.h>
 
 extern uint64_t hhdm_offset;
 
-#define MAX_PAGES 1048576 // For now up to 4GB ram
+#define PMM_NO_FRAME 0xFFFFFFFF
+#define PMM_LOW_MEMORY_LIMIT 0x10000
+
+#define PMM_FRAME_FREE (1 << 0) // Frame heads a block on one of the free lists
+#define PMM_FRAME_ZEROED (1 << 1) // Frame contents are known to be zero
+#define PMM_FRAME_POOLED (1 << 2) // Frame sits in the pre-zeroed pool
+#define PMM_FRAME_CACHED (1 << 3) // Frame sits in a per-CPU magazine
+
+// Pre-zeroed pages kept aside by the background worker (4 MiB)
+#define PMM_ZERO_POOL_TARGET 1024
+#define PMM_ZERO_POOL_LOW (PMM_ZERO_POOL_TARGET * 3 / 4) // The sleeping worker is woken below this
+#define PMM_ZERO_BATCH 16
+
+#define PMM_MAX_EXTENTS 64
+
+// Per-CPU magazines move frames to and from the global pool in batches
+#define PMM_MAGAZINE_SIZE 64
+#define PMM_MAGAZINE_BATCH 32
+
+// One entry per physical frame. Only the first frame of a block (its head)
+// carries meaningful order/flags, the rest of the block is ignored.
+typedef struct
+{
+  uint32_t next; // Free list links, frame indices
+  uint32_t prev;
+  uint16_t refs; // Mappings sharing an allocated block (copy-on-write), on its first frame
+  uint8_t order;
+  uint8_t flags;
+  uint8_t owner; // pmm_owner_t of an allocated block, kept on its first frame
+} pmm_frame_t;
+
+typedef struct
+{
+  spinlock_t lock; // Only contended when another CPU drains this magazine
+  uint32_t dirty_count;
+  uint32_t zeroed_count;
+  uint32_t dirty[PMM_MAGAZINE_SIZE];
+  uint32_t zeroed[PMM_MAGAZINE_BATCH];
+
+  uint64_t alloc_hits;
+  uint64_t alloc_misses;
+  uint64_t free_hits;
+  uint64_t free_misses;
+  uint64_t refills;
+  uint64_t drains;
+
+  // Accounting for every allocation made on this CPU, not just order 0.
+  // Owner counts can go negative per CPU when blocks migrate, only the sum
+  // over all CPUs is meaningful.
+  uint64_t allocs;
+  uint64_t frees;
+  int64_t owner_pages[PMM_OWNER_COUNT];
+} __attribute__((aligned(64))) pmm_magazine_t;
+
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+static pmm_magazine_t magazines[MAX_CPUS];
+
+// Free memory that hasn't been carved into buddy blocks yet
+typedef struct
+{
+  uint64_t base;
+  uint64_t top;
+} pmm_extent_t;
+
+static pmm_extent_t extents[PMM_MAX_EXTENTS];
+static uint32_t extent_count = 0;
+static uint32_t extent_cursor = 0;
+static uint64_t uncarved_pages = 0;
+
+static pmm_frame_t *frames = NULL;
+static uint64_t *chunk_bitmap = NULL;
+static uint64_t frame_count = 0;
+
+static uint32_t free_lists[PMM_MAX_ORDER + 1];
+static uint64_t free_blocks[PMM_MAX_ORDER + 1];
+
+// Singly linked through pmm_frame_t.next, pages here are counted as free
+static uint32_t zero_pool = PMM_NO_FRAME;
+static uint64_t zero_pool_count = 0;
+
+// The zero worker, and whether it sleeps (or is about to) waiting for work
+static Thread *zero_worker = NULL;
+static uint32_t zero_worker_idle = 0;
 
-static uint64_t page_stack[MAX_PAGES];
-static uint64_t page_stack_top = 0;
 static uint64_t total_pages = 0;
 static uint64_t free_pages = 0;
-static uint64_t kernel_end = 0;
+static uint64_t peak_used_pages = 0;
+
+// Previous pmm_get_stats() sample, for the allocation rates
+static uint64_t sample_ticks = 0;
+static uint64_t sample_allocs = 0;
+static uint64_t sample_frees = 0;
+
+static const char *owner_names[PMM_OWNER_COUNT] = {
+  "kernel",
+  "page tables",
+  "heap",
+  "ext2",
+  "user",
+  "kernel stacks",
+};
 
 static inline uint64_t align_up(uint64_t addr, uint64_t align) { return (addr + align - 1) & ~(align - 1); }
 
 static inline uint64_t align_down(uint64_t addr, uint64_t align) { return addr & ~(align - 1); }
 
+static void free_list_push(uint32_t index, uint32_t order)
+{
+  pmm_frame_t *frame = &frames[index];
+  frame->order = order;
+  frame->flags |= PMM_FRAME_FREE;
+  frame->prev = PMM_NO_FRAME;
+  frame->next = free_lists[order];
+
+  if (free_lists[order] != PMM_NO_FRAME)
+  {
+    frames[free_lists[order]].prev = index;
+  }
+
+  free_lists[order] = index;
+  free_blocks[order]++;
+}
+
+static void free_list_remove(uint32_t index, uint32_t order)
+{
+  pmm_frame_t *frame = &frames[index];
+
+  if (frame->prev != PMM_NO_FRAME)
+  {
+    frames[frame->prev].next = frame->next;
+  } else
+  {
+    free_lists[order] = frame->next;
+  }
+
+  if (frame->next != PMM_NO_FRAME)
+  {
+    frames[frame->next].prev = frame->prev;
+  }
+
+  frame->flags &= ~PMM_FRAME_FREE;
+  frame->next = PMM_NO_FRAME;
+  frame->prev = PMM_NO_FRAME;
+  free_blocks[order]--;
+}
+
+// Return a block to the free lists, merging with its buddy for as long as the
+// buddy is itself a free block of the same order.
+static void buddy_free(uint32_t index, uint32_t order)
+{
+  while (order < PMM_MAX_ORDER)
+  {
+    uint32_t buddy = index ^ (1U << order);
+    if (buddy >= frame_count)
+    {
+      break;
+    }
+
+    pmm_frame_t *buddy_frame = &frames[buddy];
+    if (!(buddy_frame->flags & PMM_FRAME_FREE) || buddy_frame->order != order)
+    {
+      break;
+    }
+
+    free_list_remove(buddy, order);
+    index &= ~(1U << order);
+    order++;
+  }
+
+  free_list_push(index, order);
+}
+
+// The frame database is initialized one chunk (a max-order block worth of
+// frames) at a time, the first time anything inside the chunk is carved.
+// Buddies never cross a chunk, so merging only ever looks at initialized
+// entries.
+static inline int chunk_ready(uint64_t index)
+{
+  uint64_t chunk = index >> PMM_MAX_ORDER;
+  return (chunk_bitmap[chunk / 64] >> (chunk % 64)) & 1;
+}
+
+static void chunk_init(uint64_t index)
+{
+  uint64_t chunk = index >> PMM_MAX_ORDER;
+  if (chunk_ready(index))
+  {
+    return;
+  }
+
+  uint64_t first = chunk << PMM_MAX_ORDER;
+  uint64_t last = first + (1ULL << PMM_MAX_ORDER);
+  if (last > frame_count)
+  {
+    last = frame_count;
+  }
+
+  for (uint64_t i = first; i < last; i++)
+  {
+    frames[i].next = PMM_NO_FRAME;
+    frames[i].prev = PMM_NO_FRAME;
+    frames[i].order = 0;
+    frames[i].flags = 0;
+    frames[i].owner = PMM_OWNER_KERNEL;
+  }
+
+  chunk_bitmap[chunk / 64] |= 1ULL << (chunk % 64);
+}
+
+// Move the next naturally aligned block out of the uncarved extents and onto
+// the buddy free lists. Returns 0 once every extent has been used up.
+static int carve_block(void)
+{
+  while (extent_cursor < extent_count && extents[extent_cursor].base >= extents[extent_cursor].top)
+  {
+    extent_cursor++;
+  }
+
+  if (extent_cursor >= extent_count)
+  {
+    return 0;
+  }
+
+  pmm_extent_t *extent = &extents[extent_cursor];
+  uint64_t index = extent->base / PAGE_SIZE;
+  uint64_t end = extent->top / PAGE_SIZE;
+
+  uint32_t order = PMM_MAX_ORDER;
+  while (order > 0 && ((index & ((1ULL << order) - 1)) != 0 || index + (1ULL << order) > end))
+  {
+    order--;
+  }
+
+  chunk_init(index);
+  buddy_free((uint32_t) index, order);
+
+  extent->base += (uint64_t) PAGE_SIZE << order;
+  uncarved_pages -= 1ULL << order;
+  return 1;
+}
+
+static void add_extent(uint64_t base, uint64_t top)
+{
+  if (extent_count == PMM_MAX_EXTENTS)
+  {
+    serial_print("PMM: Warning: Too many memory regions, ignoring ");
+    serial_print_dec((top - base) / 1024);
+    serial_print(" KB\n");
+    return;
+  }
+
+  extents[extent_count].base = base;
+  extents[extent_count].top = top;
+  extent_count++;
+
+  uint64_t pages = (top - base) / PAGE_SIZE;
+  total_pages += pages;
+  free_pages += pages;
+  uncarved_pages += pages;
+}
+
 void pmm_init()
 {
+  uint64_t start_tsc = rdtsc();
+
   serial_print("PMM: Initializing physical memory manager...\n");
 
   struct limine_memmap_request request = limine_get_memmap_request();
@@ -37,11 +292,22 @@ void pmm_init()
   serial_print_dec(memmap->entry_count);
   serial_print(" memory regions\n");
 
-  page_stack_top = 0;
   total_pages = 0;
   free_pages = 0;
+  uncarved_pages = 0;
+  extent_count = 0;
+  extent_cursor = 0;
+  zero_pool = PMM_NO_FRAME;
+  zero_pool_count = 0;
+
+  for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
+  {
+    free_lists[order] = PMM_NO_FRAME;
+    free_blocks[order] = 0;
+  }
 
   uint64_t total_usable = 0;
+  uint64_t highest_usable = 0;
   for (uint64_t i = 0; i < memmap->entry_count; i++)
   {
     struct limine_memmap_entry *entry = memmap->entries[i];
@@ -49,6 +315,12 @@ void pmm_init()
     if (entry->type == LIMINE_MEMMAP_USABLE)
     {
       total_usable += entry->length;
+
+      uint64_t top = align_down(entry->base + entry->length, PAGE_SIZE);
+      if (top > highest_usable)
+      {
+        highest_usable = top;
+      }
     }
   }
 
@@ -56,6 +328,20 @@ void pmm_init()
   serial_print_dec(total_usable / 1024 / 1024);
   serial_print(" MB\n");
 
+  frame_count = highest_usable / PAGE_SIZE;
+  if (frame_count > PMM_NO_FRAME)
+  {
+    serial_print("PMM: Warning: Clamping frame database to 16 TB\n");
+    frame_count = PMM_NO_FRAME;
+  }
+
+  // The chunk bitmap and frame database live at the start of the first
+  // usable region that can hold them, and those frames are never handed out.
+  // Only the bitmap is cleared here, frame entries are set up lazily.
+  uint64_t chunk_count = (frame_count + (1ULL << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER;
+  uint64_t bitmap_size = align_up((chunk_count + 63) / 64 * sizeof(uint64_t), sizeof(pmm_frame_t));
+  uint64_t frames_size = align_up(bitmap_size + frame_count * sizeof(pmm_frame_t), PAGE_SIZE);
+  uint64_t frames_phys = 0;
   for (uint64_t i = 0; i < memmap->entry_count; i++)
   {
     struct limine_memmap_entry *entry = memmap->entries[i];
@@ -66,59 +352,567 @@ void pmm_init()
     }
 
     uint64_t base = align_up(entry->base, PAGE_SIZE);
+    if (base < PMM_LOW_MEMORY_LIMIT)
+    {
+      base = PMM_LOW_MEMORY_LIMIT;
+    }
+
     uint64_t top = align_down(entry->base + entry->length, PAGE_SIZE);
+    if (base < top && top - base >= frames_size)
+    {
+      frames_phys = base;
+      break;
+    }
+  }
 
-    if (base >= top)
+  if (!frames_phys)
+  {
+    serial_print("PMM: Error: No region large enough for the frame database!\n");
+    return;
+  }
+
+  chunk_bitmap = (uint64_t *) (frames_phys + hhdm_offset);
+  for (uint64_t i = 0; i < bitmap_size / sizeof(uint64_t); i++)
+  {
+    chunk_bitmap[i] = 0;
+  }
+  frames = (pmm_frame_t *) (frames_phys + hhdm_offset + bitmap_size);
+
+  serial_print("PMM: Frame database at ");
+  serial_print_hex(frames_phys);
+  serial_print(" (");
+  serial_print_dec(frames_size / 1024);
+  serial_print(" KB)\n");
+
+  for (uint64_t i = 0; i < memmap->entry_count; i++)
+  {
+    struct limine_memmap_entry *entry = memmap->entries[i];
+
+    if (entry->type != LIMINE_MEMMAP_USABLE)
     {
       continue;
     }
 
-    for (uint64_t addr = base; addr < top; addr += PAGE_SIZE)
+    uint64_t base = align_up(entry->base, PAGE_SIZE);
+    uint64_t top = align_down(entry->base + entry->length, PAGE_SIZE);
+
+    if (base < PMM_LOW_MEMORY_LIMIT)
     {
-      if (addr < 0x10000)
-      {
-        continue;
-      }
+      base = PMM_LOW_MEMORY_LIMIT;
+    }
 
-      if (page_stack_top >= MAX_PAGES)
+    if (top > frame_count * PAGE_SIZE)
+    {
+      top = frame_count * PAGE_SIZE;
+    }
+
+    if (base >= top)
+    {
+      continue;
+    }
+
+    if (frames_phys >= base && frames_phys < top)
+    {
+      if (frames_phys > base)
       {
-        serial_print("PMM: Warning: Page stack full!\n");
-        break;
+        add_extent(base, frames_phys);
       }
+      base = frames_phys + frames_size;
+    }
 
-      page_stack[page_stack_top++] = addr;
-      total_pages++;
-      free_pages++;
+    if (base < top)
+    {
+      add_extent(base, top);
     }
   }
 
+  uint64_t elapsed = rdtsc() - start_tsc;
+
   serial_print("PMM: Initialized with ");
   serial_print_dec(total_pages);
-  serial_print(" pages (\n");
+  serial_print(" pages (");
   serial_print_dec((total_pages * PAGE_SIZE) / 1024 / 1024);
-  serial_print(" MB)\n");
+  serial_print(" MB) in ");
+  serial_print_dec(extent_count);
+  serial_print(" extents\n");
+  serial_print("PMM: Bootstrap took ");
+  serial_print_dec(elapsed);
+  serial_print(" TSC cycles\n");
 }
 
-void *pmm_alloc_page()
+static void *buddy_alloc(uint32_t order)
 {
-  if (page_stack_top == 0)
+  uint32_t current = order;
+  while (current <= PMM_MAX_ORDER && free_lists[current] == PMM_NO_FRAME)
+  {
+    current++;
+
+    // Nothing big enough on the free lists yet, carve more from the extents
+    if (current > PMM_MAX_ORDER && carve_block())
+    {
+      current = order;
+    }
+  }
+
+  if (current > PMM_MAX_ORDER)
   {
-    serial_print("PMM: Error: Out of memory!\n");
     return NULL;
   }
 
+  uint32_t index = free_lists[current];
+  free_list_remove(index, current);
+
+  // Split the block down, returning the upper halves to the free lists
+  while (current > order)
+  {
+    current--;
+    free_list_push(index + (1U << current), current);
+  }
+
+  frames[index].order = order;
+  free_pages -= 1ULL << order;
+
+  if (total_pages - free_pages > peak_used_pages)
+  {
+    peak_used_pages = total_pages - free_pages;
+  }
+
+  return (void *) ((uint64_t) index * PAGE_SIZE);
+}
+
+static inline void zero_page(void *page)
+{
+  void *dst = (void *) ((uint64_t) page + hhdm_offset);
+  uint64_t count = PAGE_SIZE / 8;
+  __asm__ volatile("rep stosq" : "+D"(dst), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+// Zero a page with non-temporal stores so background zeroing doesn't evict
+// the working set of whatever runs next. Callers must sfence before handing
+// the page out.
+static inline void zero_page_nontemporal(void *page)
+{
+  uint64_t *dst = (uint64_t *) ((uint64_t) page + hhdm_offset);
+  for (int i = 0; i < PAGE_SIZE / 8; i += 4)
+  {
+    __asm__ volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+        :
+        : "r"(&dst[i]), "r"(0ULL)
+        : "memory");
+  }
+}
+
+// The zero pool and the buddy lists below are global and need pmm_lock
+
+// Wake the zero worker if it sleeps and the pool has room again. Called
+// whenever the pool shrinks or frames go back to the buddy lists.
+static void zero_worker_kick(void)
+{
+  if (zero_pool_count < PMM_ZERO_POOL_LOW && __atomic_load_n(&zero_worker_idle, __ATOMIC_SEQ_CST)
+      && __atomic_exchange_n(&zero_worker_idle, 0, __ATOMIC_SEQ_CST))
+  {
+    thread_unpark(zero_worker);
+  }
+}
+
+static uint32_t zero_pool_pop(void)
+{
+  if (zero_pool == PMM_NO_FRAME)
+  {
+    return PMM_NO_FRAME;
+  }
+
+  uint32_t index = zero_pool;
+  zero_pool = frames[index].next;
+  zero_pool_count--;
+
+  frames[index].flags &= ~PMM_FRAME_POOLED;
+  frames[index].next = PMM_NO_FRAME;
+  frames[index].order = 0;
   free_pages--;
-  uint64_t page = page_stack[--page_stack_top];
+  zero_worker_kick();
+
+  return index;
+}
+
+static void zero_pool_push(uint32_t index)
+{
+  frames[index].flags |= PMM_FRAME_POOLED | PMM_FRAME_ZEROED;
+  frames[index].next = zero_pool;
+  zero_pool = index;
+  zero_pool_count++;
+  free_pages++;
+}
+
+// Give every pooled page back to the buddy allocator so it can be merged
+// into larger blocks again. The zero worker is left asleep, it would only
+// split them up again.
+static void zero_pool_drain(void)
+{
+  while (zero_pool != PMM_NO_FRAME)
+  {
+    uint32_t index = zero_pool;
+    zero_pool = frames[index].next;
+    zero_pool_count--;
+
+    frames[index].flags &= ~(PMM_FRAME_POOLED | PMM_FRAME_ZEROED);
+    frames[index].next = PMM_NO_FRAME;
+    buddy_free(index, 0);
+  }
+}
+
+// Take one frame for a magazine, preferring pre-zeroed frames when the caller
+// is about to need one and plain buddy frames otherwise.
+static uint32_t global_take(int want_zeroed)
+{
+  uint32_t index = PMM_NO_FRAME;
+
+  if (want_zeroed)
+  {
+    index = zero_pool_pop();
+  }
+
+  if (index == PMM_NO_FRAME)
+  {
+    void *page = buddy_alloc(0);
+    if (page)
+    {
+      index = (uint32_t) ((uint64_t) page / PAGE_SIZE);
+    }
+  }
+
+  if (index == PMM_NO_FRAME && !want_zeroed)
+  {
+    index = zero_pool_pop();
+  }
+
+  return index;
+}
+
+static void global_put(uint32_t index)
+{
+  if ((frames[index].flags & PMM_FRAME_ZEROED) && zero_pool_count < PMM_ZERO_POOL_TARGET)
+  {
+    zero_pool_push(index);
+    return;
+  }
+
+  frames[index].flags &= ~PMM_FRAME_ZEROED;
+  buddy_free(index, 0);
+  free_pages++;
+  zero_worker_kick();
+}
+
+// Magazines are only used by their own CPU with interrupts disabled and
+// mag->lock held. Nothing else takes that lock except magazine_drain_all(),
+// so the fast paths below never wait on it.
+
+static void magazine_push(pmm_magazine_t *mag, uint32_t index)
+{
+  frames[index].flags |= PMM_FRAME_CACHED;
+
+  if ((frames[index].flags & PMM_FRAME_ZEROED) && mag->zeroed_count < PMM_MAGAZINE_BATCH)
+  {
+    mag->zeroed[mag->zeroed_count++] = index;
+  } else
+  {
+    frames[index].flags &= ~PMM_FRAME_ZEROED;
+    mag->dirty[mag->dirty_count++] = index;
+  }
+}
+
+static void magazine_refill(pmm_magazine_t *mag, int want_zeroed)
+{
+  spin_lock(&pmm_lock);
+
+  for (int i = 0; i < PMM_MAGAZINE_BATCH; i++)
+  {
+    uint32_t index = global_take(want_zeroed);
+    if (index == PMM_NO_FRAME)
+    {
+      break;
+    }
+
+    magazine_push(mag, index);
+  }
+
+  mag->refills++;
+  spin_unlock(&pmm_lock);
+}
+
+// Hand the oldest dirty frames back, keeping the most recently freed (and so
+// most likely cache-hot) ones at the top of the stack.
+static void magazine_drain(pmm_magazine_t *mag, uint32_t keep)
+{
+  uint32_t drain = mag->dirty_count > keep ? mag->dirty_count - keep : 0;
+
+  spin_lock(&pmm_lock);
+
+  for (uint32_t i = 0; i < drain; i++)
+  {
+    uint32_t index = mag->dirty[i];
+    frames[index].flags &= ~PMM_FRAME_CACHED;
+    global_put(index);
+  }
+
+  if (keep == 0)
+  {
+    for (uint32_t i = 0; i < mag->zeroed_count; i++)
+    {
+      uint32_t index = mag->zeroed[i];
+      frames[index].flags &= ~PMM_FRAME_CACHED;
+      global_put(index);
+    }
+    mag->zeroed_count = 0;
+  }
+
+  mag->drains++;
+  spin_unlock(&pmm_lock);
+
+  for (uint32_t i = drain; i < mag->dirty_count; i++)
+  {
+    mag->dirty[i - drain] = mag->dirty[i];
+  }
+  mag->dirty_count -= drain;
+}
+
+// Hand back every frame cached on any CPU, straight to the buddy lists so
+// they can merge. Only for the high-order slow path.
+static void magazine_drain_all(void)
+{
+  for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+  {
+    pmm_magazine_t *mag = &magazines[cpu];
+    spin_lock(&mag->lock);
+    spin_lock(&pmm_lock);
+
+    for (uint32_t i = 0; i < mag->dirty_count + mag->zeroed_count; i++)
+    {
+      uint32_t index = i < mag->dirty_count ? mag->dirty[i] : mag->zeroed[i - mag->dirty_count];
+      frames[index].flags &= ~(PMM_FRAME_CACHED | PMM_FRAME_ZEROED);
+      buddy_free(index, 0);
+      free_pages++;
+    }
 
-  uint8_t *ptr = (uint8_t *) (page + hhdm_offset);
-  for (int i = 0; i < PAGE_SIZE; i++)
+    if (mag->dirty_count + mag->zeroed_count)
+    {
+      mag->drains++;
+    }
+    mag->dirty_count = 0;
+    mag->zeroed_count = 0;
+
+    spin_unlock(&pmm_lock);
+    spin_unlock(&mag->lock);
+  }
+}
+
+static uint32_t magazine_pop(pmm_magazine_t *mag, int want_zeroed, int *zeroed)
+{
+  uint32_t index;
+
+  if (want_zeroed && mag->zeroed_count)
   {
-    ptr[i] = 0;
+    index = mag->zeroed[--mag->zeroed_count];
+  } else if (mag->dirty_count)
+  {
+    index = mag->dirty[--mag->dirty_count];
+  } else if (mag->zeroed_count)
+  {
+    index = mag->zeroed[--mag->zeroed_count];
+  } else
+  {
+    return PMM_NO_FRAME;
   }
 
-  return (void *) page;
+  *zeroed = (frames[index].flags & PMM_FRAME_ZEROED) != 0;
+  frames[index].flags = 0;
+  frames[index].order = 0;
+  return index;
+}
+
+// Charge or credit a block to the current CPU's counters, interrupts must be
+// disabled.
+static void account_alloc(uint32_t index, uint32_t order)
+{
+  pmm_magazine_t *mag = &magazines[cpu_current_id()];
+  frames[index].owner = PMM_OWNER_KERNEL;
+  frames[index].refs = 1;
+  mag->owner_pages[PMM_OWNER_KERNEL] += 1LL << order;
+  mag->allocs++;
+}
+
+static void account_free(uint32_t index, uint32_t order)
+{
+  pmm_magazine_t *mag = &magazines[cpu_current_id()];
+  mag->owner_pages[frames[index].owner] -= 1LL << order;
+  frames[index].owner = PMM_OWNER_KERNEL;
+  mag->frees++;
 }
 
+static void *alloc_order0(int want_zeroed)
+{
+  uint64_t flags = irq_save();
+  pmm_magazine_t *mag = &magazines[cpu_current_id()];
+  spin_lock(&mag->lock);
+
+  int zeroed = 0;
+  uint32_t index = magazine_pop(mag, want_zeroed, &zeroed);
+  if (index != PMM_NO_FRAME)
+  {
+    mag->alloc_hits++;
+  } else
+  {
+    mag->alloc_misses++;
+    magazine_refill(mag, want_zeroed);
+    index = magazine_pop(mag, want_zeroed, &zeroed);
+  }
+
+  if (index != PMM_NO_FRAME)
+  {
+    account_alloc(index, 0);
+  }
+
+  spin_unlock(&mag->lock);
+  irq_restore(flags);
+
+  if (index == PMM_NO_FRAME)
+  {
+    serial_print("PMM: Error: Out of memory!\n");
+    return NULL;
+  }
+
+  void *page = (void *) ((uint64_t) index * PAGE_SIZE);
+  if (want_zeroed && !zeroed)
+  {
+    zero_page(page);
+  }
+
+  return page;
+}
+
+// Validate a block handed back by a caller, returning its frame index or
+// PMM_NO_FRAME if it must not be freed.
+static uint32_t check_free(void *addr, uint32_t order)
+{
+  uint64_t phys = (uint64_t) addr;
+  uint64_t index = phys / PAGE_SIZE;
+
+  if (order > PMM_MAX_ORDER || (phys & (PAGE_SIZE - 1)) || (index & ((1ULL << order) - 1)))
+  {
+    serial_print("PMM: Error: Misaligned free of ");
+    serial_print_hex(phys);
+    serial_print("\n");
+    return PMM_NO_FRAME;
+  }
+
+  if (index + (1ULL << order) > frame_count || !chunk_ready(index))
+  {
+    serial_print("PMM: Error: Free of unmanaged memory ");
+    serial_print_hex(phys);
+    serial_print("\n");
+    return PMM_NO_FRAME;
+  }
+
+  if (frames[index].flags & (PMM_FRAME_FREE | PMM_FRAME_POOLED | PMM_FRAME_CACHED))
+  {
+    serial_print("PMM: Error: Double free of ");
+    serial_print_hex(phys);
+    serial_print("\n");
+    return PMM_NO_FRAME;
+  }
+
+  return (uint32_t) index;
+}
+
+// Drop one reference to a block, returns nonzero if it was the last one and
+// the block really goes back
+static int drop_ref(uint32_t index)
+{
+  if (__atomic_load_n(&frames[index].refs, __ATOMIC_ACQUIRE) <= 1)
+  {
+    return 1;
+  }
+  return __atomic_sub_fetch(&frames[index].refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+void *pmm_alloc_pages(uint32_t order)
+{
+  if (order > PMM_MAX_ORDER)
+  {
+    serial_print("PMM: Error: Invalid allocation order!\n");
+    return NULL;
+  }
+
+  if (order == 0)
+  {
+    return alloc_order0(0);
+  }
+
+  uint64_t flags = spin_lock_irqsave(&pmm_lock);
+  void *block = buddy_alloc(order);
+  spin_unlock(&pmm_lock);
+
+  if (!block)
+  {
+    // Frames cached on any CPU may be all that keeps buddies from merging
+    magazine_drain_all();
+    spin_lock(&pmm_lock);
+    zero_pool_drain();
+    block = buddy_alloc(order);
+    spin_unlock(&pmm_lock);
+  }
+
+  if (block)
+  {
+    account_alloc((uint32_t) ((uint64_t) block / PAGE_SIZE), order);
+  }
+
+  irq_restore(flags);
+
+  if (!block)
+  {
+    serial_print("PMM: Error: Out of memory!\n");
+    return NULL;
+  }
+
+  return block;
+}
+
+void pmm_free_pages(void *addr, uint32_t order)
+{
+  if (!addr)
+  {
+    return;
+  }
+
+  if (order == 0)
+  {
+    pmm_free_page(addr);
+    return;
+  }
+
+  uint32_t index = check_free(addr, order);
+  if (index == PMM_NO_FRAME || !drop_ref(index))
+  {
+    return;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&pmm_lock);
+  account_free(index, order);
+  frames[index].flags = 0;
+  buddy_free(index, order);
+  free_pages += 1ULL << order;
+  zero_worker_kick();
+  spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void *pmm_alloc_page() { return alloc_order0(1); }
+
+void *pmm_alloc_page_nozero() { return alloc_order0(0); }
+
 void pmm_free_page(void *page)
 {
   if (!page)
@@ -126,18 +920,405 @@ void pmm_free_page(void *page)
     return;
   }
 
-  if (page_stack_top >= MAX_PAGES)
+  uint32_t index = check_free(page, 0);
+  if (index == PMM_NO_FRAME || !drop_ref(index))
   {
-    serial_print("PMM: Error: Page stack overflow on free!\n");
     return;
   }
 
-  page_stack[page_stack_top++] = (uint64_t) page;
-  free_pages++;
+  uint64_t flags = irq_save();
+  pmm_magazine_t *mag = &magazines[cpu_current_id()];
+  spin_lock(&mag->lock);
+
+  if (mag->dirty_count == PMM_MAGAZINE_SIZE)
+  {
+    mag->free_misses++;
+    magazine_drain(mag, PMM_MAGAZINE_SIZE - PMM_MAGAZINE_BATCH);
+  } else
+  {
+    mag->free_hits++;
+  }
+
+  account_free(index, 0);
+  frames[index].flags = 0;
+  magazine_push(mag, index);
+
+  spin_unlock(&mag->lock);
+  irq_restore(flags);
+}
+
+void pmm_free_page_batch(void *const *pages, uint32_t count)
+{
+  uint64_t flags = irq_save();
+  pmm_magazine_t *mag = &magazines[cpu_current_id()];
+  spin_lock(&mag->lock);
+  uint32_t i = 0;
+
+  // Whatever fits goes into the magazine, the rest straight to the buddy
+  // lists under one lock
+  for (; i < count && mag->dirty_count < PMM_MAGAZINE_SIZE; i++)
+  {
+    uint32_t index = check_free(pages[i], 0);
+    if (index == PMM_NO_FRAME || !drop_ref(index))
+    {
+      continue;
+    }
+
+    account_free(index, 0);
+    frames[index].flags = 0;
+    magazine_push(mag, index);
+    mag->free_hits++;
+  }
+
+  if (i < count)
+  {
+    spin_lock(&pmm_lock);
+    for (; i < count; i++)
+    {
+      uint32_t index = check_free(pages[i], 0);
+      if (index == PMM_NO_FRAME || !drop_ref(index))
+      {
+        continue;
+      }
+
+      account_free(index, 0);
+      frames[index].flags = 0;
+      global_put(index);
+      mag->free_misses++;
+    }
+    spin_unlock(&pmm_lock);
+  }
+
+  spin_unlock(&mag->lock);
+  irq_restore(flags);
+}
+
+uint32_t pmm_zero_pool_refill(uint32_t max_pages)
+{
+  uint32_t batch[PMM_ZERO_BATCH];
+  uint32_t count = 0;
+
+  if (max_pages > PMM_ZERO_BATCH)
+  {
+    max_pages = PMM_ZERO_BATCH;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&pmm_lock);
+  while (count < max_pages && zero_pool_count + count < PMM_ZERO_POOL_TARGET)
+  {
+    void *page = buddy_alloc(0);
+    if (!page)
+    {
+      break;
+    }
+    batch[count++] = (uint32_t) ((uint64_t) page / PAGE_SIZE);
+  }
+  spin_unlock_irqrestore(&pmm_lock, flags);
+
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  // Zero outside the lock, the pages are invisible to everyone else meanwhile
+  for (uint32_t i = 0; i < count; i++)
+  {
+    zero_page_nontemporal((void *) ((uint64_t) batch[i] * PAGE_SIZE));
+  }
+  __asm__ volatile("sfence" : : : "memory");
+
+  flags = spin_lock_irqsave(&pmm_lock);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    zero_pool_push(batch[i]);
+  }
+  spin_unlock_irqrestore(&pmm_lock, flags);
+
+  return count;
+}
+
+void pmm_zero_worker()
+{
+  // Zeroing ahead of time only pays off when nothing else wants the CPU
+  thread_set_priority(THREAD_CLASS_BACKGROUND, 0);
+  zero_worker = thread_current();
+
+  for (;;)
+  {
+    if (pmm_zero_pool_refill(PMM_ZERO_BATCH))
+    {
+      thread_yield();
+      continue;
+    }
+
+    // The pool is full or there's nothing free to zero. Announce the sleep
+    // before looking once more, so an allocation or free that slips in
+    // between either gets seen here or unparks us.
+    __atomic_store_n(&zero_worker_idle, 1, __ATOMIC_SEQ_CST);
+    if (pmm_zero_pool_refill(PMM_ZERO_BATCH))
+    {
+      __atomic_store_n(&zero_worker_idle, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    thread_park();
+  }
+}
+
+void pmm_print_magazine_stats()
+{
+  for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+  {
+    pmm_magazine_t *mag = &magazines[cpu];
+    uint64_t allocs = mag->alloc_hits + mag->alloc_misses;
+    uint64_t frees = mag->free_hits + mag->free_misses;
+
+    if (allocs == 0 && frees == 0)
+    {
+      continue;
+    }
+
+    serial_print("PMM: CPU ");
+    serial_print_dec(cpu);
+    serial_print(" magazine: alloc hits ");
+    serial_print_dec(mag->alloc_hits);
+    serial_print("/");
+    serial_print_dec(allocs);
+    serial_print(" (");
+    serial_print_dec(allocs ? mag->alloc_hits * 100 / allocs : 0);
+    serial_print("%), free hits ");
+    serial_print_dec(mag->free_hits);
+    serial_print("/");
+    serial_print_dec(frees);
+    serial_print(" (");
+    serial_print_dec(frees ? mag->free_hits * 100 / frees : 0);
+    serial_print("%), ");
+    serial_print_dec(mag->refills);
+    serial_print(" refills, ");
+    serial_print_dec(mag->drains);
+    serial_print(" drains\n");
+  }
 }
 
 uint64_t pmm_get_total_memory() { return total_pages * PAGE_SIZE; }
 
-uint64_t pmm_get_free_memory() { return free_pages * PAGE_SIZE; }
+static uint64_t cached_pages(void)
+{
+  uint64_t cached = 0;
+  for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+  {
+    cached += magazines[cpu].dirty_count + magazines[cpu].zeroed_count;
+  }
+  return cached;
+}
+
+uint64_t pmm_get_free_memory() { return (free_pages + cached_pages()) * PAGE_SIZE; }
 
-uint64_t pmm_get_used_memory() { return (total_pages - free_pages) * PAGE_SIZE; }
+uint64_t pmm_get_used_memory() { return (total_pages - free_pages - cached_pages()) * PAGE_SIZE; }
+
+void pmm_split_pages(void *addr, uint32_t order)
+{
+  uint64_t index = (uint64_t) addr / PAGE_SIZE;
+  if (!addr || order == 0 || order > PMM_MAX_ORDER || index + (1ULL << order) > frame_count || !chunk_ready(index))
+  {
+    return;
+  }
+
+  // The owner charge already covers every page, it just moves onto each one
+  for (uint64_t i = index; i < index + (1ULL << order); i++)
+  {
+    frames[i].order = 0;
+    frames[i].flags = 0;
+    frames[i].owner = frames[index].owner;
+    frames[i].refs = 1;
+  }
+}
+
+int pmm_ref_pages(void *addr)
+{
+  uint64_t index = (uint64_t) addr / PAGE_SIZE;
+  if (!addr || index >= frame_count || !chunk_ready(index)
+      || (frames[index].flags & (PMM_FRAME_FREE | PMM_FRAME_POOLED | PMM_FRAME_CACHED)))
+  {
+    return -1;
+  }
+
+  uint16_t refs = __atomic_load_n(&frames[index].refs, __ATOMIC_RELAXED);
+  do
+  {
+    if (refs == UINT16_MAX)
+    {
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&frames[index].refs, &refs, refs + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  return 0;
+}
+
+uint32_t pmm_page_refs(void *addr)
+{
+  uint64_t index = (uint64_t) addr / PAGE_SIZE;
+  if (!addr || index >= frame_count || !chunk_ready(index))
+  {
+    return 0;
+  }
+  return __atomic_load_n(&frames[index].refs, __ATOMIC_ACQUIRE);
+}
+
+void pmm_set_owner(void *addr, pmm_owner_t owner)
+{
+  uint64_t index = (uint64_t) addr / PAGE_SIZE;
+  if (!addr || owner >= PMM_OWNER_COUNT || index >= frame_count || !chunk_ready(index)
+      || (frames[index].flags & (PMM_FRAME_FREE | PMM_FRAME_POOLED | PMM_FRAME_CACHED)))
+  {
+    return;
+  }
+
+  uint64_t flags = irq_save();
+  pmm_magazine_t *mag = &magazines[cpu_current_id()];
+  int64_t pages = 1LL << frames[index].order;
+  mag->owner_pages[frames[index].owner] -= pages;
+  mag->owner_pages[owner] += pages;
+  frames[index].owner = owner;
+  irq_restore(flags);
+}
+
+// Count the blocks carve_block() would cut the remaining extents into
+static void count_uncarved_blocks(uint64_t *blocks)
+{
+  for (uint32_t i = extent_cursor; i < extent_count; i++)
+  {
+    uint64_t index = extents[i].base / PAGE_SIZE;
+    uint64_t end = extents[i].top / PAGE_SIZE;
+
+    while (index < end)
+    {
+      uint32_t order = PMM_MAX_ORDER;
+      while (order > 0 && ((index & ((1ULL << order) - 1)) != 0 || index + (1ULL << order) > end))
+      {
+        order--;
+      }
+
+      blocks[order]++;
+      index += 1ULL << order;
+    }
+  }
+}
+
+void pmm_get_stats(pmm_stats_t *stats)
+{
+  uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+  stats->total_pages = total_pages;
+  stats->peak_used_pages = peak_used_pages;
+  stats->zero_pool_pages = zero_pool_count;
+  stats->uncarved_pages = uncarved_pages;
+
+  for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
+  {
+    stats->free_blocks[order] = free_blocks[order];
+  }
+  count_uncarved_blocks(stats->free_blocks);
+
+  uint64_t free = free_pages;
+
+  spin_unlock_irqrestore(&pmm_lock, flags);
+
+  // Magazines are read without their owners' cooperation, so the per-CPU
+  // numbers below are only approximately consistent with each other.
+  stats->cached_pages = cached_pages();
+  stats->free_pages = free + stats->cached_pages;
+  stats->used_pages = total_pages - stats->free_pages;
+
+  stats->allocs = 0;
+  stats->frees = 0;
+  for (uint32_t owner = 0; owner < PMM_OWNER_COUNT; owner++)
+  {
+    stats->owner_pages[owner] = 0;
+  }
+
+  for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++)
+  {
+    pmm_magazine_t *mag = &magazines[cpu];
+    stats->allocs += mag->allocs;
+    stats->frees += mag->frees;
+    for (uint32_t owner = 0; owner < PMM_OWNER_COUNT; owner++)
+    {
+      stats->owner_pages[owner] += mag->owner_pages[owner];
+    }
+  }
+
+  // Unusable free space index: the share of free memory sitting in blocks
+  // too small for a huge page
+  uint64_t usable = 0;
+  for (uint32_t order = PMM_HUGE_PAGE_ORDER; order <= PMM_MAX_ORDER; order++)
+  {
+    usable += stats->free_blocks[order] << order;
+  }
+  stats->fragmentation = stats->free_pages ? (uint32_t) ((stats->free_pages - usable) * 1000 / stats->free_pages) : 0;
+
+  flags = irq_save();
+  uint64_t ticks = pit_get_ticks();
+  uint64_t elapsed = ticks - sample_ticks;
+  uint32_t hz = pit_get_frequency();
+
+  stats->alloc_rate = elapsed && hz ? (stats->allocs - sample_allocs) * hz / elapsed : 0;
+  stats->free_rate = elapsed && hz ? (stats->frees - sample_frees) * hz / elapsed : 0;
+
+  sample_ticks = ticks;
+  sample_allocs = stats->allocs;
+  sample_frees = stats->frees;
+  irq_restore(flags);
+}
+
+void pmm_dump_stats()
+{
+  pmm_stats_t stats;
+  pmm_get_stats(&stats);
+
+  serial_print("PMM: ");
+  serial_print_dec(stats.used_pages);
+  serial_print("/");
+  serial_print_dec(stats.total_pages);
+  serial_print(" pages used, peak ");
+  serial_print_dec(stats.peak_used_pages);
+  serial_print(", ");
+  serial_print_dec(stats.cached_pages);
+  serial_print(" cached, ");
+  serial_print_dec(stats.zero_pool_pages);
+  serial_print(" pre-zeroed, ");
+  serial_print_dec(stats.uncarved_pages);
+  serial_print(" uncarved\n");
+
+  serial_print("PMM: Free blocks by order:");
+  for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
+  {
+    serial_print(" ");
+    serial_print_dec(stats.free_blocks[order]);
+  }
+  serial_print("\n");
+
+  serial_print("PMM: Fragmentation index ");
+  serial_print_dec(stats.fragmentation);
+  serial_print("/1000 for 2 MiB blocks\n");
+
+  serial_print("PMM: ");
+  serial_print_dec(stats.allocs);
+  serial_print(" allocs (");
+  serial_print_dec(stats.alloc_rate);
+  serial_print("/s), ");
+  serial_print_dec(stats.frees);
+  serial_print(" frees (");
+  serial_print_dec(stats.free_rate);
+  serial_print("/s)\n");
+
+  for (uint32_t owner = 0; owner < PMM_OWNER_COUNT; owner++)
+  {
+    serial_print("PMM:   ");
+    serial_print(owner_names[owner]);
+    serial_print(": ");
+    serial_print_dec(stats.owner_pages[owner]);
+    serial_print(" pages\n");
+  }
+
+  pmm_print_magazine_stats();
+}
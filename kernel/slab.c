@@ -0,0 +1,566 @@
+#include "slab.h"
+
+#include "pmm.h"
+#include "serial.h"
+
+#include <stddef.h>
+
+extern uint64_t hhdm_offset;
+
+#define SLAB_MAGIC 0x51AB51AB
+#define KMALLOC_LARGE_MAGIC 0x1A26E0BB
+
+#define KMEM_MIN_ALIGN 8
+#define KMEM_MAX_SLAB_ORDER 3
+#define KMEM_MIN_OBJECTS 8
+
+// Every kmalloc size class uses slabs of this size, which lets kfree() find
+// the slab header of any kmalloc object by rounding its address down.
+#define KMALLOC_SLAB_ORDER 1
+#define KMALLOC_SLAB_SIZE (PAGE_SIZE << KMALLOC_SLAB_ORDER)
+#define KMALLOC_CLASS_COUNT 8
+
+// Lives at the start of every slab, followed by the free index stack and
+// then the objects themselves. Free objects are tracked out of line so that
+// constructed state survives a free/alloc cycle.
+struct kmem_slab
+{
+  uint32_t magic;
+  uint32_t in_use;
+  uint32_t free_count;
+  uint32_t reserved;
+  kmem_cache_t *cache;
+  kmem_slab_t *next;
+  kmem_slab_t *prev;
+  uint16_t free_stack[];
+};
+
+// Header placed in front of kmalloc allocations too big for a size class
+typedef struct
+{
+  uint32_t magic;
+  uint32_t order;
+  uint64_t size;
+} kmalloc_large_t;
+
+static kmem_cache_t cache_cache; // Bootstrap cache that kmem_cache_t objects come from
+static kmem_cache_t *cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+
+static kmem_cache_t *kmalloc_caches[KMALLOC_CLASS_COUNT];
+static const uint32_t kmalloc_sizes[KMALLOC_CLASS_COUNT] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+static const char *kmalloc_names[KMALLOC_CLASS_COUNT] = { "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048" };
+
+static inline uint64_t align_up(uint64_t value, uint64_t align) { return (value + align - 1) & ~(align - 1); }
+
+static inline uint64_t slab_bytes(kmem_cache_t *cache) { return (uint64_t) PAGE_SIZE << cache->slab_order; }
+
+static inline uint8_t *slab_object(kmem_cache_t *cache, kmem_slab_t *slab, uint32_t index)
+{
+  return (uint8_t *) slab + cache->header_size + (uint64_t) index * cache->object_size;
+}
+
+static void slab_list_push(kmem_slab_t **head, kmem_slab_t *slab)
+{
+  slab->prev = NULL;
+  slab->next = *head;
+  if (*head)
+  {
+    (*head)->prev = slab;
+  }
+  *head = slab;
+}
+
+static void slab_list_remove(kmem_slab_t **head, kmem_slab_t *slab)
+{
+  if (slab->prev)
+  {
+    slab->prev->next = slab->next;
+  } else
+  {
+    *head = slab->next;
+  }
+
+  if (slab->next)
+  {
+    slab->next->prev = slab->prev;
+  }
+
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+// How many objects fit in a slab once the header and free index stack are
+// accounted for
+static uint32_t objects_fit(uint64_t bytes, uint32_t object_size, uint32_t align, uint32_t *header_size)
+{
+  uint32_t count = (bytes - sizeof(kmem_slab_t)) / (object_size + sizeof(uint16_t));
+
+  while (count > 0)
+  {
+    uint32_t header = align_up(sizeof(kmem_slab_t) + count * sizeof(uint16_t), align);
+    if (header + (uint64_t) count * object_size <= bytes)
+    {
+      *header_size = header;
+      return count;
+    }
+    count--;
+  }
+
+  return 0;
+}
+
+static int cache_setup(kmem_cache_t *cache, const char *name, uint32_t size, uint32_t align, void (*ctor)(void *obj),
+    int fixed_order)
+{
+  int i = 0;
+  for (; name[i] && i < KMEM_NAME_LEN - 1; i++)
+  {
+    cache->name[i] = name[i];
+  }
+  cache->name[i] = '\0';
+
+  if (align < KMEM_MIN_ALIGN)
+  {
+    align = KMEM_MIN_ALIGN;
+  }
+
+  if (size == 0 || (align & (align - 1)))
+  {
+    return -1;
+  }
+
+  cache->align = align;
+  cache->object_size = align_up(size, align);
+  cache->ctor = ctor;
+  cache->owner = PMM_OWNER_HEAP;
+  cache->objects_per_slab = 0;
+
+  // Pick the smallest slab that holds a reasonable number of objects without
+  // wasting more than an eighth of itself
+  uint32_t order = fixed_order >= 0 ? (uint32_t) fixed_order : 0;
+  for (; order <= KMEM_MAX_SLAB_ORDER; order++)
+  {
+    uint64_t bytes = (uint64_t) PAGE_SIZE << order;
+    uint32_t header = 0;
+    uint32_t count = objects_fit(bytes, cache->object_size, align, &header);
+    if (count == 0)
+    {
+      continue;
+    }
+
+    cache->slab_order = order;
+    cache->objects_per_slab = count;
+    cache->header_size = header;
+
+    uint64_t waste = bytes - header - (uint64_t) count * cache->object_size;
+    if (fixed_order >= 0 || count >= KMEM_MIN_OBJECTS || waste * 8 <= bytes)
+    {
+      break;
+    }
+  }
+
+  if (cache->objects_per_slab == 0)
+  {
+    return -1;
+  }
+
+  spin_init(&cache->lock);
+  cache->partial = NULL;
+  cache->full = NULL;
+  cache->empty = NULL;
+
+  cache->allocs = 0;
+  cache->frees = 0;
+  cache->active_objects = 0;
+  cache->peak_active_objects = 0;
+  cache->total_objects = 0;
+  cache->slab_count = 0;
+
+  uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+  cache->next = cache_list;
+  cache_list = cache;
+  spin_unlock_irqrestore(&cache_list_lock, flags);
+
+  return 0;
+}
+
+static kmem_slab_t *slab_create(kmem_cache_t *cache)
+{
+  void *phys = pmm_alloc_pages(cache->slab_order);
+  if (!phys)
+  {
+    return NULL;
+  }
+  pmm_set_owner(phys, cache->owner);
+
+  kmem_slab_t *slab = (kmem_slab_t *) ((uint64_t) phys + hhdm_offset);
+  slab->magic = SLAB_MAGIC;
+  slab->in_use = 0;
+  slab->free_count = cache->objects_per_slab;
+  slab->cache = cache;
+  slab->next = NULL;
+  slab->prev = NULL;
+
+  // Lowest index on top so objects are handed out in address order
+  for (uint32_t i = 0; i < cache->objects_per_slab; i++)
+  {
+    slab->free_stack[i] = (uint16_t) (cache->objects_per_slab - 1 - i);
+  }
+
+  if (cache->ctor)
+  {
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++)
+    {
+      cache->ctor(slab_object(cache, slab, i));
+    }
+  }
+
+  cache->total_objects += cache->objects_per_slab;
+  cache->slab_count++;
+
+  return slab;
+}
+
+static void slab_release(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+  slab->magic = 0;
+  cache->total_objects -= cache->objects_per_slab;
+  cache->slab_count--;
+  pmm_free_pages((void *) ((uint64_t) slab - hhdm_offset), cache->slab_order);
+}
+
+void slab_init()
+{
+  cache_list = NULL;
+  spin_init(&cache_list_lock);
+
+  if (cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), KMEM_MIN_ALIGN, NULL, -1) != 0)
+  {
+    serial_print("Slab: Error: Failed to set up bootstrap cache!\n");
+    return;
+  }
+
+  for (int i = 0; i < KMALLOC_CLASS_COUNT; i++)
+  {
+    kmem_cache_t *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache || cache_setup(cache, kmalloc_names[i], kmalloc_sizes[i], KMEM_MIN_ALIGN, NULL, KMALLOC_SLAB_ORDER) != 0)
+    {
+      serial_print("Slab: Error: Failed to create ");
+      serial_print(kmalloc_names[i]);
+      serial_print("\n");
+      kmalloc_caches[i] = NULL;
+      continue;
+    }
+    kmalloc_caches[i] = cache;
+  }
+
+  serial_print("Slab: Initialized with ");
+  serial_print_dec(KMALLOC_CLASS_COUNT);
+  serial_print(" kmalloc size classes (16 - ");
+  serial_print_dec(KMALLOC_MAX_CLASS_SIZE);
+  serial_print(" bytes)\n");
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, void (*ctor)(void *obj))
+{
+  kmem_cache_t *cache = kmem_cache_alloc(&cache_cache);
+  if (!cache)
+  {
+    return NULL;
+  }
+
+  if (cache_setup(cache, name, size, align, ctor, -1) != 0)
+  {
+    serial_print("Slab: Error: Invalid cache parameters for ");
+    serial_print(name);
+    serial_print("\n");
+    kmem_cache_free(&cache_cache, cache);
+    return NULL;
+  }
+
+  return cache;
+}
+
+uint64_t kmem_cache_shrink(kmem_cache_t *cache)
+{
+  if (!cache)
+  {
+    return 0;
+  }
+
+  uint64_t freed = 0;
+  uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+  while (cache->empty)
+  {
+    kmem_slab_t *slab = cache->empty;
+    slab_list_remove(&cache->empty, slab);
+    slab_release(cache, slab);
+    freed += 1ULL << cache->slab_order;
+  }
+
+  spin_unlock_irqrestore(&cache->lock, flags);
+  return freed;
+}
+
+// Only slabs created from here on are charged to the new owner
+void kmem_cache_set_owner(kmem_cache_t *cache, pmm_owner_t owner) { cache->owner = owner; }
+
+void kmem_cache_destroy(kmem_cache_t *cache)
+{
+  if (!cache || cache == &cache_cache)
+  {
+    return;
+  }
+
+  if (cache->active_objects != 0)
+  {
+    serial_print("Slab: Error: Destroying cache ");
+    serial_print(cache->name);
+    serial_print(" with live objects\n");
+    return;
+  }
+
+  kmem_cache_shrink(cache);
+
+  uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+  kmem_cache_t **it = &cache_list;
+  while (*it && *it != cache)
+  {
+    it = &(*it)->next;
+  }
+  if (*it)
+  {
+    *it = cache->next;
+  }
+  spin_unlock_irqrestore(&cache_list_lock, flags);
+
+  kmem_cache_free(&cache_cache, cache);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+  if (!cache)
+  {
+    return NULL;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+  kmem_slab_t *slab = cache->partial;
+  if (!slab)
+  {
+    slab = cache->empty;
+    if (slab)
+    {
+      slab_list_remove(&cache->empty, slab);
+    } else
+    {
+      slab = slab_create(cache);
+      if (!slab)
+      {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        serial_print("Slab: Error: Out of memory in ");
+        serial_print(cache->name);
+        serial_print("\n");
+        return NULL;
+      }
+    }
+    slab_list_push(&cache->partial, slab);
+  }
+
+  uint32_t index = slab->free_stack[--slab->free_count];
+  slab->in_use++;
+
+  if (slab->free_count == 0)
+  {
+    slab_list_remove(&cache->partial, slab);
+    slab_list_push(&cache->full, slab);
+  }
+
+  cache->allocs++;
+  cache->active_objects++;
+  if (cache->active_objects > cache->peak_active_objects)
+  {
+    cache->peak_active_objects = cache->active_objects;
+  }
+
+  void *obj = slab_object(cache, slab, index);
+  spin_unlock_irqrestore(&cache->lock, flags);
+
+  return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+  if (!cache || !obj)
+  {
+    return;
+  }
+
+  kmem_slab_t *slab = (kmem_slab_t *) ((uint64_t) obj & ~(slab_bytes(cache) - 1));
+  if (slab->magic != SLAB_MAGIC || slab->cache != cache)
+  {
+    serial_print("Slab: Error: Object ");
+    serial_print_hex((uint64_t) obj);
+    serial_print(" does not belong to ");
+    serial_print(cache->name);
+    serial_print("\n");
+    return;
+  }
+
+  uint64_t offset = (uint64_t) obj - (uint64_t) slab_object(cache, slab, 0);
+  uint32_t index = offset / cache->object_size;
+  if (offset % cache->object_size || index >= cache->objects_per_slab)
+  {
+    serial_print("Slab: Error: Bad object pointer ");
+    serial_print_hex((uint64_t) obj);
+    serial_print(" freed to ");
+    serial_print(cache->name);
+    serial_print("\n");
+    return;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+  if (slab->free_count == cache->objects_per_slab)
+  {
+    spin_unlock_irqrestore(&cache->lock, flags);
+    serial_print("Slab: Error: Double free in ");
+    serial_print(cache->name);
+    serial_print("\n");
+    return;
+  }
+
+  if (slab->free_count == 0)
+  {
+    slab_list_remove(&cache->full, slab);
+    slab_list_push(&cache->partial, slab);
+  }
+
+  slab->free_stack[slab->free_count++] = (uint16_t) index;
+  slab->in_use--;
+
+  cache->frees++;
+  cache->active_objects--;
+
+  // Keep a single empty slab around to absorb alloc/free churn
+  if (slab->in_use == 0)
+  {
+    slab_list_remove(&cache->partial, slab);
+    if (cache->empty)
+    {
+      slab_release(cache, slab);
+    } else
+    {
+      slab_list_push(&cache->empty, slab);
+    }
+  }
+
+  spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void *kmalloc(size_t size)
+{
+  if (size == 0)
+  {
+    return NULL;
+  }
+
+  if (size <= KMALLOC_MAX_CLASS_SIZE)
+  {
+    for (int i = 0; i < KMALLOC_CLASS_COUNT; i++)
+    {
+      if (size <= kmalloc_sizes[i])
+      {
+        return kmem_cache_alloc(kmalloc_caches[i]);
+      }
+    }
+  }
+
+  uint32_t order = KMALLOC_SLAB_ORDER;
+  while (((uint64_t) PAGE_SIZE << order) < size + sizeof(kmalloc_large_t))
+  {
+    order++;
+    if (order > PMM_MAX_ORDER)
+    {
+      serial_print("Slab: Error: kmalloc request too large\n");
+      return NULL;
+    }
+  }
+
+  void *phys = pmm_alloc_pages(order);
+  if (!phys)
+  {
+    return NULL;
+  }
+  pmm_set_owner(phys, PMM_OWNER_HEAP);
+
+  kmalloc_large_t *header = (kmalloc_large_t *) ((uint64_t) phys + hhdm_offset);
+  header->magic = KMALLOC_LARGE_MAGIC;
+  header->order = order;
+  header->size = size;
+
+  return header + 1;
+}
+
+void kfree(void *ptr)
+{
+  if (!ptr)
+  {
+    return;
+  }
+
+  void *base = (void *) ((uint64_t) ptr & ~((uint64_t) KMALLOC_SLAB_SIZE - 1));
+  uint32_t magic = *(uint32_t *) base;
+
+  if (magic == SLAB_MAGIC)
+  {
+    kmem_cache_free(((kmem_slab_t *) base)->cache, ptr);
+    return;
+  }
+
+  kmalloc_large_t *header = (kmalloc_large_t *) base;
+  if (magic == KMALLOC_LARGE_MAGIC && ptr == (void *) (header + 1))
+  {
+    header->magic = 0;
+    pmm_free_pages((void *) ((uint64_t) base - hhdm_offset), header->order);
+    return;
+  }
+
+  serial_print("Slab: Error: kfree of unknown pointer ");
+  serial_print_hex((uint64_t) ptr);
+  serial_print("\n");
+}
+
+void kmem_print_stats()
+{
+  serial_print("Slab: Cache statistics (name, object size, active/total, slabs, allocs, frees, peak)\n");
+
+  uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+  for (kmem_cache_t *cache = cache_list; cache; cache = cache->next)
+  {
+    serial_print("  ");
+    serial_print(cache->name);
+    serial_print(": ");
+    serial_print_dec(cache->object_size);
+    serial_print("B ");
+    serial_print_dec(cache->active_objects);
+    serial_print("/");
+    serial_print_dec(cache->total_objects);
+    serial_print(" objs, ");
+    serial_print_dec(cache->slab_count);
+    serial_print(" slabs (order ");
+    serial_print_dec(cache->slab_order);
+    serial_print("), ");
+    serial_print_dec(cache->allocs);
+    serial_print(" allocs, ");
+    serial_print_dec(cache->frees);
+    serial_print(" frees, peak ");
+    serial_print_dec(cache->peak_active_objects);
+    serial_print("\n");
+  }
+  spin_unlock_irqrestore(&cache_list_lock, flags);
+}
@@ -0,0 +1,120 @@
+#include "smp.h"
+
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "kernel_limine.h"
+#include "lapic.h"
+#include "pit.h"
+#include "serial.h"
+#include "syscall.h"
+#include "thread.h"
+#include "vmm.h"
+
+#include <limine.h>
+#include <stddef.h>
+
+// How long the BSP waits for the APs to check in
+#define SMP_STARTUP_TIMEOUT_MS 1000
+
+cpu_t cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+
+static uint32_t cpus_online = 1;
+
+static void cpu_setup(uint32_t id, uint32_t lapic)
+{
+  cpu_t *cpu = &cpus[id];
+  cpu->self = cpu;
+  cpu->id = id;
+  cpu->lapic_id = lapic;
+  cpu->thread = NULL;
+  cpu->idle = NULL;
+  cpu->prev = NULL;
+  cpu->need_resched = 0;
+  cpu->kernel_tlb_gen = 0;
+  cpu->syscall_rsp = 0;
+  cpu->user_rsp = 0;
+
+  wrmsr(MSR_GS_BASE, (uint64_t) cpu);
+  wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void smp_init_bsp() { cpu_setup(0, 0); }
+
+// Limine drops every AP here on its own stack, with interrupts disabled and
+// the bootloader's GDT and IDT still loaded
+static void ap_entry(struct limine_mp_info *info)
+{
+  uint32_t id = (uint32_t) info->extra_argument;
+  cpu_setup(id, info->lapic_id);
+
+  gdt_init_cpu(id);
+  idt_init_cpu();
+  vmm_init_cpu();
+  lapic_init_cpu();
+  syscall_init_cpu();
+
+  __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+  scheduler_start();
+
+  for (;;)
+  {
+    __asm__ volatile("cli; hlt");
+  }
+}
+
+void smp_init()
+{
+  struct limine_mp_request request = limine_get_mp_request();
+  struct limine_mp_response *response = request.response;
+  if (!response)
+  {
+    serial_print("SMP: No MP info from bootloader, running on the BSP only\n");
+    return;
+  }
+
+  cpus[0].lapic_id = response->bsp_lapic_id;
+
+  // Number the APs first, schedulers look at cpu_count as soon as they start
+  uint32_t count = 1;
+  for (uint64_t i = 0; i < response->cpu_count; i++)
+  {
+    struct limine_mp_info *info = response->cpus[i];
+    if (info->lapic_id == response->bsp_lapic_id)
+    {
+      continue;
+    }
+
+    if (count == MAX_CPUS)
+    {
+      serial_print("SMP: More CPUs than MAX_CPUS, leaving one parked\n");
+      info->extra_argument = 0;
+      continue;
+    }
+
+    info->extra_argument = count++;
+  }
+  cpu_count = count;
+
+  for (uint64_t i = 0; i < response->cpu_count; i++)
+  {
+    struct limine_mp_info *info = response->cpus[i];
+    if (info->lapic_id != response->bsp_lapic_id && info->extra_argument != 0)
+    {
+      __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_RELEASE);
+    }
+  }
+
+  uint64_t deadline = pit_get_ticks() + (uint64_t) SMP_STARTUP_TIMEOUT_MS * pit_get_frequency() / 1000;
+  while (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) < count && pit_get_ticks() < deadline)
+  {
+    __asm__ volatile("pause");
+  }
+
+  serial_print("SMP: ");
+  serial_print_dec(__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE));
+  serial_print(" of ");
+  serial_print_dec(count);
+  serial_print(" CPUs online\n");
+}
@@ -1,19 +1,122 @@
 #include "syscall.h"
 
+#include "async.h"
+#include "cpu.h"
+#include "ext2.h"
+#include "gdt.h"
 #include "idt.h"
+#include "pmm.h"
 #include "serial.h"
+#include "slab.h"
 #include "thread.h"
+#include "vma.h"
 
 #include <stddef.h>
 
 #define SYSCALL_VECTOR 0x80
 
+#define EFER_SCE (1ULL << 0) // SYSCALL/SYSRET enable
+
+// Entered with interrupts off, syscall_fast_entry turns them back on once
+// it's on the kernel stack
+#define SYSCALL_RFLAGS_MASK ((1 << 8) | (1 << 9) | (1 << 10) | (1 << 18)) // TF, IF, DF, AC
+
+// syscall_asm.asm hardcodes these
+_Static_assert(offsetof(cpu_t, syscall_rsp) == 56, "cpu_t layout changed");
+_Static_assert(offsetof(cpu_t, user_rsp) == 64, "cpu_t layout changed");
+
 extern void syscall_entry_asm(void);
+extern void syscall_fast_entry(void);
 
 void syscall_init()
 {
   idt_set_gate(SYSCALL_VECTOR, (uint64_t) syscall_entry_asm, 0x08, IDT_TYPE_USER_INTERRUPT);
   serial_print("Syscalls: Registered interrupt 0x80 for syscalls\n");
+
+  syscall_init_cpu();
+  serial_print("Syscalls: Enabled the SYSCALL instruction\n");
+}
+
+void syscall_init_cpu()
+{
+  // SYSCALL loads CS from STAR[47:32] and SS 8 above it. SYSRET loads SS 8
+  // and CS 16 above STAR[63:48], which is why user data sits below user code.
+  wrmsr(MSR_STAR, ((uint64_t) (USER_DS - 8) << 48) | ((uint64_t) KERNEL_CS << 32));
+  wrmsr(MSR_LSTAR, (uint64_t) syscall_fast_entry);
+  wrmsr(MSR_SFMASK, SYSCALL_RFLAGS_MASK);
+  wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
+
+#define HUGE_PAGE_SIZE ((uint64_t) PAGE_SIZE << PMM_HUGE_PAGE_ORDER)
+
+static int64_t sys_map_memory(
+    uint64_t addr, uint64_t length, uint32_t prot, uint32_t flags, const char *path, uint64_t offset)
+{
+  address_space_t *as = vmm_get_current_address_space();
+  uint64_t align = (flags & MAP_HUGE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+
+  if (length == 0 || (addr & (align - 1)) || (offset & (PAGE_SIZE - 1)) || (flags & MAP_HUGE && !(flags & MAP_ANONYMOUS)))
+  {
+    return -1;
+  }
+
+  length = (length + align - 1) & ~(align - 1);
+
+  uint32_t vm_prot = prot & (VM_READ | VM_WRITE | VM_EXEC);
+  if (flags & MAP_HUGE)
+  {
+    vm_prot |= VM_HUGE;
+  }
+
+  if (!(flags & MAP_FIXED))
+  {
+    addr = vma_find_free(as, length, align);
+  }
+
+  if (!addr)
+  {
+    return -1;
+  }
+
+  vm_file_t *file = NULL;
+  if (!(flags & MAP_ANONYMOUS))
+  {
+    // TODO: Validate string is in userspace memory
+    // There's no page cache yet, so every file mapping gets its own copy
+    int64_t size = ext2_file_size(path);
+    if (size <= 0 || (uint64_t) size <= offset)
+    {
+      return -1;
+    }
+
+    void *data = kmalloc(size);
+    if (!data)
+    {
+      return -1;
+    }
+
+    if (ext2_read_file(path, data, size) != size || !(file = vm_file_create(data, size, 1)))
+    {
+      kfree(data);
+      return -1;
+    }
+  }
+
+  vm_region_t *region = vma_create(as, addr, length, file ? VM_REGION_FILE : VM_REGION_ANON, vm_prot, file, offset);
+  vm_file_put(file);
+
+  if (!region)
+  {
+    return -1;
+  }
+
+  if ((flags & MAP_POPULATE) && !file && vma_populate(as, region) != 0)
+  {
+    vma_unmap(as, addr, length);
+    return -1;
+  }
+
+  return (int64_t) addr;
 }
 
 int64_t syscall_handler(
@@ -29,7 +132,9 @@ int64_t syscall_handler(
       Port *port = port_from_id((uint32_t) arg1);
       if (!port)
         return -1;
-      return send(port, (uint32_t) arg2, (uint32_t) arg3, (uint32_t) arg4, (uint32_t) arg5, (uint32_t) arg6);
+      int result = send(port, (uint32_t) arg2, (uint32_t) arg3, (uint32_t) arg4, (uint32_t) arg5, (uint32_t) arg6);
+      port_put(port);
+      return result;
     }
 
     case SYS_RECV:
@@ -42,31 +147,159 @@ int64_t syscall_handler(
 
       // TODO: Validate user pointer is in userspace memory
       Message *msg_out = (Message *) arg2;
-      return recv(port, msg_out);
+      int result = recv(port, msg_out);
+      port_put(port);
+      return result;
     }
 
-    case SYS_THREAD_EXIT:
+    case SYS_SEND_BATCH:
     {
-      // arg1 = exit code
-      serial_print("Thread exiting with code: ");
-      serial_print_hex(arg1);
-      serial_print("\n");
+      // arg1 = port_id
+      // arg2 = pointer to array of ipc_message_t
+      // arg3 = number of messages, at most IPC_BATCH_MAX
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
+
+      // TODO: Validate user pointer is in userspace memory
+      int result = send_batch(port, (const ipc_message_t *) arg2, (uint32_t) arg3);
+      port_put(port);
+      return result;
+    }
+
+    case SYS_RECV_BATCH:
+    {
+      // arg1 = port_id
+      // arg2 = pointer to array of ipc_message_t
+      // arg3 = room in the array, at most IPC_BATCH_MAX
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
+
+      // TODO: Validate user pointer is in userspace memory
+      int result = recv_batch(port, (ipc_message_t *) arg2, (uint32_t) arg3);
+      port_put(port);
+      return result;
+    }
 
-      // Mark thread as dead and yield
-      Thread *current = thread_current();
-      if (current)
+    case SYS_RECV_ANY:
+    {
+      // arg1 = pointer to array of port_ids
+      // arg2 = number of ports, at most RECV_ANY_MAX_PORTS
+      // arg3 = pointer to Message structure
+      if (!arg1 || arg2 == 0 || arg2 > RECV_ANY_MAX_PORTS)
+        return -1;
+
+      // TODO: Validate user pointers are in userspace memory
+      const uint32_t *port_ids = (const uint32_t *) arg1;
+      Port *ports[RECV_ANY_MAX_PORTS];
+      uint32_t count = 0;
+      while (count < arg2 && (ports[count] = port_from_id(port_ids[count])))
       {
-        current->state = THREAD_DEAD;
+        count++;
       }
-      // Yield to another thread
-      thread_yield();
 
-      // If there are no other threads, we shoudl halt
-      for (;;)
+      int result = count < arg2 ? -1 : recv_any(ports, count, (Message *) arg3);
+      for (uint32_t i = 0; i < count; i++)
       {
-        __asm__ volatile("cli; hlt");
+        port_put(ports[i]);
       }
+      return result;
+    }
+
+    case SYS_SEND_GRANT:
+    {
+      // arg1 = port_id
+      // arg2 = pointer to Message structure
+      // arg3 = page aligned address of the pages to send
+      // arg4 = length, a multiple of the page size
+      // arg5 = GRANT_* flags
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
+
+      // TODO: Validate user pointer is in userspace memory
+      int result = send_grant(port, (const Message *) arg2, arg3, arg4, (uint32_t) arg5);
+      port_put(port);
+      return result;
+    }
+
+    case SYS_RECV_GRANT:
+    {
+      // arg1 = port_id
+      // arg2 = pointer to Message structure
+      // arg3 = pointer to ipc_grant_t
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
 
+      // TODO: Validate user pointers are in userspace memory
+      int result = recv_grant(port, (Message *) arg2, (ipc_grant_t *) arg3);
+      port_put(port);
+      return result;
+    }
+
+    case SYS_ASYNC_SETUP:
+    {
+      // arg1 = number of submission entries, at most ASYNC_MAX_ENTRIES
+      // arg2 = ASYNC_SETUP_* flags
+      return async_setup((uint32_t) arg1, (uint32_t) arg2);
+    }
+
+    case SYS_ASYNC_ENTER:
+    {
+      // arg1 = completions to wait for
+      return async_enter((uint32_t) arg1);
+    }
+
+    case SYS_CALL:
+    {
+      // arg1 = port_id
+      // arg2 = pointer to Message structure, the reply is written back to it
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
+
+      // TODO: Validate user pointer is in userspace memory
+      int result = call(port, (Message *) arg2);
+      port_put(port);
+      return result;
+    }
+
+    case SYS_REPLY:
+    {
+      // arg1 = message_id
+      // arg2-arg5 = data[0-3]
+      return reply((uint32_t) arg1, (uint32_t) arg2, (uint32_t) arg3, (uint32_t) arg4, (uint32_t) arg5);
+    }
+
+    case SYS_REPLY_RECV:
+    {
+      // arg1 = port_id
+      // arg2 = pointer to Message structure, reply on entry, next message on return
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
+
+      // TODO: Validate user pointer is in userspace memory
+      int result = reply_recv(port, (Message *) arg2);
+      port_put(port);
+      return result;
+    }
+
+    case SYS_NULL:
+    {
+      return 0;
+    }
+
+    case SYS_THREAD_EXIT:
+    {
+      // arg1 = exit code
+      serial_print("Thread exiting with code: ");
+      serial_print_hex(arg1);
+      serial_print("\n");
+
+      thread_exit();
       return 0;
     }
 
@@ -90,6 +323,37 @@ int64_t syscall_handler(
       if (!port)
         return -1;
       port_destroy(port);
+      port_put(port);
+      return 0;
+    }
+
+    case SYS_PORT_CONFIGURE:
+    {
+      // arg1 = port_id
+      // arg2 = queue capacity
+      // arg3 = PORT_OVERFLOW_* policy
+      // arg4 = PORT_* flags
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
+      int result = port_configure(port, (uint32_t) arg2, (port_overflow_t) arg3, (uint32_t) arg4);
+      port_put(port);
+      return result;
+    }
+
+    case SYS_PORT_STATS:
+    {
+      // arg1 = port_id
+      // arg2 = pointer to port_stats_t
+      if (!arg2)
+        return -1;
+      Port *port = port_from_id((uint32_t) arg1);
+      if (!port)
+        return -1;
+
+      // TODO: Validate user pointer is in userspace memory
+      port_get_stats(port, (port_stats_t *) arg2);
+      port_put(port);
       return 0;
     }
 
@@ -102,6 +366,68 @@ int64_t syscall_handler(
       return 0;
     }
 
+    case SYS_MAP_MEMORY:
+    {
+      // arg1 = address, only used with MAP_FIXED
+      // arg2 = length
+      // arg3 = PROT_* flags
+      // arg4 = MAP_* flags
+      // arg5 = file path unless MAP_ANONYMOUS
+      // arg6 = file offset
+      return sys_map_memory(arg1, arg2, (uint32_t) arg3, (uint32_t) arg4, (const char *) arg5, arg6);
+    }
+
+    case SYS_UNMAP_MEMORY:
+    {
+      // arg1 = address
+      // arg2 = length
+      return vma_unmap(vmm_get_current_address_space(), arg1, (arg2 + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1));
+    }
+
+    case SYS_MEM_STATS:
+    {
+      // arg1 = pointer to pmm_stats_t, may be NULL
+      // arg2 = MEM_STATS_* flags
+      if (arg2 & MEM_STATS_DUMP)
+      {
+        pmm_dump_stats();
+      }
+
+      // TODO: Validate user pointer is in userspace memory
+      if (arg1)
+      {
+        pmm_get_stats((pmm_stats_t *) arg1);
+      }
+      return 0;
+    }
+
+    case SYS_SPAWN:
+    {
+      // arg1 = entry point
+      // arg2 = user stack pointer, inside memory the child inherits
+      address_space_t *child = vmm_clone_address_space(vmm_get_current_address_space());
+      if (!child)
+      {
+        return -1;
+      }
+
+      async_clone(child, vmm_get_current_address_space());
+
+      if (thread_create_user((void (*)(void)) arg1, (void *) arg2, child) != 0)
+      {
+        vmm_destroy_address_space(child);
+        return -1;
+      }
+      return 0;
+    }
+
+    case SYS_SET_PRIORITY:
+    {
+      // arg1 = SCHED_* class
+      // arg2 = priority within the class, 0 is the most urgent
+      return thread_set_priority((ThreadClass) arg1, (uint32_t) arg2);
+    }
+
     default:
     {
       serial_print("Unknown syscall: ");
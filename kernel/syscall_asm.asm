@@ -6,6 +6,9 @@ extern syscall_handler
 global syscall_entry_asm
 syscall_entry_asm:
     ; CPU has already pushed: SS, RSP, RFLAGS, CS, RIP
+    ; Only ring 3 makes syscalls, so GS always holds the user base here
+    swapgs
+
     ; Save callee-saved registers
     push rbx
     push rbp
@@ -44,4 +47,86 @@ syscall_entry_asm:
 
     ; Return to userspace
     ; The iretq will pop: RIP, CS, RFLAGS, RSP, SS
-    iretq
\ No newline at end of file
+    swapgs
+    iretq
+
+; Offsets into cpu_t, checked in syscall.c
+%define CPU_SYSCALL_RSP 56
+%define CPU_USER_RSP 64
+
+global syscall_fast_entry
+syscall_fast_entry:
+    ; SYSCALL left the user RIP in rcx and RFLAGS in r11, masked interrupts
+    ; and kept the user stack, so get onto the kernel one before anything else
+    swapgs
+    mov [gs:CPU_USER_RSP], rsp
+    mov rsp, [gs:CPU_SYSCALL_RSP]
+
+    ; The scratch slot belongs to the CPU, not to us, once interrupts are back
+    push qword [gs:CPU_USER_RSP]
+    push r11
+    push rcx
+
+    ; Unlike the interrupt gate, callers only lose rax, rcx and r11
+    push rdi
+    push rsi
+    push rdx
+    push r10
+    push r8
+    push r9
+
+    sti
+
+    ; Same shuffle as syscall_entry_asm, and the push keeps the call aligned
+    push r9             ; arg6
+    mov r9, r8
+    mov r8, r10
+    mov rcx, rdx
+    mov rdx, rsi
+    mov rsi, rdi
+    mov rdi, rax
+
+    call syscall_handler
+
+    add rsp, 8
+
+    ; We may come back on another CPU, so nothing per-CPU is cached across
+    ; the call
+    cli
+
+    pop r9
+    pop r8
+    pop r10
+    pop rdx
+    pop rsi
+    pop rdi
+
+    pop rcx             ; User RIP
+
+    ; SYSRET to a non-canonical RIP faults in ring 0 on Intel, after the user
+    ; stack is already back in rsp, so anything past user space goes through
+    ; iretq, which faults on the kernel stack instead. Flags survive the pop.
+    push rcx
+    shr rcx, 47
+    pop rcx
+    jnz .iret_return
+
+    pop r11             ; User RFLAGS
+    pop rsp             ; User stack
+
+    swapgs
+    o64 sysret
+
+.iret_return:
+    ; Interrupts are off, so the scratch slot is ours again
+    pop r11
+    pop qword [gs:CPU_USER_RSP]
+
+    push qword 0x1B     ; User data segment
+    push qword [gs:CPU_USER_RSP]
+    push r11
+    push qword 0x23     ; User code segment
+    push rcx
+
+    swapgs
+    iretq
@@ -1,443 +1,2326 @@
 #include "thread.h"
+#include "async.h"
+#include "cpu.h"
 #include "gdt.h"
+#include "pit.h"
+#include "pmm.h"
+#include "serial.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "vma.h"
 
 #include <stddef.h>
 
 extern void context_switch(uint64_t *old_rsp, uint64_t new_rsp);
 extern void jump_to_usermode(uint64_t entry, uint64_t user_stack);
 
-#define MAX_THREADS 8
-#define STACK_SIZE 4096
-#define MAX_PORTS 16
-#define MAX_MESSAGES 64
+#define PORT_TABLE_INITIAL_SIZE 16
 
-static Thread *current = NULL;
-static Thread *thread_list = NULL;
-static uint8_t stacks[MAX_THREADS][STACK_SIZE];
-static Thread threads[MAX_THREADS];
-static int thread_count = 0;
+// Every thread owns a fixed slot of kernel virtual space for its stack. The
+// stack is mapped down from the top of the slot and whatever is left below it
+// (at least KSTACK_GUARD_PAGES) stays unmapped to catch overflows.
+#define KSTACK_REGION_BASE 0xFFFFFE0000000000ULL // PML4 slot 508, nothing else lives there
+#define KSTACK_SLOT_SIZE (64 * 1024)
+#define KSTACK_GUARD_PAGES 1
+#define KSTACK_MAX_PAGES (KSTACK_SLOT_SIZE / PAGE_SIZE - KSTACK_GUARD_PAGES)
 
-static Port ports[MAX_PORTS];
-static int port_count = 0;
+// Dead threads kept around with their stacks still mapped, for quick reuse.
+// Beyond that they keep only their (unmapped) slot.
+#define THREAD_CACHE_MAX 16
 
-static Message message_pool[MAX_MESSAGES];
-static int message_pool_next = 0;
+// FIFO of runnable threads per priority level, with a bit set for every
+// non-empty level so picking the next thread never scans. Every CPU has one.
+typedef struct
+{
+  spinlock_t lock;
+  Thread *head[THREAD_PRIORITY_LEVELS];
+  Thread *tail[THREAD_PRIORITY_LEVELS];
+  uint32_t bitmap;
+  uint32_t count; // Read without the lock to skip idle CPUs when stealing
+} run_queue_t;
+
+// The thread running on this CPU
+#define current (cpu_current()->thread)
+
+static run_queue_t run_queues[MAX_CPUS];
+
+// Exited threads wait here until nobody runs on their stack any more. Then
+// they're cached with their stack mapped, or keep just their empty slot.
+static spinlock_t pool_lock = SPINLOCK_INIT;
+static Thread *dead_threads = NULL;
+static Thread *free_threads = NULL;
+static Thread *free_slots = NULL;
+static uint32_t free_thread_count = 0;
+
+// Kernel stack page tables are shared by every CPU
+static spinlock_t stack_lock = SPINLOCK_INIT;
+static uint64_t next_stack_slot = KSTACK_REGION_BASE;
+static uint32_t stack_pages = THREAD_STACK_SIZE / PAGE_SIZE;
+
+static uint32_t time_slice_ticks = 1;
+static uint32_t latency_budget_ticks = 1;
+
+// Messages send_batch() and recv_batch() move per trip through ipc_lock
+#define IPC_BATCH_CHUNK 16
+
+// Threads in thread_park(), wakeups take it before the run queue locks
+static spinlock_t park_lock = SPINLOCK_INIT;
+
+// Ports, their queues and blocked receivers
+static spinlock_t ipc_lock = SPINLOCK_INIT;
+
+static kmem_cache_t *thread_cache = NULL;
+static kmem_cache_t *port_cache = NULL;
+static kmem_cache_t *message_cache = NULL;
+static kmem_cache_t *ring_cache = NULL;
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t data[MESSAGE_DATA_SIZE];
+} ring_slot_t;
+
+// Single-producer/single-consumer ring behind a PORT_RING port. Each side
+// writes only its own cache line, and reads the other side's index only when
+// its cached copy says the ring is full or empty. The last line is read by
+// both but written only around blocking, so it stays shared in both caches.
+typedef struct port_ring
+{
+  // Written by the producer
+  uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint32_t head_cache; // Last head seen
+  uint64_t produced;
+  uint64_t dropped;
+  uint64_t blocked_sends;
+
+  // Written by the consumer
+  uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint32_t tail_cache; // Last tail seen
+  uint64_t consumed;
+
+  // Owners by thread_handle(), so an exited owner's reused slot isn't it
+  uint64_t producer __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint64_t consumer;
+  uint32_t producer_waiting; // Set under ipc_lock while the producer blocks
+  uint32_t consumer_waiting; // Same for the consumer
+  uint32_t mask; // Slot count minus one, the count is a power of two
+  ring_slot_t *slots;
+} port_ring_t;
+
+// Port IDs index this table (offset by one), it grows on demand
+static Port **port_table = NULL;
+static uint32_t port_table_size = 0;
+
+static void port_ctor(void *obj)
+{
+  Port *port = obj;
+  port->id = 0;
+  port->queue_head = NULL;
+  port->queue_tail = NULL;
+  port->message_count = 0;
+  port->recv_waiters = NULL;
+  port->recv_waiters_tail = NULL;
+  port->capacity = MAX_MESSAGE_QUEUE;
+  port->overflow = PORT_OVERFLOW_FAIL;
+  port->send_waiters = NULL;
+  port->send_waiters_tail = NULL;
+  port->ring = NULL;
+  port->refs = 0;
+  port->dead = 0;
+
+  uint8_t *stats = (uint8_t *) &port->stats;
+  for (size_t i = 0; i < sizeof(port->stats); i++)
+  {
+    stats[i] = 0;
+  }
+}
 
 void thread_init()
 {
-  current = NULL;
-  thread_list = NULL;
-  thread_count = 0;
-  port_count = 0;
-  message_pool_next = 0;
+  for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+  {
+    run_queue_t *rq = &run_queues[cpu];
+    spin_init(&rq->lock);
+    for (int i = 0; i < THREAD_PRIORITY_LEVELS; i++)
+    {
+      rq->head[i] = NULL;
+      rq->tail[i] = NULL;
+    }
+    rq->bitmap = 0;
+    rq->count = 0;
+  }
+  dead_threads = NULL;
+  free_threads = NULL;
+  free_slots = NULL;
+  free_thread_count = 0;
+  next_stack_slot = KSTACK_REGION_BASE;
+  thread_set_stack_size(THREAD_STACK_SIZE);
+  port_table = NULL;
+  port_table_size = 0;
+  thread_set_time_slice(THREAD_TIME_SLICE_MS);
+  uint32_t budget = (uint32_t) ((uint64_t) THREAD_LATENCY_BUDGET_MS * pit_get_frequency() / 1000);
+  latency_budget_ticks = budget ? budget : 1;
+
+  thread_cache = kmem_cache_create("thread", sizeof(Thread), 64, NULL);
+  port_cache = kmem_cache_create("port", sizeof(Port), 64, port_ctor);
+  message_cache = kmem_cache_create("message", sizeof(Message), 8, NULL);
+  ring_cache = kmem_cache_create("port_ring", sizeof(port_ring_t), CACHE_LINE_SIZE, NULL);
+
+  if (!thread_cache || !port_cache || !message_cache || !ring_cache)
+  {
+    serial_print("Thread: Error: Failed to create object caches!\n");
+  }
+}
+
+// Queue a runnable thread on t->cpu behind the others of its priority, or
+// ahead of them with front. A thread woken before it finished blocking may
+// already be queued.
+static void run_queue_push(Thread *t, int front)
+{
+  run_queue_t *rq = &run_queues[t->cpu];
+  spin_lock(&rq->lock);
+
+  if (!t->queued)
+  {
+    t->queued = 1;
+    t->next = NULL;
+    if (!rq->head[t->priority])
+    {
+      rq->head[t->priority] = t;
+      rq->tail[t->priority] = t;
+    } else if (front)
+    {
+      t->next = rq->head[t->priority];
+      rq->head[t->priority] = t;
+    } else
+    {
+      rq->tail[t->priority]->next = t;
+      rq->tail[t->priority] = t;
+    }
+    rq->bitmap |= 1U << t->priority;
+    rq->count++;
+  }
+
+  spin_unlock(&rq->lock);
+}
+
+// Take the first thread of the highest non-empty priority above limit, NULL
+// if none
+static Thread *run_queue_pop(uint32_t cpu, uint32_t limit)
+{
+  run_queue_t *rq = &run_queues[cpu];
+  if (!__atomic_load_n(&rq->count, __ATOMIC_RELAXED))
+  {
+    return NULL;
+  }
+
+  spin_lock(&rq->lock);
+  uint32_t ready = rq->bitmap;
+  if (limit < THREAD_PRIORITY_LEVELS)
+  {
+    ready &= (1U << limit) - 1;
+  }
+
+  if (!ready)
+  {
+    spin_unlock(&rq->lock);
+    return NULL;
+  }
+
+  uint32_t level = __builtin_ctz(ready);
+  Thread *t = rq->head[level];
+  rq->head[level] = t->next;
+  if (!t->next)
+  {
+    rq->tail[level] = NULL;
+    rq->bitmap &= ~(1U << level);
+  }
+  rq->count--;
+
+  t->next = NULL;
+  t->queued = 0;
+  spin_unlock(&rq->lock);
+  return t;
+}
+
+// Pull work over from the other CPUs, starting with the next one so idle
+// CPUs don't all pile onto the same victim
+static Thread *steal_thread(uint32_t self, uint32_t limit)
+{
+  for (uint32_t i = 1; i < cpu_count; i++)
+  {
+    Thread *t = run_queue_pop((self + i) % cpu_count, limit);
+    if (t)
+    {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+// Foreground work anywhere goes before local background work
+static Thread *pick_next(uint32_t cpu)
+{
+  Thread *t = run_queue_pop(cpu, THREAD_BACKGROUND_BASE);
+  if (!t)
+  {
+    t = steal_thread(cpu, THREAD_BACKGROUND_BASE);
+  }
+  if (!t)
+  {
+    t = run_queue_pop(cpu, THREAD_PRIORITY_LEVELS);
+  }
+  if (!t)
+  {
+    t = steal_thread(cpu, THREAD_PRIORITY_LEVELS);
+  }
+  return t;
+}
+
+// Make a blocked thread runnable again, on the CPU it last ran on. Latency
+// threads go ahead of their level, and anything more urgent than what that
+// CPU runs asks it to reschedule. Idle CPUs notice on their next timer tick.
+static void thread_wake(Thread *t, int status)
+{
+  t->waiting_on_port = NULL;
+  t->wake_status = status;
+  t->state = THREAD_RUNNING;
+  t->latency_ticks = 0;
+  run_queue_push(t, t->sched_class == THREAD_CLASS_LATENCY);
+
+  cpu_t *cpu = &cpus[t->cpu];
+  Thread *running = __atomic_load_n(&cpu->thread, __ATOMIC_RELAXED);
+  if (running && t->priority < running->priority)
+  {
+    __atomic_store_n(&cpu->need_resched, 1, __ATOMIC_RELEASE);
+  }
+}
+
+int thread_set_priority(ThreadClass cls, uint32_t priority)
+{
+  static const uint8_t class_base[THREAD_CLASS_COUNT + 1]
+      = { THREAD_LATENCY_BASE, THREAD_NORMAL_BASE, THREAD_BACKGROUND_BASE, THREAD_PRIORITY_LEVELS };
+
+  if ((uint32_t) cls >= THREAD_CLASS_COUNT)
+  {
+    return -1;
+  }
+
+  uint32_t levels = class_base[cls + 1] - class_base[cls];
+  if (priority >= levels)
+  {
+    priority = levels - 1;
+  }
+
+  // Only ever the running thread, which sits in no queue
+  uint64_t flags = irq_save();
+  Thread *self = current;
+  int result = self ? 0 : -1;
+
+  // A thread demoted for using up its latency budget has to block first
+  if (self && cls == THREAD_CLASS_LATENCY && self->latency_ticks >= latency_budget_ticks)
+  {
+    result = -1;
+  }
+  else if (self)
+  {
+    self->sched_class = cls;
+    self->priority = class_base[cls] + priority;
+  }
+  irq_restore(flags);
+
+  return result;
+}
+
+void thread_set_time_slice(uint32_t milliseconds)
+{
+  uint32_t ticks = (uint32_t) ((uint64_t) milliseconds * pit_get_frequency() / 1000);
+  time_slice_ticks = ticks ? ticks : 1;
+}
+
+void thread_set_stack_size(uint32_t bytes)
+{
+  uint32_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+  stack_pages = pages == 0 ? 1 : pages > KSTACK_MAX_PAGES ? KSTACK_MAX_PAGES : pages;
+}
+
+int thread_is_stack_guard(uint64_t addr)
+{
+  if (addr < KSTACK_REGION_BASE || addr >= next_stack_slot)
+  {
+    return 0;
+  }
+  return (vmm_get_mapping(vmm_get_kernel_address_space(), addr) & PAGE_PRESENT) == 0;
+}
+
+static void release_stack_page(uint64_t entry) { pmm_free_page((void *) (entry & 0x000FFFFFFFFFF000ULL)); }
+
+// Map or unmap pages at the bottom of t's stack until exactly pages are mapped
+static int stack_resize(Thread *t, uint32_t pages)
+{
+  address_space_t *kernel_as = vmm_get_kernel_address_space();
+  uint64_t flags = spin_lock_irqsave(&stack_lock);
+  int result = 0;
+
+  if (pages < t->stack_pages)
+  {
+    uint64_t bottom = t->stack_top - (uint64_t) t->stack_pages * PAGE_SIZE;
+    vmm_unmap_range(kernel_as, bottom, (uint64_t) (t->stack_pages - pages) * PAGE_SIZE, release_stack_page);
+    t->stack_pages = pages;
+  }
+
+  while (t->stack_pages < pages)
+  {
+    void *frame = pmm_alloc_page_nozero();
+    if (!frame)
+    {
+      result = -1;
+      break;
+    }
+    pmm_set_owner(frame, PMM_OWNER_KERNEL_STACK);
+
+    uint64_t virt = t->stack_top - (uint64_t) (t->stack_pages + 1) * PAGE_SIZE;
+    if (vmm_map_page(kernel_as, virt, (uint64_t) frame, PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL | PAGE_NO_EXECUTE) != 0)
+    {
+      pmm_free_page(frame);
+      result = -1;
+      break;
+    }
+    t->stack_pages++;
+  }
+
+  spin_unlock_irqrestore(&stack_lock, flags);
+  return result;
+}
+
+// Move exited threads to the free list, pool_lock must be held. Threads only
+// get onto dead_threads once no CPU runs on their stack any more.
+static void reap_dead_threads(void)
+{
+  while (dead_threads)
+  {
+    Thread *t = dead_threads;
+    dead_threads = t->next;
+
+    if (free_thread_count >= THREAD_CACHE_MAX)
+    {
+      stack_resize(t, 0);
+      t->next = free_slots;
+      free_slots = t;
+      continue;
+    }
+
+    t->next = free_threads;
+    free_threads = t;
+    free_thread_count++;
+  }
+}
+
+// A thread with a kernel stack of the configured size, reusing an exited one
+// when possible
+static Thread *thread_alloc(void)
+{
+  uint64_t flags = spin_lock_irqsave(&pool_lock);
+  reap_dead_threads();
+
+  Thread *t = free_threads;
+  if (t)
+  {
+    free_threads = t->next;
+    free_thread_count--;
+  } else if ((t = free_slots))
+  {
+    free_slots = t->next;
+  } else if ((t = kmem_cache_alloc(thread_cache)))
+  {
+    next_stack_slot += KSTACK_SLOT_SIZE;
+    t->stack_top = next_stack_slot;
+    t->stack_pages = 0;
+    t->generation = 0;
+  }
+
+  spin_unlock_irqrestore(&pool_lock, flags);
+
+  if (!t)
+  {
+    return NULL;
+  }
+  t->generation++;
+
+  if (stack_resize(t, stack_pages) != 0)
+  {
+    stack_resize(t, 0);
+    flags = spin_lock_irqsave(&pool_lock);
+    t->next = free_slots;
+    free_slots = t;
+    spin_unlock_irqrestore(&pool_lock, flags);
+    return NULL;
+  }
+
+  t->on_cpu = 0;
+  t->queued = 0;
+  return t;
+}
+
+// New threads start out on the creating CPU, idle ones steal them from there
+static void thread_start(Thread *t)
+{
+  uint64_t flags = irq_save();
+  t->cpu = cpu_current_id();
+  run_queue_push(t, 0);
+  irq_restore(flags);
+}
+
+void thread_finish_switch()
+{
+  cpu_t *cpu = cpu_current();
+  Thread *prev = cpu->prev;
+  cpu->prev = NULL;
+
+  // From here on prev may run elsewhere, or be reaped if it died
+  if (prev)
+  {
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    if (prev->state == THREAD_DEAD)
+    {
+      spin_lock(&pool_lock);
+      prev->next = dead_threads;
+      dead_threads = prev;
+      spin_unlock(&pool_lock);
+    }
+  }
+
+  spin_lock(&pool_lock);
+  reap_dead_threads();
+  spin_unlock(&pool_lock);
+}
+
+// Every kernel thread starts here, switched to with interrupts disabled
+static void kernel_thread_start(void)
+{
+  thread_finish_switch();
+  __asm__ volatile("sti");
+  current->entry();
+  thread_exit();
+}
+
+static void thread_init_stats(Thread *t)
+{
+  t->slice_left = time_slice_ticks;
+  t->voluntary_switches = 0;
+  t->involuntary_switches = 0;
+  t->handoffs = 0;
+}
+
+// A kernel thread ready to be switched to, but not queued anywhere yet
+static Thread *thread_create_kernel(void (*entry)(void))
+{
+  Thread *t = thread_alloc();
+  if (!t)
+  {
+    return NULL;
+  }
+
+  // Slot tops are page aligned, so 16 byte aligned too
+  uint64_t *sp = (uint64_t *) t->stack_top;
+
+  // Setup initial stack frame
+  *(--sp) = 0; // Fake return address, keeps the ABI stack alignment
+  *(--sp) = (uint64_t) kernel_thread_start; // Return address for 'ret' instruction
+  *(--sp) = 0; // rbp
+  *(--sp) = 0; // rbx
+  *(--sp) = 0; // r12
+  *(--sp) = 0; // r13
+  *(--sp) = 0; // r14
+  *(--sp) = 0; // r15
+
+  t->rsp = (uint64_t) sp;
+  t->kernel_rsp = (uint64_t) sp;
+  t->user_rsp = 0;
+  t->is_user_mode = 0;
+  t->address_space = NULL;
+  t->entry = entry;
+  thread_init_stats(t);
+  t->state = THREAD_RUNNING;
+  t->next = NULL;
+  t->priority = THREAD_PRIORITY_DEFAULT;
+  t->sched_class = THREAD_CLASS_NORMAL;
+  t->waiting_on_port = NULL;
+  t->waits = NULL;
+  t->wait_count = 0;
+  t->wake_status = 0;
+  t->reply_to = NULL;
+  t->parked = 0;
+  t->unpark_pending = 0;
+  t->latency_ticks = 0;
+
+  return t;
+}
+
+void thread_create(void (*entry)(void))
+{
+  Thread *t = thread_create_kernel(entry);
+  if (t)
+  {
+    thread_start(t);
+  }
+}
+
+// Runs whenever its CPU finds nothing to do, and looks again on every tick
+static void idle_thread(void)
+{
+  for (;;)
+  {
+    __asm__ volatile("sti; hlt" : : : "memory");
+    thread_yield();
+  }
+}
+
+extern void usermode_trampoline(void);
+
+
+int thread_create_user(void (*entry)(void), void *user_stack, address_space_t *as)
+{
+  Thread *t = thread_alloc();
+  if (!t)
+  {
+    return -1;
+  }
+
+  uint64_t *sp = (uint64_t *) t->stack_top;
+
+  // TSS.rsp0 is set when the thread is switched to, user threads can be
+  // created from inside a syscall whose stack must stay in place
+
+  // Setup initial stack frame
+  // When context_switch returns, it will jump to usermode_trampoline
+  // The trampoline will load r12 and r13 into rdi/rsi and call jump_to_usermode
+
+  *(--sp) = (uint64_t) usermode_trampoline; // return address
+  *(--sp) = 0; // rbp
+  *(--sp) = 0; // rbx
+  *(--sp) = (uint64_t) entry; // r12 - will be loaded into rdi
+  *(--sp) = (uint64_t) user_stack; // r13 - will be loaded into rsi
+  *(--sp) = 0; // r14
+  *(--sp) = 0; // r15
+
+  t->rsp = (uint64_t) sp;
+  t->kernel_rsp = t->stack_top;
+  t->user_rsp = (uint64_t) user_stack;
+  t->is_user_mode = 1;
+  t->address_space = as;
+  t->entry = NULL;
+  thread_init_stats(t);
+  t->state = THREAD_RUNNING;
+  t->next = NULL;
+  t->priority = THREAD_PRIORITY_DEFAULT;
+  t->sched_class = THREAD_CLASS_NORMAL;
+  t->waiting_on_port = NULL;
+  t->waits = NULL;
+  t->wait_count = 0;
+  t->wake_status = 0;
+  t->reply_to = NULL;
+  t->parked = 0;
+  t->unpark_pending = 0;
+  t->latency_ticks = 0;
+
+  thread_start(t);
+  return 0;
+}
+
+// Make next the running thread on cpu, interrupts must be disabled. A thread
+// picked off another CPU's queue may still be switching away over there.
+static void switch_to(cpu_t *cpu, Thread *prev, uint64_t *prev_rsp, Thread *next, uint32_t slice)
+{
+  next->cpu = cpu->id;
+  next->slice_left = slice;
+  while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+  {
+    __asm__ volatile("pause");
+  }
+  next->on_cpu = 1;
+
+  cpu->thread = next;
+  cpu->prev = prev;
+
+  // IMPORTANT: If switching to a user thread, update TSS.rsp0
+  if (next->is_user_mode)
+  {
+    gdt_set_kernel_stack(next->kernel_rsp);
+  }
+
+  // Kernel threads run on the kernel's own tables, a user address space they
+  // borrowed could be torn down by its thread exiting on another CPU
+  vmm_switch_address_space(next->address_space ? next->address_space : vmm_get_kernel_address_space());
+  context_switch(prev_rsp, next->rsp);
+
+  // Running again on our own stack, possibly on another CPU
+  thread_finish_switch();
+}
+
+// Switch to the next runnable thread, interrupts must be disabled. A thread
+// preempted in an interrupt handler keeps its interrupted state (ring 3 or
+// not) in the interrupt frame on its kernel stack and resumes through it.
+static void schedule(int preempted)
+{
+  cpu_t *cpu = cpu_current();
+  Thread *prev = cpu->thread;
+
+  // Blocked threads simply stay off the queues, dead ones are reaped once
+  // we're off their stack
+  __atomic_store_n(&cpu->need_resched, 0, __ATOMIC_RELAXED);
+  if (prev->state == THREAD_RUNNING && prev != cpu->idle)
+  {
+    run_queue_push(prev, 0);
+  }
+
+  Thread *next = pick_next(cpu->id);
+  if (!next)
+  {
+    next = cpu->idle;
+  }
+
+  if (prev == next)
+  {
+    next->slice_left = time_slice_ticks;
+    return;
+  }
+
+  if (preempted)
+  {
+    prev->involuntary_switches++;
+  } else
+  {
+    prev->voluntary_switches++;
+  }
+
+  switch_to(cpu, prev, &prev->rsp, next, time_slice_ticks);
+}
+
+// Switch straight to the blocked thread next, skipping the run queues. It
+// inherits what is left of our slice, and we wait at the front of our level
+// unless we block. next must be off its CPU and claimed under ipc_lock, so
+// nobody else can wake it.
+static void handoff(Thread *next, int status)
+{
+  cpu_t *cpu = cpu_current();
+  Thread *prev = cpu->thread;
+
+  __atomic_store_n(&cpu->need_resched, 0, __ATOMIC_RELAXED);
+  next->waiting_on_port = NULL;
+  next->wake_status = status;
+  next->state = THREAD_RUNNING;
+  next->latency_ticks = 0;
+  if (prev->state == THREAD_RUNNING)
+  {
+    run_queue_push(prev, 1);
+  }
+
+  prev->voluntary_switches++;
+  prev->handoffs++;
+  switch_to(cpu, prev, &prev->rsp, next, prev->slice_left);
+}
+
+void thread_yield()
+{
+  if (!current)
+  {
+    return;
+  }
+
+  uint64_t flags = irq_save();
+  schedule(0);
+  irq_restore(flags);
+}
+
+void thread_park()
+{
+  uint64_t flags = spin_lock_irqsave(&park_lock);
+  Thread *self = current;
+  if (!self->unpark_pending)
+  {
+    self->parked = 1;
+    self->state = THREAD_BLOCKED;
+    spin_unlock(&park_lock);
+    schedule(0);
+    spin_lock(&park_lock);
+  }
+  self->unpark_pending = 0;
+  spin_unlock_irqrestore(&park_lock, flags);
+}
+
+void thread_unpark(Thread *t)
+{
+  uint64_t flags = spin_lock_irqsave(&park_lock);
+  if (t->parked)
+  {
+    t->parked = 0;
+    thread_wake(t, 0);
+  } else
+  {
+    t->unpark_pending = 1;
+  }
+  spin_unlock_irqrestore(&park_lock, flags);
+}
+
+// Switch away right now if a wakeup asked this CPU to, interrupts must be
+// disabled
+static void preempt_check(void)
+{
+  cpu_t *cpu = cpu_current();
+  Thread *t = cpu->thread;
+  if (t && t != cpu->idle && t->state == THREAD_RUNNING && __atomic_load_n(&cpu->need_resched, __ATOMIC_ACQUIRE))
+  {
+    schedule(1);
+  }
+}
+
+void thread_tick()
+{
+  // The idle thread looks for work on every tick by itself
+  Thread *t = current;
+  if (!t || t == cpu_current()->idle || t->state != THREAD_RUNNING)
+  {
+    return;
+  }
+
+  // Something more urgent was woken for this CPU
+  if (__atomic_load_n(&cpu_current()->need_resched, __ATOMIC_ACQUIRE))
+  {
+    preempt_check();
+    return;
+  }
+
+  // Latency threads only keep their class while they block regularly
+  if (t->sched_class == THREAD_CLASS_LATENCY && ++t->latency_ticks >= latency_budget_ticks)
+  {
+    t->sched_class = THREAD_CLASS_NORMAL;
+    t->priority = THREAD_NORMAL_BASE + (t->priority - THREAD_LATENCY_BASE);
+    schedule(1);
+    return;
+  }
+
+  if (t->slice_left > 1)
+  {
+    t->slice_left--;
+    return;
+  }
+
+  schedule(1);
+}
+
+// Never returns, the thread is simply never scheduled again
+void thread_exit()
+{
+  irq_save();
+
+  if (current)
+  {
+    current->state = THREAD_DEAD;
+
+    // Whoever still waits for our reply() won't get one
+    spin_lock(&ipc_lock);
+    if (current->reply_to)
+    {
+      thread_wake(current->reply_to, -6);
+      current->reply_to = NULL;
+    }
+    spin_unlock(&ipc_lock);
+
+    serial_print("Thread: Exited after ");
+    serial_print_dec(current->voluntary_switches);
+    serial_print(" voluntary (");
+    serial_print_dec(current->handoffs);
+    serial_print(" handoffs) and ");
+    serial_print_dec(current->involuntary_switches);
+    serial_print(" involuntary switches\n");
+
+    // Threads don't share address spaces yet, so it dies with its thread
+    if (current->address_space)
+    {
+      async_destroy(current->address_space);
+      vmm_destroy_address_space(current->address_space);
+      current->address_space = NULL;
+    }
+
+    schedule(0);
+  }
+
+  // Nothing else left to run
+  for (;;)
+  {
+    __asm__ volatile("cli; hlt");
+  }
+}
+
+void scheduler_start()
+{
+  irq_save();
+
+  cpu_t *cpu = cpu_current();
+  cpu->idle = thread_create_kernel(idle_thread);
+  if (!cpu->idle)
+  {
+    serial_print("Thread: Error: Failed to create idle thread!\n");
+    return;
+  }
+
+  cpu->idle->sched_class = THREAD_CLASS_BACKGROUND;
+  cpu->idle->priority = THREAD_PRIORITY_LEVELS - 1;
+
+  Thread *next = pick_next(cpu->id);
+  if (!next)
+  {
+    next = cpu->idle;
+  }
+
+  // The boot context is never resumed
+  uint64_t dummy = 0;
+  switch_to(cpu, NULL, &dummy, next, time_slice_ticks);
+}
+
+Thread *thread_current() { return current; }
+
+static Message *message_alloc(void)
+{
+  Message *msg = kmem_cache_alloc(message_cache);
+  if (!msg)
+  {
+    return NULL;
+  }
+
+  msg->next = NULL;
+  msg->caller = NULL;
+  msg->grant = NULL;
+  return msg;
+}
+
+// Pages still attached go with the message
+static void message_free(Message *msg)
+{
+  vma_grant_free(msg->grant);
+  kmem_cache_free(message_cache, msg);
+}
+
+static port_ring_t *ring_alloc(uint32_t capacity)
+{
+  uint32_t size = 1;
+  while (size < capacity)
+  {
+    size <<= 1;
+  }
+
+  port_ring_t *ring = kmem_cache_alloc(ring_cache);
+  if (!ring)
+  {
+    return NULL;
+  }
+
+  ring->slots = kmalloc(size * sizeof(ring_slot_t));
+  if (!ring->slots)
+  {
+    kmem_cache_free(ring_cache, ring);
+    return NULL;
+  }
+
+  ring->tail = 0;
+  ring->head_cache = 0;
+  ring->produced = 0;
+  ring->dropped = 0;
+  ring->blocked_sends = 0;
+  ring->head = 0;
+  ring->tail_cache = 0;
+  ring->consumed = 0;
+  ring->producer = 0;
+  ring->consumer = 0;
+  ring->producer_waiting = 0;
+  ring->consumer_waiting = 0;
+  ring->mask = size - 1;
+  return ring;
+}
+
+static void ring_free(port_ring_t *ring)
+{
+  if (ring)
+  {
+    kfree(ring->slots);
+    kmem_cache_free(ring_cache, ring);
+  }
+}
+
+static int port_table_grow(void)
+{
+  uint32_t new_size = port_table_size ? port_table_size * 2 : PORT_TABLE_INITIAL_SIZE;
+  Port **new_table = kmalloc(new_size * sizeof(Port *));
+  if (!new_table)
+  {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < new_size; i++)
+  {
+    new_table[i] = i < port_table_size ? port_table[i] : NULL;
+  }
+
+  kfree(port_table);
+  port_table = new_table;
+  port_table_size = new_size;
+  return 0;
+}
+
+Port *port_create()
+{
+  Port *port = kmem_cache_alloc(port_cache);
+  if (!port)
+  {
+    return NULL;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+
+  uint32_t slot = 0;
+  while (slot < port_table_size && port_table[slot])
+  {
+    slot++;
+  }
+
+  if (slot == port_table_size && port_table_grow() != 0)
+  {
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    kmem_cache_free(port_cache, port);
+    return NULL;
+  }
+
+  port->id = slot + 1;
+  port->refs = 1; // The table's
+  port_table[slot] = port;
+
+  spin_unlock_irqrestore(&ipc_lock, flags);
+  return port;
+}
+
+// Queue self as a receiver on port through waiter, ipc_lock must be held
+static void port_wait(Port *port, port_waiter_t *waiter, Thread *self)
+{
+  waiter->thread = self;
+  waiter->port = port;
+  waiter->next = NULL;
+  waiter->prev = port->recv_waiters_tail;
+  if (port->recv_waiters_tail)
+  {
+    port->recv_waiters_tail->next = waiter;
+  } else
+  {
+    port->recv_waiters = waiter;
+  }
+  port->recv_waiters_tail = waiter;
+}
+
+static void port_unwait(port_waiter_t *waiter)
+{
+  Port *port = waiter->port;
+  if (waiter->prev)
+  {
+    waiter->prev->next = waiter->next;
+  } else
+  {
+    port->recv_waiters = waiter->next;
+  }
+
+  if (waiter->next)
+  {
+    waiter->next->prev = waiter->prev;
+  } else
+  {
+    port->recv_waiters_tail = waiter->prev;
+  }
+}
+
+// Block self receiving on count ports through waiters, ipc_lock must be held
+static void ports_wait(Port *const *ports, uint32_t count, port_waiter_t *waiters, Thread *self)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    port_wait(ports[i], &waiters[i], self);
+  }
+
+  self->state = THREAD_BLOCKED;
+  self->waiting_on_port = ports[0];
+  self->wake_status = 0;
+  self->waits = waiters;
+  self->wait_count = count;
+}
+
+// Take the longest waiting receiver off port, and off every other port it
+// waits on. ipc_lock must be held. Returns the claimed thread, NULL if
+// nobody waits.
+static Thread *port_claim_receiver(Port *port)
+{
+  if (!port->recv_waiters)
+  {
+    return NULL;
+  }
+
+  Thread *t = port->recv_waiters->thread;
+  for (uint32_t i = 0; i < t->wait_count; i++)
+  {
+    port_unwait(&t->waits[i]);
+  }
+  t->waits = NULL;
+  t->wait_count = 0;
+  return t;
+}
+
+void port_destroy(Port *port)
+{
+  if (!port)
+  {
+    return;
+  }
+
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+  if (port->dead)
+  {
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    return;
+  }
+  port->dead = 1;
+
+  Message *msg = port->queue_head;
+  while (msg)
+  {
+    Message *next = msg->next;
+    if (msg->caller)
+    {
+      thread_wake(msg->caller, -5); // Port destroyed before the call was received
+    }
+    message_free(msg);
+    msg = next;
+  }
+
+  Thread *receiver;
+  while ((receiver = port_claim_receiver(port)))
+  {
+    thread_wake(receiver, -5); // Port destroyed
+  }
+
+  while (port->send_waiters)
+  {
+    Thread *sender = port->send_waiters;
+    port->send_waiters = sender->wait_next;
+    thread_wake(sender, -5);
+  }
+
+  port->queue_head = NULL;
+  port->queue_tail = NULL;
+  port->message_count = 0;
+  port->send_waiters_tail = NULL;
+
+  if (port->id && port->id <= port_table_size && port_table[port->id - 1] == port)
+  {
+    port_table[port->id - 1] = NULL;
+  }
+
+  spin_unlock_irqrestore(&ipc_lock, flags);
+  port_put(port); // The table's reference
+}
+
+Port *port_get(Port *port)
+{
+  if (port)
+  {
+    __atomic_fetch_add(&port->refs, 1, __ATOMIC_RELAXED);
+  }
+  return port;
+}
+
+// Threads blocked on a port hold a reference through their syscall, so the
+// last one is only dropped once nobody touches the port any more
+void port_put(Port *port)
+{
+  if (!port || __atomic_sub_fetch(&port->refs, 1, __ATOMIC_ACQ_REL))
+  {
+    return;
+  }
+
+  // Back to constructed state before returning it to the cache
+  port_ring_t *ring = port->ring;
+  port_ctor(port);
+  ring_free(ring);
+  kmem_cache_free(port_cache, port);
+}
+
+int port_configure(Port *port, uint32_t capacity, port_overflow_t overflow, uint32_t flags)
+{
+  if (!port || capacity == 0 || capacity > PORT_MAX_CAPACITY || (uint32_t) overflow >= PORT_OVERFLOW_COUNT
+      || (flags & ~PORT_RING))
+  {
+    return -1;
+  }
+
+  // Only the consumer may touch queued slots, so a ring can't drop the oldest
+  port_ring_t *ring = NULL;
+  if (flags & PORT_RING)
+  {
+    if (overflow == PORT_OVERFLOW_DROP_OLDEST || !(ring = ring_alloc(capacity)))
+    {
+      return -1;
+    }
+    capacity = ring->mask + 1;
+  }
+
+  uint64_t irq = spin_lock_irqsave(&ipc_lock);
+
+  // Nothing synchronizes with a ring's two ends, so it stays as it is and can
+  // only replace a queue nobody uses right now
+  if (port->ring || (ring && (port->queue_head || port->recv_waiters || port->send_waiters)))
+  {
+    spin_unlock_irqrestore(&ipc_lock, irq);
+    ring_free(ring);
+    return -1;
+  }
+
+  port->capacity = capacity;
+  port->overflow = overflow;
+
+  // Lockless senders and receivers read the policy once they see the ring
+  if (ring)
+  {
+    __atomic_store_n(&port->ring, ring, __ATOMIC_RELEASE);
+  }
+
+  // Growing the queue (or giving up on blocking) lets waiting senders retry,
+  // they re-check the bound themselves
+  while (port->send_waiters)
+  {
+    Thread *sender = port->send_waiters;
+    port->send_waiters = sender->wait_next;
+    thread_wake(sender, 0);
+  }
+  port->send_waiters_tail = NULL;
+
+  spin_unlock_irqrestore(&ipc_lock, irq);
+  return 0;
+}
+
+void port_get_stats(Port *port, port_stats_t *stats)
+{
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+  port_stats_t snapshot = port->stats;
+  snapshot.depth = port->message_count;
+  snapshot.capacity = port->capacity;
+  snapshot.overflow = port->overflow;
+
+  // The ring's counters belong to its two ends, this is only a rough snapshot
+  port_ring_t *ring = port->ring;
+  if (ring)
+  {
+    snapshot.depth = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    snapshot.sent = __atomic_load_n(&ring->produced, __ATOMIC_RELAXED);
+    snapshot.received = __atomic_load_n(&ring->consumed, __ATOMIC_RELAXED);
+    snapshot.dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    snapshot.blocked_sends = __atomic_load_n(&ring->blocked_sends, __ATOMIC_RELAXED);
+  }
+  spin_unlock_irqrestore(&ipc_lock, flags);
+
+  // Copied out after dropping the lock, stats may have to be faulted in
+  *stats = snapshot;
+}
+
+// Port ID management for syscall interface
+uint32_t port_to_id(Port *port)
+{
+  if (!port)
+  {
+    return 0;
+  }
+
+  // IDs are table slots plus 1 so that 0 can be an invalid ID
+  return port->id;
+}
+
+Port *port_from_id(uint32_t id)
+{
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+
+  // ID 0 is invalid. Convert back to index (subtract 1), NULL if the port
+  // was destroyed. The table's reference keeps it alive until ours is taken.
+  Port *port = port_get(id == 0 || id > port_table_size ? NULL : port_table[id - 1]);
+
+  spin_unlock_irqrestore(&ipc_lock, flags);
+  return port;
+}
+
+// Unlink the oldest queued message, ipc_lock must be held. A sender waiting
+// for room gets to retry.
+static Message *port_pop(Port *port)
+{
+  Message *msg = port->queue_head;
+  if (!msg)
+  {
+    return NULL;
+  }
+
+  port->queue_head = msg->next;
+  if (!port->queue_head)
+  {
+    port->queue_tail = NULL;
+  }
+  port->message_count--;
+
+  Thread *sender = port->send_waiters;
+  if (sender)
+  {
+    port->send_waiters = sender->wait_next;
+    if (!port->send_waiters)
+    {
+      port->send_waiters_tail = NULL;
+    }
+    thread_wake(sender, 0);
+  }
+
+  return msg;
+}
+
+// Make room for one more message, ipc_lock must be held with interrupts
+// disabled. Applies the port's overflow policy, so it may block and drop the
+// lock meanwhile unless may_block is clear. Returns 0 once there's room,
+// negative if the message must not be queued (the port may be gone then).
+static int port_make_room(Port *port, int may_block)
+{
+  if (port->dead)
+  {
+    return -5; // Port destroyed
+  }
+
+  while (port->message_count >= port->capacity)
+  {
+    Thread *self = current;
+
+    switch (port->overflow)
+    {
+      case PORT_OVERFLOW_DROP_OLDEST:
+      {
+        Message *old = port_pop(port);
+        if (old->caller)
+        {
+          thread_wake(old->caller, -7); // Dropped before it was received
+        }
+        message_free(old);
+        port->stats.dropped++;
+        break;
+      }
+
+      case PORT_OVERFLOW_BLOCK:
+      {
+        // Not dropped, the caller keeps it
+        if (self && !may_block)
+        {
+          return -7; // Queue full
+        }
+
+        // Nothing to block in the boot context, fail like the default policy
+        if (self)
+        {
+          self->state = THREAD_BLOCKED;
+          self->waiting_on_port = port;
+          self->wake_status = 0;
+          self->wait_next = NULL;
+          if (port->send_waiters_tail)
+          {
+            port->send_waiters_tail->wait_next = self;
+          } else
+          {
+            port->send_waiters = self;
+          }
+          port->send_waiters_tail = self;
+          port->stats.blocked_sends++;
+
+          spin_unlock(&ipc_lock);
+          schedule(0);
+          spin_lock(&ipc_lock);
+
+          if (self->wake_status != 0)
+          {
+            return self->wake_status; // Port destroyed
+          }
+          break;
+        }
+      }
+        // fall through
+
+      default:
+      {
+        port->stats.dropped++;
+        return -7; // Queue full
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Append msg to port's queue, ipc_lock must be held. Returns the receiver
+// that waited longest on it, now claimed by the caller and off its ports.
+static Thread *port_enqueue(Port *port, Message *msg)
+{
+  if (port->queue_tail)
+  {
+    port->queue_tail->next = msg;
+    port->queue_tail = msg;
+  } else
+  {
+    port->queue_head = msg;
+    port->queue_tail = msg;
+  }
+
+  port->message_count++;
+  port->stats.sent++;
+  if (port->message_count > port->stats.high_water)
+  {
+    port->stats.high_water = port->message_count;
+  }
+
+  return port_claim_receiver(port);
+}
+
+// Run the claimed, blocked thread t next: directly if it's fully off its CPU,
+// through its run queue otherwise. Drops ipc_lock, interrupts must be
+// disabled and stay so.
+static void switch_to_woken(Thread *t, int status)
+{
+  if (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE))
+  {
+    thread_wake(t, status);
+    spin_unlock(&ipc_lock);
+    schedule(0);
+    return;
+  }
+
+  spin_unlock(&ipc_lock);
+  handoff(t, status);
+}
+
+// The thread we received a call from waits for us, a newer call replaces it
+static void take_reply(Thread *self, Thread *caller)
+{
+  if (self->reply_to)
+  {
+    thread_wake(self->reply_to, -6); // Never got a reply
+  }
+  self->reply_to = caller;
+}
+
+// Stack slot index and generation, never 0 and never shared with a thread
+// that exited and whose Thread was reused
+static uint64_t thread_handle(Thread *t)
+{
+  uint64_t slot = (t->stack_top - KSTACK_REGION_BASE) / KSTACK_SLOT_SIZE;
+  return (slot << 32) | t->generation;
+}
+
+// Claim one end of a ring for self the first time it's used
+static int ring_bind(uint64_t *owner, Thread *self)
+{
+  if (!self)
+  {
+    return -2; // No current thread?
+  }
+
+  uint64_t handle = thread_handle(self);
+  uint64_t bound = __atomic_load_n(owner, __ATOMIC_RELAXED);
+  if (bound == handle)
+  {
+    return 0;
+  }
+
+  uint64_t expected = 0;
+  if (!bound && __atomic_compare_exchange_n(owner, &expected, handle, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    return 0;
+  }
+  return -8; // Another thread owns this end
+}
+
+// Sleep until the other end of the ring makes progress. The waiting flag is
+// set before a full fence and the ring re-checked after it, while the other
+// end publishes its index before a fence and checks the flag after it, so one
+// of the two always sees the other. Returns 0 to retry.
+static int ring_block(Port *port, port_ring_t *ring, int producer)
+{
+  Thread *self = current;
+  port_waiter_t waiter;
+  uint32_t *waiting = producer ? &ring->producer_waiting : &ring->consumer_waiting;
+
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+  if (port->dead)
+  {
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    return -5; // Port destroyed, nobody would wake us
+  }
+  __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  uint32_t depth = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (producer ? depth <= ring->mask : depth != 0)
+  {
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    return 0;
+  }
+
+  if (producer)
+  {
+    self->state = THREAD_BLOCKED;
+    self->waiting_on_port = port;
+    self->wake_status = 0;
+    self->wait_next = NULL;
+    port->send_waiters = self;
+    port->send_waiters_tail = self;
+  } else
+  {
+    ports_wait(&port, 1, &waiter, self);
+  }
+
+  spin_unlock(&ipc_lock);
+  schedule(0);
+  irq_restore(flags);
+
+  return self->wake_status; // Port destroyed if not 0
+}
+
+// Wake the other end, it said it's blocked
+static void ring_wake(Port *port, port_ring_t *ring, int producer)
+{
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+
+  Thread *t;
+  if (producer)
+  {
+    __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+    t = port->send_waiters;
+    port->send_waiters = NULL;
+    port->send_waiters_tail = NULL;
+  } else
+  {
+    __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+    t = port_claim_receiver(port);
+  }
+
+  if (t)
+  {
+    thread_wake(t, 0);
+  }
+
+  spin_unlock(&ipc_lock);
+  preempt_check();
+  irq_restore(flags);
+}
+
+// send() on a ring port. Takes no lock and touches only the producer's cache
+// line unless the ring looks full or the consumer sleeps.
+static int ring_send(Port *port, port_ring_t *ring, const ring_slot_t *slot, int may_block)
+{
+  int bound = ring_bind(&ring->producer, current);
+  if (bound != 0)
+  {
+    return bound;
+  }
+
+  // The caller's port reference keeps the ring itself alive
+  if (__atomic_load_n(&port->dead, __ATOMIC_ACQUIRE))
+  {
+    return -5; // Port destroyed
+  }
+
+  uint32_t tail = ring->tail;
+  while (tail - ring->head_cache > ring->mask)
+  {
+    ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - ring->head_cache <= ring->mask)
+    {
+      break;
+    }
+
+    if (port->overflow != PORT_OVERFLOW_BLOCK)
+    {
+      ring->dropped++;
+      return -7; // Queue full
+    }
+
+    if (!may_block)
+    {
+      return -7; // Queue full, not dropped
+    }
+
+    ring->blocked_sends++;
+    int status = ring_block(port, ring, 1);
+    if (status != 0)
+    {
+      return status;
+    }
+  }
+
+  ring->slots[tail & ring->mask] = *slot;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  ring->produced++;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED))
+  {
+    ring_wake(port, ring, 0);
+  }
+  return 0; // Success
+}
+
+// recv() on a ring port, the mirror image of ring_send()
+static int ring_recv(Port *port, port_ring_t *ring, Message *msg_out, int may_block)
+{
+  int bound = ring_bind(&ring->consumer, current);
+  if (bound != 0)
+  {
+    return bound;
+  }
+
+  if (__atomic_load_n(&port->dead, __ATOMIC_ACQUIRE))
+  {
+    return -5; // Port destroyed
+  }
+
+  uint32_t head = ring->head;
+  while (head == ring->tail_cache)
+  {
+    ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head != ring->tail_cache)
+    {
+      break;
+    }
+
+    if (!may_block)
+    {
+      return -3; // Nothing queued
+    }
+
+    int status = ring_block(port, ring, 0);
+    if (status != 0)
+    {
+      return status;
+    }
+  }
+
+  // Copied out after releasing the slot, msg_out may have to be faulted in
+  ring_slot_t slot = ring->slots[head & ring->mask];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  ring->consumed++;
+
+  // Only a BLOCK ring has a producer that may be asleep
+  if (port->overflow == PORT_OVERFLOW_BLOCK)
+  {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_RELAXED))
+    {
+      ring_wake(port, ring, 1);
+    }
+  }
+
+  msg_out->id = slot.id;
+  for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
+  {
+    msg_out->data[i] = slot.data[i];
+  }
+  return 0; // Success
+}
+
+// Queue msg on port and wake its receiver, applying the overflow policy if
+// it's full (without blocking unless may_block). Returns 0 once msg belongs
+// to the port. Rings take no Messages.
+static int message_send(Port *port, Message *msg, int may_block)
+{
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+
+  int room = port->ring ? -1 : port_make_room(port, may_block);
+  if (room != 0)
+  {
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    return room;
+  }
+
+  // Check if a thread is blocked waiting on this port
+  Thread *blocked = port_enqueue(port, msg);
+  if (blocked)
+  {
+    thread_wake(blocked, 0);
+  }
+
+  // A receiver that outranks us on this CPU runs right away
+  spin_unlock(&ipc_lock);
+  preempt_check();
+  irq_restore(flags);
+  return 0; // Success
+}
+
+int send(Port *port, uint32_t id, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3)
+{
+  if (!port)
+  {
+    return -1; // Invalid port
+  }
+
+  // Ports never go back from ring mode, so this needs no lock
+  port_ring_t *ring = __atomic_load_n(&port->ring, __ATOMIC_ACQUIRE);
+  if (ring)
+  {
+    ring_slot_t slot = { .id = id, .data = { d0, d1, d2, d3 } };
+    return ring_send(port, ring, &slot, 1);
+  }
+
+  Message *msg = message_alloc();
+  if (!msg)
+  {
+    return -2; // Out of messages
+  }
+
+  msg->id = id;
+  msg->data[0] = d0;
+  msg->data[1] = d1;
+  msg->data[2] = d2;
+  msg->data[3] = d3;
+
+  int result = message_send(port, msg, 1);
+  if (result != 0)
+  {
+    message_free(msg);
+
+    // Turned into a ring since we looked
+    if (result == -1)
+    {
+      return send(port, id, d0, d1, d2, d3);
+    }
+  }
+  return result;
+}
+
+int send_batch(Port *port, const ipc_message_t *msgs, uint32_t count)
+{
+  if (!port || !msgs || count == 0 || count > IPC_BATCH_MAX)
+  {
+    return -1; // Invalid parameters
+  }
 
-  for (int i = 0; i < MAX_MESSAGES; i++)
+  // Only the first message may wait for room, after that we return what got through
+  uint32_t sent = 0;
+  port_ring_t *ring = __atomic_load_n(&port->ring, __ATOMIC_ACQUIRE);
+  if (ring)
   {
-    message_pool[i].next = NULL;
+    for (; sent < count; sent++)
+    {
+      ring_slot_t slot = { .id = msgs[sent].id };
+      for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
+      {
+        slot.data[i] = msgs[sent].data[i];
+      }
+
+      int result = ring_send(port, ring, &slot, sent == 0);
+      if (result != 0)
+      {
+        return sent ? (int) sent : result;
+      }
+    }
+    return sent;
   }
 
-  for (int i = 0; i < MAX_PORTS; i++)
+  Message *batch[IPC_BATCH_CHUNK];
+  while (sent < count)
   {
-    ports[i].queue_head = NULL;
-    ports[i].queue_tail = NULL;
-    ports[i].message_count = 0;
-    ports[i].blocked_thread = NULL;
+    uint32_t chunk = count - sent < IPC_BATCH_CHUNK ? count - sent : IPC_BATCH_CHUNK;
+
+    // Copied in before taking the lock, msgs may have to be faulted in
+    uint32_t ready = 0;
+    for (; ready < chunk; ready++)
+    {
+      Message *msg = message_alloc();
+      if (!msg)
+      {
+        break;
+      }
+
+      msg->id = msgs[sent + ready].id;
+      for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
+      {
+        msg->data[i] = msgs[sent + ready].data[i];
+      }
+      batch[ready] = msg;
+    }
+
+    if (ready == 0)
+    {
+      return sent ? (int) sent : -2; // Out of messages
+    }
+
+    // One lock round trip for the whole chunk, every message wakes a receiver
+    uint64_t flags = spin_lock_irqsave(&ipc_lock);
+    uint32_t queued = 0;
+    int result = 0;
+    while (queued < ready)
+    {
+      result = port->ring ? -1 : port_make_room(port, sent + queued == 0);
+      if (result != 0)
+      {
+        break;
+      }
+
+      Thread *receiver = port_enqueue(port, batch[queued++]);
+      if (receiver)
+      {
+        thread_wake(receiver, 0);
+      }
+    }
+
+    spin_unlock(&ipc_lock);
+    preempt_check();
+    irq_restore(flags);
+
+    for (uint32_t i = queued; i < ready; i++)
+    {
+      message_free(batch[i]);
+    }
+
+    sent += queued;
+    if (result != 0 || ready < chunk)
+    {
+      return sent ? (int) sent : result;
+    }
   }
+
+  return sent;
 }
 
-void thread_create(void (*entry)(void))
+int send_grant(Port *port, const Message *msg, uint64_t addr, uint64_t length, uint32_t flags)
 {
-  if (thread_count >= MAX_THREADS)
+  if (!port || !msg || length > IPC_GRANT_MAX_SIZE || (flags & ~GRANT_SHARE))
   {
-    return;
+    return -1; // Invalid parameters
   }
 
-  Thread *t = &threads[thread_count];
-  uint8_t *stack = stacks[thread_count];
-  uint64_t *sp = (uint64_t *) (stack + STACK_SIZE);
-
-  // Align stack to 16 bytes
-  sp = (uint64_t *) ((uint64_t) sp & ~0xF);
+  Thread *self = current;
+  if (!self || !self->address_space)
+  {
+    return -2; // Only user threads have pages to grant
+  }
 
-  // Setup initial stack frame
-  *(--sp) = (uint64_t) entry; // Return address for 'ret' instruction
-  *(--sp) = 0; // rbp
-  *(--sp) = 0; // rbx
-  *(--sp) = 0; // r12
-  *(--sp) = 0; // r13
-  *(--sp) = 0; // r14
-  *(--sp) = 0; // r15
+  Message *grant_msg = message_alloc();
+  if (!grant_msg)
+  {
+    return -2; // Out of messages
+  }
 
-  t->rsp = (uint64_t) sp;
-  t->kernel_rsp = (uint64_t) sp;
-  t->user_rsp = 0;
-  t->is_user_mode = 0;
-  t->state = THREAD_RUNNING;
-  t->next = NULL;
-  t->waiting_on_port = NULL;
+  grant_msg->id = msg->id;
+  for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
+  {
+    grant_msg->data[i] = msg->data[i];
+  }
 
-  if (!thread_list)
+  grant_msg->grant = vma_grant_take(self->address_space, addr, length, flags & GRANT_SHARE);
+  if (!grant_msg->grant)
   {
-    thread_list = t;
-    t->next = t;
-    current = t;
-  } else
+    message_free(grant_msg);
+    return -1; // Range can't be granted
+  }
+
+  // Rings only carry the four words, message_send() turns them down
+  int result = message_send(port, grant_msg, 1);
+  if (result != 0)
   {
-    Thread *it = thread_list;
-    while (it->next != thread_list)
+    // Shared pages never left, moved ones go back where they were
+    vm_grant_t *grant = grant_msg->grant;
+    grant_msg->grant = NULL;
+    message_free(grant_msg);
+    if (flags & GRANT_SHARE)
     {
-      it = it->next;
+      vma_grant_free(grant);
+    } else
+    {
+      vma_grant_map(self->address_space, grant, &addr);
     }
-    it->next = t;
-    t->next = thread_list;
   }
-
-  thread_count++;
+  return result;
 }
 
-extern void usermode_trampoline(void);
-
-
-void thread_create_user(void (*entry)(void), void *user_stack)
+// Take the oldest queued message into msg_out, ipc_lock must be held
+static int port_dequeue(Port *port, Message *msg_out)
 {
-  if (thread_count >= MAX_THREADS)
+  Message *msg = port_pop(port);
+  if (!msg)
   {
-    return;
+    return -1;
   }
 
-  Thread *t = &threads[thread_count];
-  uint8_t *kernel_stack = stacks[thread_count];
-  uint64_t *sp = (uint64_t *) (kernel_stack + STACK_SIZE);
-
-  sp = (uint64_t *) ((uint64_t) sp & ~0xF);
+  port->stats.received++;
 
-  gdt_set_kernel_stack((uint64_t) sp);
+  msg_out->id = msg->id;
+  msg_out->data[0] = msg->data[0];
+  msg_out->data[1] = msg->data[1];
+  msg_out->data[2] = msg->data[2];
+  msg_out->data[3] = msg->data[3];
+  msg_out->caller = msg->caller;
+  msg_out->grant = msg->grant;
+  msg->grant = NULL;
 
-  // Setup initial stack frame
-  // When context_switch returns, it will jump to usermode_trampoline
-  // The trampoline will load r12 and r13 into rdi/rsi and call jump_to_usermode
+  message_free(msg);
+  return 0;
+}
 
-  *(--sp) = (uint64_t) usermode_trampoline; // return address
-  *(--sp) = 0; // rbp
-  *(--sp) = 0; // rbx
-  *(--sp) = (uint64_t) entry; // r12 - will be loaded into rdi
-  *(--sp) = (uint64_t) user_stack; // r13 - will be loaded into rsi
-  *(--sp) = 0; // r14
-  *(--sp) = 0; // r15
+// Only the ID and data reach userspace, its Message has nothing else
+static void message_copy_out(Message *dst, const Message *src)
+{
+  dst->id = src->id;
+  for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
+  {
+    dst->data[i] = src->data[i];
+  }
+}
 
-  t->rsp = (uint64_t) sp;
-  t->kernel_rsp = (uint64_t) (kernel_stack + STACK_SIZE);
-  t->user_rsp = (uint64_t) user_stack;
-  t->is_user_mode = 1;
-  t->state = THREAD_RUNNING;
-  t->next = NULL;
-  t->waiting_on_port = NULL;
+// Copy a received message out. Its pages are mapped into our address space
+// if grant asks for them and freed otherwise.
+static int message_deliver(Message *msg_out, Message *msg, ipc_grant_t *grant)
+{
+  message_copy_out(msg_out, msg);
 
-  if (!thread_list)
-  {
-    thread_list = t;
-    t->next = t;
-    current = t;
-  } else
+  ipc_grant_t mapped = { 0, 0 };
+  int result = 0; // Success
+  if (msg->grant)
   {
-    Thread *it = thread_list;
-    while (it->next != thread_list)
+    address_space_t *as = current->address_space;
+    uint64_t length = msg->grant->pages * PAGE_SIZE;
+    if (!grant || !as)
     {
-      it = it->next;
+      vma_grant_free(msg->grant);
+    } else if (vma_grant_map(as, msg->grant, &mapped.addr) == 0)
+    {
+      mapped.length = length;
+    } else
+    {
+      result = -9; // No room for the pages, the message itself arrived
     }
-    it->next = t;
-    t->next = thread_list;
   }
 
-  thread_count++;
+  if (grant)
+  {
+    *grant = mapped;
+  }
+  return result;
 }
 
-static Thread *find_next_runnable(Thread *start)
+// recv() with ipc_lock held, taken with flags. If it has to block and
+// replying is set, the CPU goes straight to that caller. Pages sent along
+// are mapped if grant is set. Drops the lock.
+static int recv_locked(Port *port, Message *msg_out, uint64_t flags, Thread *replying, ipc_grant_t *grant)
 {
-  Thread *candidate = start->next;
-
-  while (candidate != start)
+  // Copied out after dropping the lock, msg_out may have to be faulted in
+  Message msg;
+  Thread *self = current;
+  port_waiter_t waiter;
+
+  // Another receiver may take the message we were woken for, then we just
+  // wait for the next one
+  while (port_dequeue(port, &msg) != 0)
   {
-    if (candidate->state == THREAD_RUNNING)
+    if (port->dead)
+    {
+      spin_unlock_irqrestore(&ipc_lock, flags);
+      return -5; // Port destroyed
+    }
+
+    ports_wait(&port, 1, &waiter, self);
+
+    // A sender may wake us as soon as the lock drops, interrupts stay off so
+    // we still get to switch away before anything else runs here
+    if (replying)
+    {
+      switch_to_woken(replying, 0);
+      replying = NULL;
+    } else
+    {
+      spin_unlock(&ipc_lock);
+      schedule(0);
+    }
+
+    // The port may have been destroyed while we were blocked
+    if (self->wake_status != 0)
     {
-      return candidate;
+      irq_restore(flags);
+      return self->wake_status;
     }
-    candidate = candidate->next;
+
+    spin_lock(&ipc_lock);
   }
 
-  if (start->state == THREAD_RUNNING)
+  if (replying)
   {
-    return start;
+    thread_wake(replying, 0);
   }
-
-  return NULL;
+  take_reply(self, msg.caller);
+  spin_unlock_irqrestore(&ipc_lock, flags);
+  return message_deliver(msg_out, &msg, grant);
 }
 
-void thread_yield()
+int recv(Port *port, Message *msg_out) { return recv_grant(port, msg_out, NULL); }
+
+int recv_grant(Port *port, Message *msg_out, ipc_grant_t *grant)
 {
-  if (!current)
+  if (!port || !msg_out)
   {
-    return;
+    return -1; // Invalid parameters
   }
 
-  Thread *prev = current;
-  Thread *next = find_next_runnable(current);
-
-  if (!next)
+  if (!current)
   {
-    return;
+    return -2; // No current thread?
   }
 
-  current = next;
-
-  // IMPORTANT: If switching to a user thread, update TSS.rsp0
-  if (next->is_user_mode)
+  port_ring_t *ring = __atomic_load_n(&port->ring, __ATOMIC_ACQUIRE);
+  if (ring)
   {
-    gdt_set_kernel_stack(next->kernel_rsp);
+    if (grant)
+    {
+      grant->addr = 0;
+      grant->length = 0;
+    }
+    return ring_recv(port, ring, msg_out, 1);
   }
 
-  if (prev != next)
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+  if (port->ring)
   {
-    context_switch(&prev->rsp, current->rsp);
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    return recv_grant(port, msg_out, grant);
   }
+  return recv_locked(port, msg_out, flags, NULL, grant);
 }
 
-void scheduler_start()
+// Block until one of count ports has a message and return that port's
+// index. The message is taken into msg_out, or left queued if it's NULL.
+static int wait_any(Port *const *ports, uint32_t count, Message *msg_out)
 {
-  if (!thread_list)
+  if (!ports || count == 0 || count > RECV_ANY_MAX_PORTS)
   {
-    return;
+    return -1; // Invalid parameters
   }
 
-  current = thread_list;
-
-  Thread *runnable = find_next_runnable(current);
-  if (!runnable)
+  Thread *self = current;
+  if (!self)
   {
-    return;
+    return -2; // No current thread?
   }
 
-  current = runnable;
+  Message msg;
+  port_waiter_t waiters[RECV_ANY_MAX_PORTS];
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
 
-  // Set up TSS if this is a user thread
-  if (current->is_user_mode)
+  for (;;)
   {
-    gdt_set_kernel_stack(current->kernel_rsp);
-  }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      // A ring's consumer only sleeps on its own ring
+      if (!ports[i] || ports[i]->ring)
+      {
+        spin_unlock_irqrestore(&ipc_lock, flags);
+        return -1; // Invalid parameters
+      }
+
+      if (ports[i]->dead)
+      {
+        spin_unlock_irqrestore(&ipc_lock, flags);
+        return -5; // Port destroyed
+      }
+
+      if (!msg_out && ports[i]->queue_head)
+      {
+        spin_unlock_irqrestore(&ipc_lock, flags);
+        return i;
+      }
+
+      if (msg_out && port_dequeue(ports[i], &msg) == 0)
+      {
+        take_reply(self, msg.caller);
+        spin_unlock_irqrestore(&ipc_lock, flags);
+        int result = message_deliver(msg_out, &msg, NULL);
+        return result != 0 ? result : (int) i;
+      }
+    }
 
-  uint64_t dummy = 0;
-  context_switch(&dummy, current->rsp);
-}
+    // One wakeup from any of them takes us off all of them
+    ports_wait(ports, count, waiters, self);
+    spin_unlock(&ipc_lock);
+    schedule(0);
 
-Thread *thread_current() { return current; }
+    // One of the ports was destroyed
+    if (self->wake_status != 0)
+    {
+      irq_restore(flags);
+      return self->wake_status;
+    }
 
-static Message *message_alloc(void)
-{
-  if (message_pool_next >= MAX_MESSAGES)
-  {
-    return NULL;
+    spin_lock(&ipc_lock);
   }
-
-  Message *msg = &message_pool[message_pool_next++];
-  msg->next = NULL;
-  return msg;
 }
 
-static void message_free(Message *msg)
+int recv_any(Port *const *ports, uint32_t count, Message *msg_out)
 {
-  // TODO: Return to a free list
-  (void) msg;
+  if (!msg_out)
+  {
+    return -1; // Invalid parameters
+  }
+  return wait_any(ports, count, msg_out);
 }
 
-Port *port_create()
+int port_poll_any(Port *const *ports, uint32_t count) { return wait_any(ports, count, NULL); }
+
+int send_try(Port *port, const ipc_message_t *msg)
 {
-  if (port_count >= MAX_PORTS)
+  if (!port || !msg)
   {
-    return NULL;
+    return -1; // Invalid parameters
   }
 
-  Port *port = &ports[port_count++];
-  port->queue_head = NULL;
-  port->queue_tail = NULL;
-  port->message_count = 0;
-  port->blocked_thread = NULL;
+  Message *queued = message_alloc();
+  if (!queued)
+  {
+    return -2; // Out of messages
+  }
 
-  return port;
+  queued->id = msg->id;
+  for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
+  {
+    queued->data[i] = msg->data[i];
+  }
+
+  int result = message_send(port, queued, 0);
+  if (result != 0)
+  {
+    message_free(queued);
+  }
+  return result;
 }
 
-void port_destroy(Port *port)
+int recv_try(Port *port, ipc_message_t *msg_out)
 {
-  if (!port)
+  if (!port || !msg_out)
   {
-    return;
+    return -1; // Invalid parameters
   }
 
-  Message *msg = port->queue_head;
-  while (msg)
+  Message msg;
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+  int result = port->ring ? -1 : port_dequeue(port, &msg) == 0 ? 0 : port->dead ? -5 : -3;
+
+  // Nobody is left to reply to it
+  if (result == 0 && msg.caller)
   {
-    Message *next = msg->next;
-    message_free(msg);
-    msg = next;
+    thread_wake(msg.caller, -6);
   }
+  spin_unlock_irqrestore(&ipc_lock, flags);
 
-  if (port->blocked_thread)
+  if (result == 0)
   {
-    port->blocked_thread->state = THREAD_RUNNING;
-    port->blocked_thread->waiting_on_port = NULL;
+    message_deliver((Message *) msg_out, &msg, NULL);
   }
-
-  port->queue_head = NULL;
-  port->queue_tail = NULL;
-  port->message_count = 0;
-  port->blocked_thread = NULL;
+  return result;
 }
 
-// Port ID management for syscall interface
-uint32_t port_to_id(Port *port)
+int recv_batch(Port *port, ipc_message_t *msgs, uint32_t count)
 {
-  if (!port)
+  if (!port || !msgs || count == 0 || count > IPC_BATCH_MAX)
   {
-    return 0;
+    return -1; // Invalid parameters
   }
 
-  // Calculate index in ports array
-  // Add 1 so that 0 can be an invalid ID
-  uint32_t index = (uint32_t) (port - ports);
-  if (index >= MAX_PORTS)
+  Thread *self = current;
+  if (!self)
   {
-    return 0;
+    return -2; // No current thread?
   }
 
-  return index + 1;
-}
+  // Only ID and data are written, which is all an ipc_message_t has
+  int result = recv(port, (Message *) &msgs[0]);
+  if (result != 0)
+  {
+    return result;
+  }
 
-Port *port_from_id(uint32_t id)
-{
-  // ID 0 is invalid
-  if (id == 0 || id > MAX_PORTS)
+  port_ring_t *ring = __atomic_load_n(&port->ring, __ATOMIC_ACQUIRE);
+  uint32_t received = 1;
+  if (ring)
   {
-    return NULL;
+    while (received < count && ring_recv(port, ring, (Message *) &msgs[received], 0) == 0)
+    {
+      received++;
+    }
+    return received;
+  }
+
+  // A call ends the batch, so it can be replied to before the next one
+  Message batch[IPC_BATCH_CHUNK];
+  int stop = self->reply_to != NULL;
+  while (!stop && received < count)
+  {
+    uint32_t chunk = count - received < IPC_BATCH_CHUNK ? count - received : IPC_BATCH_CHUNK;
+    uint32_t taken = 0;
+
+    uint64_t flags = spin_lock_irqsave(&ipc_lock);
+    while (!stop && taken < chunk && port_dequeue(port, &batch[taken]) == 0)
+    {
+      take_reply(self, batch[taken].caller);
+      stop = batch[taken++].caller != NULL;
+    }
+    spin_unlock_irqrestore(&ipc_lock, flags);
+
+    // Copied out after dropping the lock, msgs may have to be faulted in
+    for (uint32_t i = 0; i < taken; i++)
+    {
+      message_deliver((Message *) &msgs[received + i], &batch[i], NULL);
+    }
+
+    received += taken;
+    if (taken < chunk)
+    {
+      break;
+    }
   }
 
-  // Convert back to index (subtract 1)
-  return &ports[id - 1];
+  return received;
 }
 
-int send(Port *port, uint32_t id, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3)
+int call(Port *port, Message *msg)
 {
-  if (!port)
+  if (!port || !msg)
   {
-    return -1; // Invalid port
+    return -1; // Invalid parameters
   }
 
-  Message *msg = message_alloc();
-  if (!msg)
+  Thread *self = current;
+  if (!self)
   {
-    return -2; // Out of messages
+    return -2; // No current thread?
   }
 
-  msg->id = id;
-  msg->data[0] = d0;
-  msg->data[1] = d1;
-  msg->data[2] = d2;
-  msg->data[3] = d3;
-  msg->next = NULL;
+  Message *request = message_alloc();
+  if (!request)
+  {
+    return -2; // Out of messages
+  }
 
-  // Check if a thread is blocked waiting on this port
-  if (port->blocked_thread)
+  request->id = msg->id;
+  for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
   {
-    Thread *blocked = port->blocked_thread;
+    request->data[i] = msg->data[i];
+  }
+  request->caller = self;
+
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
 
-    blocked->state = THREAD_RUNNING;
-    blocked->waiting_on_port = NULL;
-    port->blocked_thread = NULL;
+  int room = port->ring ? -1 : port_make_room(port, 1); // Rings carry no calls
+  if (room != 0)
+  {
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    message_free(request);
+    return room;
   }
 
-  if (port->queue_tail)
+  self->state = THREAD_BLOCKED;
+  self->waiting_on_port = NULL;
+  self->wake_status = 0;
+
+  // A waiting server gets our CPU and the rest of our slice right away
+  Thread *receiver = port_enqueue(port, request);
+  if (receiver)
   {
-    port->queue_tail->next = msg;
-    port->queue_tail = msg;
+    switch_to_woken(receiver, 0);
   } else
   {
-    port->queue_head = msg;
-    port->queue_tail = msg;
+    spin_unlock(&ipc_lock);
+    schedule(0);
   }
+  irq_restore(flags);
 
-  port->message_count++;
+  if (self->wake_status != 0)
+  {
+    return self->wake_status;
+  }
 
+  message_copy_out(msg, &self->reply);
   return 0; // Success
 }
 
-int recv(Port *port, Message *msg_out)
+// Hand the reply to whoever we received a call from, ipc_lock must be held.
+// Returns the claimed caller, NULL if there's nobody to reply to.
+static Thread *reply_locked(Thread *self, const Message *reply_msg)
 {
-  if (!port || !msg_out)
+  Thread *caller = self->reply_to;
+  if (!caller)
   {
-    return -1; // Invalid parameters
+    return NULL;
   }
 
-  if (port->queue_head)
+  self->reply_to = NULL;
+  caller->reply.id = reply_msg->id;
+  for (int i = 0; i < MESSAGE_DATA_SIZE; i++)
   {
-    Message *msg = port->queue_head;
-    port->queue_head = msg->next;
-
-    if (!port->queue_head)
-    {
-      port->queue_tail = NULL;
-    }
-
-    port->message_count--;
-
-    msg_out->id = msg->id;
-    msg_out->data[0] = msg->data[0];
-    msg_out->data[1] = msg->data[1];
-    msg_out->data[2] = msg->data[2];
-    msg_out->data[3] = msg->data[3];
-
-    message_free(msg);
-
-    return 0; // Success
+    caller->reply.data[i] = reply_msg->data[i];
   }
+  return caller;
+}
 
-  if (!current)
+int reply(uint32_t id, uint32_t d0, uint32_t d1, uint32_t d2, uint32_t d3)
+{
+  Thread *self = current;
+  if (!self)
   {
     return -2; // No current thread?
   }
 
-  if (port->blocked_thread)
+  Message msg = { .id = id, .data = { d0, d1, d2, d3 } };
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+
+  Thread *caller = reply_locked(self, &msg);
+  if (!caller)
   {
-    return -3; // Another thread already blocked
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    return -1; // Nothing to reply to
   }
 
-  current->state = THREAD_BLOCKED;
-  current->waiting_on_port = port;
-  port->blocked_thread = current;
-
-  thread_yield();
+  // The caller continues on our slice, we're next in line after it
+  switch_to_woken(caller, 0);
+  irq_restore(flags);
+  return 0; // Success
+}
 
-  // When we resume a message should be available, try to recieve again
-  if (port->queue_head)
+int reply_recv(Port *port, Message *msg)
+{
+  if (!port || !msg)
   {
-    Message *msg = port->queue_head;
-    port->queue_head = msg->next;
-
-    if (!port->queue_head)
-    {
-      port->queue_tail = NULL;
-    }
-
-    port->message_count--;
+    return -1; // Invalid parameters
+  }
 
-    msg_out->id = msg->id;
-    msg_out->data[0] = msg->data[0];
-    msg_out->data[1] = msg->data[1];
-    msg_out->data[2] = msg->data[2];
-    msg_out->data[3] = msg->data[3];
+  Thread *self = current;
+  if (!self)
+  {
+    return -2; // No current thread?
+  }
 
-    message_free(msg);
+  // Read before msg gets overwritten with the next request
+  Message reply_msg;
+  message_copy_out(&reply_msg, msg);
 
-    return 0; // Success
+  uint64_t flags = spin_lock_irqsave(&ipc_lock);
+  if (port->ring)
+  {
+    spin_unlock_irqrestore(&ipc_lock, flags);
+    return -1; // Rings carry no calls
   }
 
-  // We shouldn't reach here...
-  return -4; // Woke up without a message??
+  Thread *caller = reply_locked(self, &reply_msg);
+  return recv_locked(port, msg, flags, caller, NULL);
 }
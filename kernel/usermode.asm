@@ -11,16 +11,14 @@ jump_to_usermode:
 
     cli
 
-    mov ax, 0x23    ; USER_DS selector
+    mov ax, 0x1B    ; USER_DS selector
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
 
     ; Build iretq frame (must be 64-bit pushes)
     ; Stack layout (top to bottom): SS, RSP, RFLAGS, CS, RIP
     
-    mov rax, 0x23   ; USER_DS
+    mov rax, 0x1B   ; USER_DS
     push rax        ; SS
     
     push r11        ; RSP (user stack)
@@ -30,17 +28,21 @@ jump_to_usermode:
     or rax, 0x200   ; Set IF (enable interrupts)
     push rax        ; RFLAGS
     
-    mov rax, 0x1B   ; USER_CS
+    mov rax, 0x23   ; USER_CS
     push rax        ; CS
     
     push r10        ; RIP (entry point)
-    
+
+    swapgs          ; Park the kernel GS base until the next kernel entry
     iretq
 
     ud2
 
+extern thread_finish_switch
+
 global usermode_trampoline
 usermode_trampoline:
+    call thread_finish_switch   ; Preserves r12/r13
     mov rdi, r12
     mov rsi, r13
     call jump_to_usermode
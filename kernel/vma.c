@@ -0,0 +1,711 @@
+#include "vma.h"
+
+#include "pmm.h"
+#include "serial.h"
+#include "slab.h"
+
+#include <stddef.h>
+
+extern uint64_t hhdm_offset;
+
+// Page fault error code bits
+#define PF_PRESENT (1 << 0)
+#define PF_WRITE (1 << 1)
+#define PF_INSTRUCTION (1 << 4)
+
+#define HUGE_PAGE_SIZE ((uint64_t) PAGE_SIZE << PMM_HUGE_PAGE_ORDER)
+
+static kmem_cache_t *region_cache = NULL;
+static kmem_cache_t *file_cache = NULL;
+
+void vma_init()
+{
+  region_cache = kmem_cache_create("vm_region", sizeof(vm_region_t), 8, NULL);
+  file_cache = kmem_cache_create("vm_file", sizeof(vm_file_t), 8, NULL);
+
+  if (!region_cache || !file_cache)
+  {
+    serial_print("VMA: Error: Failed to create object caches!\n");
+  }
+}
+
+vm_file_t *vm_file_create(const void *data, uint64_t size, int owned)
+{
+  vm_file_t *file = kmem_cache_alloc(file_cache);
+  if (!file)
+  {
+    return NULL;
+  }
+
+  file->data = data;
+  file->size = size;
+  file->refs = 1;
+  file->owned = owned;
+  return file;
+}
+
+static vm_file_t *vm_file_get(vm_file_t *file)
+{
+  if (file)
+  {
+    __atomic_fetch_add(&file->refs, 1, __ATOMIC_RELAXED);
+  }
+  return file;
+}
+
+void vm_file_put(vm_file_t *file)
+{
+  // Clones share files across address spaces running on different CPUs
+  if (!file || __atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL))
+  {
+    return;
+  }
+
+  if (file->owned)
+  {
+    kfree((void *) file->data);
+  }
+  kmem_cache_free(file_cache, file);
+}
+
+// Lowest address a region may extend down to, including its guard gap
+static inline uint64_t region_floor(vm_region_t *region)
+{
+  if (region->type == VM_REGION_STACK)
+  {
+    return region->start - VM_STACK_GUARD_PAGES * PAGE_SIZE;
+  }
+  return region->start;
+}
+
+vm_region_t *vma_create(address_space_t *as, uint64_t start, uint64_t length, vm_region_type_t type, uint32_t prot,
+    vm_file_t *file, uint64_t file_offset)
+{
+  uint64_t end = start + length;
+
+  if (!as || length == 0 || (start | length) & (PAGE_SIZE - 1) || end > USER_SPACE_END || end < start)
+  {
+    return NULL;
+  }
+
+  if ((type == VM_REGION_FILE) != (file != NULL))
+  {
+    return NULL;
+  }
+
+  if ((prot & VM_HUGE) && (type != VM_REGION_ANON || ((start | length) & (HUGE_PAGE_SIZE - 1))))
+  {
+    return NULL;
+  }
+
+  uint64_t floor = start;
+  if (type == VM_REGION_STACK)
+  {
+    if (start < (VM_STACK_GUARD_PAGES + 1) * PAGE_SIZE)
+    {
+      return NULL;
+    }
+    floor = start - VM_STACK_GUARD_PAGES * PAGE_SIZE;
+  }
+
+  // Find the insertion point and make sure nothing overlaps, guards included
+  vm_region_t **link = &as->regions;
+  while (*link && (*link)->end <= floor)
+  {
+    link = &(*link)->next;
+  }
+
+  if (*link && region_floor(*link) < end)
+  {
+    return NULL;
+  }
+
+  vm_region_t *region = kmem_cache_alloc(region_cache);
+  if (!region)
+  {
+    return NULL;
+  }
+
+  region->start = start;
+  region->end = end;
+  region->type = type;
+  region->prot = prot;
+  region->file = vm_file_get(file);
+  region->file_offset = file_offset;
+  region->next = *link;
+  *link = region;
+
+  return region;
+}
+
+vm_region_t *vma_find(address_space_t *as, uint64_t addr)
+{
+  for (vm_region_t *region = as->regions; region && region_floor(region) <= addr; region = region->next)
+  {
+    if (addr >= region->start && addr < region->end)
+    {
+      return region;
+    }
+  }
+  return NULL;
+}
+
+uint64_t vma_find_free(address_space_t *as, uint64_t length, uint64_t align)
+{
+  uint64_t candidate = VM_MMAP_BASE;
+
+  for (vm_region_t *region = as->regions; region; region = region->next)
+  {
+    if (region->end <= candidate)
+    {
+      continue;
+    }
+
+    if (candidate + length <= region_floor(region))
+    {
+      break;
+    }
+
+    candidate = (region->end + align - 1) & ~(align - 1);
+  }
+
+  if (candidate + length > USER_SPACE_END || candidate + length < candidate)
+  {
+    return 0;
+  }
+
+  return candidate;
+}
+
+static void release_frame(uint64_t entry)
+{
+  if (entry & PAGE_UNOWNED)
+  {
+    return;
+  }
+
+  uint64_t phys = entry & 0x000FFFFFFFFFF000ULL;
+  if (entry & PAGE_HUGE)
+  {
+    pmm_free_pages((void *) (phys & ~(HUGE_PAGE_SIZE - 1)), PMM_HUGE_PAGE_ORDER);
+  } else
+  {
+    pmm_free_page((void *) phys);
+  }
+}
+
+int vma_unmap(address_space_t *as, uint64_t start, uint64_t length)
+{
+  uint64_t end = start + length;
+
+  if (!as || length == 0 || (start | length) & (PAGE_SIZE - 1) || end > USER_SPACE_END || end < start)
+  {
+    return -1;
+  }
+
+  // Validate everything first so a failed call leaves no partial damage. A
+  // hole punched into one region needs a tail region, allocated up front.
+  vm_region_t *tail = NULL;
+  for (vm_region_t *region = as->regions; region && region->start < end; region = region->next)
+  {
+    if (region->end <= start)
+    {
+      continue;
+    }
+
+    if ((region->prot & VM_HUGE)
+        && ((start > region->start && (start & (HUGE_PAGE_SIZE - 1)))
+            || (end < region->end && (end & (HUGE_PAGE_SIZE - 1)))))
+    {
+      return -1;
+    }
+
+    if (start > region->start && end < region->end && !(tail = kmem_cache_alloc(region_cache)))
+    {
+      return -1;
+    }
+  }
+
+  vm_region_t **link = &as->regions;
+  while (*link && (*link)->start < end)
+  {
+    vm_region_t *region = *link;
+
+    if (region->end <= start)
+    {
+      link = &region->next;
+      continue;
+    }
+
+    uint64_t cut_start = start > region->start ? start : region->start;
+    uint64_t cut_end = end < region->end ? end : region->end;
+    vmm_unmap_range(as, cut_start, cut_end - cut_start, release_frame);
+
+    if (cut_start > region->start && cut_end < region->end)
+    {
+      // Punching a hole, the tail becomes a region of its own
+      *tail = *region;
+      tail->start = cut_end;
+      tail->file = vm_file_get(region->file);
+      tail->file_offset = region->file_offset + (cut_end - region->start);
+      region->end = cut_start;
+      region->next = tail;
+      link = &tail->next;
+    } else if (cut_start > region->start)
+    {
+      region->end = cut_start;
+      link = &region->next;
+    } else if (cut_end < region->end)
+    {
+      region->file_offset += cut_end - region->start;
+      region->start = cut_end;
+      link = &region->next;
+    } else
+    {
+      *link = region->next;
+      vm_file_put(region->file);
+      kmem_cache_free(region_cache, region);
+    }
+  }
+
+  return 0;
+}
+
+void vma_destroy_all(address_space_t *as)
+{
+  vm_region_t *region = as->regions;
+  while (region)
+  {
+    vm_region_t *next = region->next;
+    vm_file_put(region->file);
+    kmem_cache_free(region_cache, region);
+    region = next;
+  }
+  as->regions = NULL;
+}
+
+int vma_clone(address_space_t *child, address_space_t *parent)
+{
+  vm_region_t **link = &child->regions;
+
+  for (vm_region_t *region = parent->regions; region; region = region->next)
+  {
+    vm_region_t *copy = kmem_cache_alloc(region_cache);
+    if (!copy)
+    {
+      return -1;
+    }
+
+    *copy = *region;
+    copy->file = vm_file_get(region->file);
+    copy->next = NULL;
+    *link = copy;
+    link = &copy->next;
+  }
+
+  return 0;
+}
+
+static void zero_frames(void *phys, uint64_t pages)
+{
+  void *dst = (void *) ((uint64_t) phys + hhdm_offset);
+  uint64_t count = pages * PAGE_SIZE / 8;
+  __asm__ volatile("rep stosq" : "+D"(dst), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+// Fill a freshly allocated frame for the page at virt
+static void *populate_page(vm_region_t *region, uint64_t virt)
+{
+  if (region->type != VM_REGION_FILE)
+  {
+    return pmm_alloc_page();
+  }
+
+  uint64_t offset = region->file_offset + (virt - region->start);
+  uint64_t available = offset < region->file->size ? region->file->size - offset : 0;
+  if (available > PAGE_SIZE)
+  {
+    available = PAGE_SIZE;
+  }
+
+  // Only zero what the file doesn't cover
+  void *phys = available == PAGE_SIZE ? pmm_alloc_page_nozero() : pmm_alloc_page();
+  if (!phys)
+  {
+    return NULL;
+  }
+
+  uint8_t *dst = (uint8_t *) ((uint64_t) phys + hhdm_offset);
+  const uint8_t *src = region->file->data + offset;
+  for (uint64_t i = 0; i < available; i++)
+  {
+    dst[i] = src[i];
+  }
+
+  return phys;
+}
+
+static uint64_t page_flags(vm_region_t *region)
+{
+  uint64_t flags = PAGE_PRESENT | PAGE_USER;
+  if (region->prot & VM_WRITE)
+  {
+    flags |= PAGE_WRITE;
+  }
+  if (!(region->prot & VM_EXEC))
+  {
+    flags |= PAGE_NO_EXECUTE;
+  }
+  return flags;
+}
+
+// Resolve a write to a PAGE_COW mapping. The last sharer simply gets write
+// access back, everyone else copies the frame and drops their reference.
+static int break_cow(address_space_t *as, vm_region_t *region, uint64_t addr, uint64_t entry)
+{
+  int huge = (entry & PAGE_HUGE) != 0;
+  uint64_t size = huge ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  uint32_t order = huge ? PMM_HUGE_PAGE_ORDER : 0;
+  uint64_t virt = addr & ~(size - 1);
+  uint64_t flags = page_flags(region) | (huge ? PAGE_HUGE : 0);
+  void *frame = (void *) (entry & 0x000FFFFFFFFFF000ULL & ~(size - 1));
+
+  if (pmm_page_refs(frame) == 1)
+  {
+    return vmm_map_page(as, virt, (uint64_t) frame, flags);
+  }
+
+  void *copy = pmm_alloc_pages(order);
+  if (!copy)
+  {
+    return -1;
+  }
+
+  uint64_t *dst = (uint64_t *) ((uint64_t) copy + hhdm_offset);
+  const uint64_t *src = (const uint64_t *) ((uint64_t) frame + hhdm_offset);
+  uint64_t count = size / 8;
+  __asm__ volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+
+  pmm_set_owner(copy, PMM_OWNER_USER);
+
+  if (vmm_map_page(as, virt, (uint64_t) copy, flags) != 0)
+  {
+    pmm_free_pages(copy, order);
+    return -1;
+  }
+
+  pmm_free_pages(frame, order);
+  return 0;
+}
+
+// Try to back the whole 2 MiB block around addr with one huge page. Fails
+// (and the caller falls back to 4 KiB pages) when memory is too fragmented
+// or part of the block is already mapped with small pages.
+static int map_huge(address_space_t *as, vm_region_t *region, uint64_t addr)
+{
+  uint64_t block = addr & ~(HUGE_PAGE_SIZE - 1);
+
+  void *phys = pmm_alloc_pages(PMM_HUGE_PAGE_ORDER);
+  if (!phys)
+  {
+    return -1;
+  }
+
+  zero_frames(phys, 1ULL << PMM_HUGE_PAGE_ORDER);
+
+  if (vmm_map_page(as, block, (uint64_t) phys, page_flags(region) | PAGE_HUGE) != 0)
+  {
+    pmm_free_pages(phys, PMM_HUGE_PAGE_ORDER);
+    return -1;
+  }
+
+  pmm_set_owner(phys, PMM_OWNER_USER);
+  return 0;
+}
+
+int vma_handle_fault(address_space_t *as, uint64_t addr, uint64_t error_code)
+{
+  if (!as || addr >= USER_SPACE_END)
+  {
+    return -1;
+  }
+
+  vm_region_t *region = vma_find(as, addr);
+  if (!region)
+  {
+    for (vm_region_t *it = as->regions; it; it = it->next)
+    {
+      if (it->type == VM_REGION_STACK && addr >= region_floor(it) && addr < it->start)
+      {
+        serial_print("VMA: Stack overflow at ");
+        serial_print_hex(addr);
+        serial_print("\n");
+        break;
+      }
+    }
+    return -1;
+  }
+
+  if (((error_code & PF_WRITE) && !(region->prot & VM_WRITE))
+      || ((error_code & PF_INSTRUCTION) && !(region->prot & VM_EXEC)))
+  {
+    return -1;
+  }
+
+  // The only protection violation on a present page that's ours to fix is a
+  // write to a copy-on-write page
+  if (error_code & PF_PRESENT)
+  {
+    uint64_t entry = vmm_get_mapping(as, addr);
+    if (!(error_code & PF_WRITE) || !(entry & (PAGE_WRITE | PAGE_COW)))
+    {
+      return -1;
+    }
+
+    // Already writable again, the fault raced with another write
+    if (entry & PAGE_WRITE)
+    {
+      return 0;
+    }
+
+    return break_cow(as, region, addr, entry);
+  }
+
+  uint64_t page = addr & ~((uint64_t) PAGE_SIZE - 1);
+
+  // Another path may have mapped it since the fault was raised
+  if (vmm_get_mapping(as, page) & PAGE_PRESENT)
+  {
+    return 0;
+  }
+
+  if ((region->prot & VM_HUGE) && map_huge(as, region, addr) == 0)
+  {
+    return 0;
+  }
+
+  void *phys = populate_page(region, page);
+  if (!phys)
+  {
+    return -1;
+  }
+  pmm_set_owner(phys, PMM_OWNER_USER);
+
+  if (vmm_map_page(as, page, (uint64_t) phys, page_flags(region)) != 0)
+  {
+    pmm_free_page(phys);
+    return -1;
+  }
+
+  return 0;
+}
+
+vm_grant_t *vma_grant_take(address_space_t *as, uint64_t start, uint64_t length, int share)
+{
+  uint64_t end = start + length;
+
+  if (!as || length == 0 || (start | length) & (PAGE_SIZE - 1) || end > USER_SPACE_END || end < start)
+  {
+    return NULL;
+  }
+
+  vm_region_t *region = vma_find(as, start);
+  if (!region || end > region->end || (region->prot & VM_HUGE))
+  {
+    return NULL;
+  }
+
+  uint64_t pages = length / PAGE_SIZE;
+  vm_grant_t *grant = kmalloc(sizeof(vm_grant_t) + pages * sizeof(uint64_t));
+  if (!grant)
+  {
+    return NULL;
+  }
+  grant->pages = pages;
+
+  // Collect everything first so a failed grant leaves the range as it was
+  for (uint64_t i = 0; i < pages; i++)
+  {
+    uint64_t virt = start + i * PAGE_SIZE;
+    uint64_t entry = vmm_get_mapping(as, virt);
+
+    // Untouched anonymous pages are zero wherever they end up, file pages
+    // have to be read in now
+    if (!(entry & PAGE_PRESENT) && region->type == VM_REGION_FILE)
+    {
+      if (vma_handle_fault(as, virt, 0) != 0)
+      {
+        kfree(grant);
+        return NULL;
+      }
+      entry = vmm_get_mapping(as, virt);
+    }
+
+    // Frames we don't own aren't ours to give away
+    if (entry & PAGE_UNOWNED)
+    {
+      kfree(grant);
+      return NULL;
+    }
+
+    grant->entries[i] = (entry & PAGE_PRESENT) ? entry : 0;
+  }
+
+  if (!share)
+  {
+    vmm_unmap_range(as, start, length, NULL);
+    vma_unmap(as, start, length);
+    return grant;
+  }
+
+  // Same as cloning the address space, just for this range
+  for (uint64_t i = 0; i < pages; i++)
+  {
+    uint64_t entry = grant->entries[i];
+    if (!entry)
+    {
+      continue;
+    }
+
+    uint64_t phys = entry & 0x000FFFFFFFFFF000ULL;
+    if (pmm_ref_pages((void *) phys) != 0)
+    {
+      // Pages already marked copy-on-write get write access back on the
+      // next write fault, dropping our references is enough
+      while (i--)
+      {
+        if (grant->entries[i])
+        {
+          pmm_free_page((void *) (grant->entries[i] & 0x000FFFFFFFFFF000ULL));
+        }
+      }
+      kfree(grant);
+      return NULL;
+    }
+
+    if (entry & PAGE_WRITE)
+    {
+      entry = (entry & ~PAGE_WRITE) | PAGE_COW;
+      vmm_map_page(as, start + i * PAGE_SIZE, phys, entry & ~0x000FFFFFFFFFF000ULL);
+      grant->entries[i] = entry;
+    }
+  }
+
+  return grant;
+}
+
+int vma_grant_map(address_space_t *as, vm_grant_t *grant, uint64_t *addr)
+{
+  uint64_t length = grant->pages * PAGE_SIZE;
+  uint64_t start = *addr ? *addr : vma_find_free(as, length, PAGE_SIZE);
+
+  vm_region_t *region = start ? vma_create(as, start, length, VM_REGION_ANON, VM_READ | VM_WRITE, NULL, 0) : NULL;
+  if (!region)
+  {
+    vma_grant_free(grant);
+    return -1;
+  }
+
+  for (uint64_t i = 0; i < grant->pages; i++)
+  {
+    uint64_t entry = grant->entries[i];
+    if (!entry)
+    {
+      continue;
+    }
+
+    // Still shared with someone else, the first write here copies it
+    uint64_t phys = entry & 0x000FFFFFFFFFF000ULL;
+    uint64_t flags = page_flags(region);
+    if (pmm_page_refs((void *) phys) > 1)
+    {
+      flags = (flags & ~PAGE_WRITE) | PAGE_COW;
+    }
+
+    if (vmm_map_page(as, start + i * PAGE_SIZE, phys, flags) != 0)
+    {
+      // Whatever got mapped goes with the region
+      vma_unmap(as, start, length);
+      vma_grant_free(grant);
+      return -1;
+    }
+    grant->entries[i] = 0;
+  }
+
+  kfree(grant);
+  *addr = start;
+  return 0;
+}
+
+void vma_grant_free(vm_grant_t *grant)
+{
+  if (!grant)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < grant->pages; i++)
+  {
+    if (grant->entries[i])
+    {
+      release_frame(grant->entries[i]);
+    }
+  }
+  kfree(grant);
+}
+
+int vma_populate(address_space_t *as, vm_region_t *region)
+{
+  if (region->type == VM_REGION_FILE)
+  {
+    return -1;
+  }
+
+  uint64_t flags = page_flags(region);
+  uint64_t virt = region->start;
+
+  // Grab the largest naturally aligned blocks the PMM will give and map each
+  // one in a single pass
+  while (virt < region->end)
+  {
+    if ((region->prot & VM_HUGE) && map_huge(as, region, virt) == 0)
+    {
+      virt += HUGE_PAGE_SIZE;
+      continue;
+    }
+
+    uint32_t order = PMM_HUGE_PAGE_ORDER - 1;
+    while (order > 0 && ((virt & ((PAGE_SIZE << order) - 1)) || virt + (PAGE_SIZE << order) > region->end))
+    {
+      order--;
+    }
+
+    void *phys = pmm_alloc_pages(order);
+    while (!phys && order > 0)
+    {
+      phys = pmm_alloc_pages(--order);
+    }
+
+    if (!phys)
+    {
+      return -1;
+    }
+
+    zero_frames(phys, 1ULL << order);
+    pmm_set_owner(phys, PMM_OWNER_USER);
+    pmm_split_pages(phys, order);
+
+    if (vmm_map_range(as, virt, (uint64_t) phys, PAGE_SIZE << order, flags) != 0)
+    {
+      for (uint64_t i = 0; i < (1ULL << order); i++)
+      {
+        pmm_free_page((void *) ((uint64_t) phys + i * PAGE_SIZE));
+      }
+      return -1;
+    }
+
+    virt += PAGE_SIZE << order;
+  }
+
+  return 0;
+}
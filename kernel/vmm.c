@@ -1,7 +1,11 @@
 #include "vmm.h"
 
+#include "cpu.h"
 #include "pmm.h"
 #include "serial.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "vma.h"
 
 #include <stddef.h>
 
@@ -10,7 +14,52 @@
 // This should be set during kernel init from Limine's HHDM request
 extern uint64_t hhdm_offset;
 
+#define CPUID_1_EDX_PGE (1U << 13)
+#define CPUID_1_ECX_PCID (1U << 17)
+#define CPUID_7_EBX_INVPCID (1U << 10)
+
+#define CPUID_EXT_1_EDX_NX (1U << 20)
+
+#define EFER_NXE (1ULL << 11)
+
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
+#define CR3_NO_FLUSH (1ULL << 63)
+#define PCID_COUNT 4096
+#define PCID_SHARED (PCID_COUNT - 1) // Handed out once the others run out, flushed on every switch to it
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+
+// Past this many pages one full flush is cheaper than invlpg per page
+#define VMM_FLUSH_THRESHOLD 32
+
+#define HUGE_PAGE_SIZE ((uint64_t) PAGE_SIZE << PMM_HUGE_PAGE_ORDER)
+
+// Pages handed back to the PMM per call during teardown
+#define VMM_FREE_BATCH 32
+
+#define KERNEL_HALF_START 0xFFFF800000000000ULL
+
+// Device memory gets mapped here, uncached, PML4 slot 506
+#define MMIO_BASE 0xFFFFFD0000000000ULL
+
 static address_space_t kernel_address_space;
+static kmem_cache_t *address_space_cache = NULL;
+
+static address_space_t *current_address_space[MAX_CPUS];
+
+static int nx_enabled = 0;
+static int pge_enabled = 0;
+static int pcid_enabled = 0;
+static int invpcid_supported = 0;
+static uint64_t pcid_bitmap[PCID_COUNT / 64]; // Bit n set while PCID n belongs to a live address space
+static uint64_t next_mmio = MMIO_BASE;
+
+// Bumped whenever a kernel-half mapping goes away. Other CPUs compare it with
+// their own copy on every switch and flush their global entries to catch up.
+static uint64_t kernel_tlb_gen = 0;
 
 static inline uint64_t pml4_index(uint64_t vaddr) { return (vaddr >> 39) & 0x1FF; }
 static inline uint64_t pdpt_index(uint64_t vaddr) { return (vaddr >> 30) & 0x1FF; }
@@ -42,34 +91,260 @@ static inline uint64_t virt_to_phys(void *virt)
   return addr;
 }
 
-static page_table_t *get_or_create_table(uint64_t *entry, uint64_t flags)
+// The table entry index of table points at, allocated if missing. Works on a
+// copy of the entry, page tables are packed.
+static page_table_t *get_or_create_table(page_table_t *table, uint64_t index, uint64_t flags)
 {
-  if (*entry & PAGE_PRESENT)
+  uint64_t entry = table->entries[index];
+  if (entry & PAGE_PRESENT)
   {
-    *entry |= (flags & PAGE_USER);
-    uint64_t phys = entry_to_phys(*entry);
-    return (page_table_t *) phys_to_virt(phys);
+    table->entries[index] = entry | (flags & PAGE_USER);
+    return (page_table_t *) phys_to_virt(entry_to_phys(entry));
   }
 
-  // pmm_alloc_page returns a physical address
+  // pmm_alloc_page returns a physical address of an already zeroed page
   void *table_phys = pmm_alloc_page();
   if (!table_phys)
   {
     return NULL;
   }
+  pmm_set_owner(table_phys, PMM_OWNER_PAGE_TABLE);
 
   uint64_t phys = (uint64_t) table_phys;
+  table->entries[index] = phys | flags;
+
+  return (page_table_t *) phys_to_virt(phys);
+}
+
+static inline void invpcid(uint64_t type, uint16_t pcid, uint64_t virt)
+{
+  struct
+  {
+    uint64_t pcid;
+    uint64_t address;
+  } descriptor = { pcid, virt };
+
+  __asm__ volatile("invpcid %0, %1" : : "m"(descriptor), "r"(type) : "memory");
+}
+
+// Drop a stale translation for virt. invlpg only reaches the loaded PCID (and
+// global entries, which covers the shared kernel half), so other address
+// spaces either get a targeted INVPCID or a full flush on their next switch.
+//
+// Only the local TLB can be reached from here. Other CPUs catch up on their
+// next switch, before they run anything that could use the stale entries: a
+// user address space is only ever loaded where its thread runs. A kernel VA
+// is only touched again once mapped again, and mapping it catches up too.
+static void mark_remote_stale(address_space_t *as, int kernel)
+{
+  if (kernel)
+  {
+    __atomic_fetch_add(&kernel_tlb_gen, 1, __ATOMIC_RELEASE);
+  } else
+  {
+    __atomic_fetch_or(&as->tlb_stale, ~(1U << cpu_current_id()), __ATOMIC_RELEASE);
+  }
+}
+
+static void flush_page(address_space_t *as, uint64_t virt)
+{
+  uint32_t cpu = cpu_current_id();
+
+  if (virt >= KERNEL_HALF_START || as == current_address_space[cpu])
+  {
+    __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+  } else if (invpcid_supported)
+  {
+    invpcid(INVPCID_ADDRESS, as->pcid, virt);
+  } else
+  {
+    __atomic_fetch_or(&as->tlb_stale, 1U << cpu, __ATOMIC_RELEASE);
+  }
+
+  mark_remote_stale(as, virt >= KERNEL_HALF_START);
+}
+
+// Drop every non-global translation of as, or everything if the kernel half
+// changed too
+static void flush_all(address_space_t *as, int kernel)
+{
+  address_space_t *loaded = current_address_space[cpu_current_id()];
+
+  if (kernel && pge_enabled)
+  {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+  } else if (kernel || as == loaded)
+  {
+    // Without the no-flush bit this drops everything under the loaded PCID
+    uint64_t cr3 = loaded->cr3_value | (pcid_enabled ? loaded->pcid : 0);
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+  } else if (invpcid_supported)
+  {
+    invpcid(INVPCID_CONTEXT, as->pcid, 0);
+  } else
+  {
+    __atomic_fetch_or(&as->tlb_stale, 1U << cpu_current_id(), __ATOMIC_RELEASE);
+  }
+
+  mark_remote_stale(as, kernel);
+}
+
+// Drop global entries if kernel mappings went away since this CPU last looked
+static void sync_kernel_tlb(void)
+{
+  cpu_t *cpu = cpu_current();
+  uint64_t gen = __atomic_load_n(&kernel_tlb_gen, __ATOMIC_ACQUIRE);
+  if (cpu->kernel_tlb_gen == gen)
+  {
+    return;
+  }
+
+  cpu->kernel_tlb_gen = gen;
+  if (pge_enabled)
+  {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+  } else
+  {
+    address_space_t *loaded = current_address_space[cpu->id];
+    __asm__ volatile("mov %0, %%cr3" : : "r"(loaded->cr3_value | (pcid_enabled ? loaded->pcid : 0)) : "memory");
+  }
+}
+
+// Kernel VAs are unmapped without reaching other CPUs, which may still hold a
+// global entry to the freed frame. Whoever maps one again catches up first.
+static void sync_kernel_tlb_for(uint64_t virt)
+{
+  if (virt >= KERNEL_HALF_START)
+  {
+    uint64_t flags = irq_save();
+    sync_kernel_tlb();
+    irq_restore(flags);
+  }
+}
+
+// Invalidations collected over a range operation and issued in one go
+typedef struct
+{
+  address_space_t *as;
+  uint64_t addrs[VMM_FLUSH_THRESHOLD];
+  uint32_t count;
+  int overflow; // More than VMM_FLUSH_THRESHOLD pages, flush everything
+  int kernel; // Some of them are global kernel mappings
+} tlb_batch_t;
+
+static void tlb_batch_add(tlb_batch_t *batch, uint64_t virt, uint64_t pages)
+{
+  if (virt >= KERNEL_HALF_START)
+  {
+    batch->kernel = 1;
+  }
+
+  if (batch->overflow || batch->count + pages > VMM_FLUSH_THRESHOLD)
+  {
+    batch->overflow = 1;
+    return;
+  }
+
+  // invlpg on any address inside a huge page drops the whole translation
+  batch->addrs[batch->count++] = virt;
+}
+
+static void tlb_batch_flush(tlb_batch_t *batch)
+{
+  if (batch->overflow)
+  {
+    flush_all(batch->as, batch->kernel);
+  } else
+  {
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+      flush_page(batch->as, batch->addrs[i]);
+    }
+  }
 
-  // Zero out the new table
-  page_table_t *table_virt = (page_table_t *) phys_to_virt(phys);
+  batch->count = 0;
+  batch->overflow = 0;
+  batch->kernel = 0;
+}
+
+// Mark every kernel-half leaf mapping global, so they survive CR3 switches
+static void set_global(page_table_t *table, int level)
+{
   for (int i = 0; i < 512; i++)
   {
-    table_virt->entries[i] = 0;
+    uint64_t entry = table->entries[i];
+    if (!(entry & PAGE_PRESENT))
+    {
+      continue;
+    }
+
+    if (level == 1 || (entry & PAGE_HUGE))
+    {
+      table->entries[i] = entry | PAGE_GLOBAL;
+    } else
+    {
+      set_global((page_table_t *) phys_to_virt(entry_to_phys(entry)), level - 1);
+    }
+  }
+}
+
+static void setup_kernel_half(void)
+{
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+  if (edx & CPUID_EXT_1_EDX_NX)
+  {
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    nx_enabled = 1;
+  }
+
+  cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+  int pge_supported = (edx & CPUID_1_EDX_PGE) != 0;
+  int pcid_supported = (ecx & CPUID_1_ECX_PCID) != 0;
+
+  cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+  invpcid_supported = pcid_supported && (ebx & CPUID_7_EBX_INVPCID);
+
+  // Give every kernel-half PML4 slot a PDPT up front, so address spaces
+  // created now share everything the kernel maps later
+  for (int i = 256; i < 512; i++)
+  {
+    if (!get_or_create_table(kernel_address_space.pml4, i, PAGE_PRESENT | PAGE_WRITE))
+    {
+      serial_print("VMM: Error: Failed to allocate kernel PDPT!\n");
+      return;
+    }
   }
 
-  *entry = phys | flags;
+  if (pge_supported)
+  {
+    for (int i = 256; i < 512; i++)
+    {
+      set_global((page_table_t *) phys_to_virt(entry_to_phys(kernel_address_space.pml4->entries[i])), 3);
+    }
+
+    // Toggling PGE flushes the whole TLB, global entries included
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4 | CR4_PGE);
+    pge_enabled = 1;
+    serial_print("VMM: Kernel half mapped with global pages\n");
+  }
+
+  if (pcid_supported)
+  {
+    // PCIDE can only be set while the loaded PCID is 0
+    __asm__ volatile("mov %0, %%cr3" : : "r"(kernel_address_space.cr3_value) : "memory");
+    write_cr4(read_cr4() | CR4_PCIDE);
+    pcid_enabled = 1;
 
-  return table_virt;
+    serial_print("VMM: PCID enabled");
+    serial_print(invpcid_supported ? " with INVPCID\n" : "\n");
+  }
 }
 
 void vmm_init()
@@ -103,6 +378,19 @@ void vmm_init()
 
   kernel_address_space.cr3_value = current_cr3;
   kernel_address_space.pml4 = (page_table_t *) phys_to_virt(current_cr3);
+  kernel_address_space.pcid = 0;
+  kernel_address_space.tlb_stale = 0;
+
+  // The kernel keeps PCID 0 and the shared one is never handed out exclusively
+  pcid_bitmap[0] = 1;
+  pcid_bitmap[PCID_SHARED / 64] |= 1ULL << (PCID_SHARED % 64);
+  kernel_address_space.regions = NULL;
+  kernel_address_space.async = NULL;
+
+  for (int i = 0; i < MAX_CPUS; i++)
+  {
+    current_address_space[i] = &kernel_address_space;
+  }
 
   // Limine has already set up all necessary mappings:
   // - Kernel code and data at 0xFFFFFFFF80000000+
@@ -111,12 +399,61 @@ void vmm_init()
   // - HHDM at hhdm_offset
   // - Identity mappings for low memory
 
-  // We can add custom mappings here in the future if needed
+  setup_kernel_half();
+
+  address_space_cache = kmem_cache_create("address_space", sizeof(address_space_t), 8, NULL);
+  if (!address_space_cache)
+  {
+    serial_print("VMM: Error: Failed to create address space cache!\n");
+  }
+
+  vma_init();
 
   serial_print("VMM: Virtual memory manager initialized\n");
   serial_print("VMM: Page tables ready for use\n");
 }
 
+void vmm_init_cpu()
+{
+  // Paging features are per CPU, bring this one in line with the BSP. The
+  // CR3 load drops whatever the bootloader left in the TLB.
+  if (nx_enabled)
+  {
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+  }
+
+  cpu_current()->kernel_tlb_gen = __atomic_load_n(&kernel_tlb_gen, __ATOMIC_ACQUIRE);
+  current_address_space[cpu_current_id()] = &kernel_address_space;
+  __asm__ volatile("mov %0, %%cr3" : : "r"(kernel_address_space.cr3_value) : "memory");
+
+  uint64_t cr4 = read_cr4();
+  if (pge_enabled)
+  {
+    cr4 |= CR4_PGE;
+  }
+  if (pcid_enabled)
+  {
+    cr4 |= CR4_PCIDE;
+  }
+  write_cr4(cr4);
+}
+
+void *vmm_map_mmio(uint64_t phys, uint64_t size)
+{
+  uint64_t offset = phys & (PAGE_SIZE - 1);
+  uint64_t length = (offset + size + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+  uint64_t virt = __atomic_fetch_add(&next_mmio, length, __ATOMIC_RELAXED);
+
+  uint64_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_NO_CACHE | PAGE_WRITETHROUGH | PAGE_GLOBAL | PAGE_NO_EXECUTE
+      | PAGE_UNOWNED;
+  if (vmm_map_range(&kernel_address_space, virt, phys - offset, length, flags) != 0)
+  {
+    return NULL;
+  }
+
+  return (void *) (virt + offset);
+}
+
 int vmm_map_page(address_space_t *as, uint64_t virt, uint64_t phys, uint64_t flags)
 {
   if (!as || !as->pml4)
@@ -129,39 +466,62 @@ int vmm_map_page(address_space_t *as, uint64_t virt, uint64_t phys, uint64_t fla
   uint64_t pd_i = pd_index(virt);
   uint64_t pt_i = pt_index(virt);
 
-  page_table_t *pdpt = get_or_create_table(&as->pml4->entries[pml4_i], PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
-  if (!pdpt)
+  if (!nx_enabled)
   {
-    return -1;
+    flags &= ~PAGE_NO_EXECUTE;
   }
+  sync_kernel_tlb_for(virt);
 
-  if (flags & PAGE_HUGE && pd_i == 0 && pt_i == 0)
+  page_table_t *pdpt = get_or_create_table(as->pml4, pml4_i, PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
+  if (!pdpt)
   {
-    pdpt->entries[pdpt_i] = phys | flags;
-    return 0;
+    return -1;
   }
 
-  page_table_t *pd = get_or_create_table(&pdpt->entries[pdpt_i], PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
+  page_table_t *pd = get_or_create_table(pdpt, pdpt_i, PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
   if (!pd)
   {
     return -1;
   }
 
+  // PAGE_HUGE maps a 2 MiB page straight from the PD, as long as no page
+  // table hangs off that slot already
   if (flags & PAGE_HUGE)
   {
+    uint64_t huge_mask = (PAGE_SIZE << PMM_HUGE_PAGE_ORDER) - 1;
+    if ((virt & huge_mask) || (phys & huge_mask)
+        || ((pd->entries[pd_i] & PAGE_PRESENT) && !(pd->entries[pd_i] & PAGE_HUGE)))
+    {
+      return -1;
+    }
+
+    uint64_t old = pd->entries[pd_i];
     pd->entries[pd_i] = phys | flags;
+    if (old & PAGE_PRESENT)
+    {
+      flush_page(as, virt);
+    }
     return 0;
   }
 
-  page_table_t *pt = get_or_create_table(&pd->entries[pd_i], PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
+  if (pd->entries[pd_i] & PAGE_HUGE)
+  {
+    return -1;
+  }
+
+  page_table_t *pt = get_or_create_table(pd, pd_i, PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
   if (!pt)
   {
     return -1;
   }
 
+  // Not-present entries are never cached, so only replacing one needs a flush
+  uint64_t old = pt->entries[pt_i];
   pt->entries[pt_i] = phys | flags;
-
-  __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+  if (old & PAGE_PRESENT)
+  {
+    flush_page(as, virt);
+  }
 
   return 0;
 }
@@ -194,7 +554,7 @@ void vmm_unmap_page(address_space_t *as, uint64_t virt)
   if (pdpt->entries[pdpt_i] & PAGE_HUGE)
   {
     pdpt->entries[pdpt_i] = 0;
-    __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    flush_page(as, virt);
     return;
   }
 
@@ -209,7 +569,7 @@ void vmm_unmap_page(address_space_t *as, uint64_t virt)
   if (pd->entries[pd_i] & PAGE_HUGE)
   {
     pd->entries[pd_i] = 0;
-    __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    flush_page(as, virt);
     return;
   }
 
@@ -218,7 +578,245 @@ void vmm_unmap_page(address_space_t *as, uint64_t virt)
 
   pt->entries[pt_i] = 0;
 
-  __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+  flush_page(as, virt);
+}
+
+uint64_t vmm_get_mapping(address_space_t *as, uint64_t virt)
+{
+  if (!as || !as->pml4)
+  {
+    return 0;
+  }
+
+  uint64_t entry = as->pml4->entries[pml4_index(virt)];
+  if (!(entry & PAGE_PRESENT))
+  {
+    return 0;
+  }
+
+  page_table_t *pdpt = (page_table_t *) phys_to_virt(entry_to_phys(entry));
+  entry = pdpt->entries[pdpt_index(virt)];
+  if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE))
+  {
+    return entry & PAGE_PRESENT ? entry : 0;
+  }
+
+  page_table_t *pd = (page_table_t *) phys_to_virt(entry_to_phys(entry));
+  entry = pd->entries[pd_index(virt)];
+  if (!(entry & PAGE_PRESENT) || (entry & PAGE_HUGE))
+  {
+    return entry & PAGE_PRESENT ? entry : 0;
+  }
+
+  page_table_t *pt = (page_table_t *) phys_to_virt(entry_to_phys(entry));
+  entry = pt->entries[pt_index(virt)];
+  return entry & PAGE_PRESENT ? entry : 0;
+}
+
+int vmm_map_range(address_space_t *as, uint64_t virt, uint64_t phys, uint64_t length, uint64_t flags)
+{
+  uint64_t step = (flags & PAGE_HUGE) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  uint64_t end = virt + length;
+
+  if (!as || !as->pml4 || ((virt | phys | length) & (step - 1)) || end < virt)
+  {
+    return -1;
+  }
+  sync_kernel_tlb_for(virt);
+
+  if (!nx_enabled)
+  {
+    flags &= ~PAGE_NO_EXECUTE;
+  }
+
+  uint64_t table_flags = PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+  tlb_batch_t batch = { .as = as };
+  int result = 0;
+
+  // One walk down to the PD (and PT) per table, then fill as many
+  // consecutive entries as the range covers
+  while (virt < end)
+  {
+    page_table_t *pdpt = get_or_create_table(as->pml4, pml4_index(virt), table_flags);
+    page_table_t *pd = pdpt ? get_or_create_table(pdpt, pdpt_index(virt), table_flags) : NULL;
+    if (!pd)
+    {
+      result = -1;
+      break;
+    }
+
+    page_table_t *table = pd;
+    uint64_t index = pd_index(virt);
+    if (!(flags & PAGE_HUGE))
+    {
+      table = (pd->entries[index] & PAGE_HUGE) ? NULL : get_or_create_table(pd, index, table_flags);
+      if (!table)
+      {
+        result = -1;
+        break;
+      }
+      index = pt_index(virt);
+    }
+
+    for (; index < 512 && virt < end; index++)
+    {
+      uint64_t old = table->entries[index];
+      if ((flags & PAGE_HUGE) && (old & PAGE_PRESENT) && !(old & PAGE_HUGE))
+      {
+        result = -1;
+        break;
+      }
+
+      table->entries[index] = phys | flags;
+
+      // Nothing caches a translation that wasn't present
+      if (old & PAGE_PRESENT)
+      {
+        tlb_batch_add(&batch, virt, step / PAGE_SIZE);
+      }
+
+      virt += step;
+      phys += step;
+    }
+
+    if (result != 0)
+    {
+      break;
+    }
+  }
+
+  tlb_batch_flush(&batch);
+  return result;
+}
+
+// Old entries of an unmap, released in bulk once the TLB no longer holds
+// them
+typedef struct
+{
+  tlb_batch_t tlb;
+  void (*release)(uint64_t entry);
+  uint64_t *entries;
+  uint32_t count;
+  uint32_t capacity;
+} unmap_batch_t;
+
+static void unmap_batch_flush(unmap_batch_t *batch)
+{
+  tlb_batch_flush(&batch->tlb);
+
+  for (uint32_t i = 0; i < batch->count; i++)
+  {
+    batch->release(batch->entries[i]);
+  }
+  batch->count = 0;
+}
+
+// Returns how many 4 KiB pages stopped being mapped
+static uint64_t clear_entries(
+    unmap_batch_t *batch, page_table_t *table, uint64_t first, uint64_t last, uint64_t virt, uint64_t step)
+{
+  uint64_t cleared = 0;
+
+  for (uint64_t i = first; i < last; i++, virt += step)
+  {
+    uint64_t old = table->entries[i];
+    if (!(old & PAGE_PRESENT))
+    {
+      continue;
+    }
+
+    if (batch->release && batch->count == batch->capacity)
+    {
+      unmap_batch_flush(batch);
+    }
+
+    table->entries[i] = 0;
+    tlb_batch_add(&batch->tlb, virt, step / PAGE_SIZE);
+    cleared += step / PAGE_SIZE;
+
+    if (batch->release)
+    {
+      batch->entries[batch->count++] = old;
+    }
+  }
+
+  return cleared;
+}
+
+uint64_t vmm_unmap_range(address_space_t *as, uint64_t virt, uint64_t length, void (*release)(uint64_t entry))
+{
+  uint64_t end = virt + length;
+
+  if (!as || !as->pml4 || ((virt | length) & (PAGE_SIZE - 1)) || end < virt)
+  {
+    return 0;
+  }
+
+  // A scratch page holds a full page table's worth of old entries, so frames
+  // can be released after a single flush. Without one, fall back to a
+  // flush every few entries.
+  uint64_t local[VMM_FLUSH_THRESHOLD];
+  void *scratch = release ? pmm_alloc_page_nozero() : NULL;
+
+  unmap_batch_t batch = { .tlb = { .as = as }, .release = release };
+  batch.entries = scratch ? (uint64_t *) phys_to_virt((uint64_t) scratch) : local;
+  batch.capacity = scratch ? PAGE_SIZE / sizeof(uint64_t) : VMM_FLUSH_THRESHOLD;
+
+  uint64_t unmapped = 0;
+
+  while (virt < end)
+  {
+    uint64_t pml4e = as->pml4->entries[pml4_index(virt)];
+    if (!(pml4e & PAGE_PRESENT))
+    {
+      virt = (virt | ((1ULL << 39) - 1)) + 1;
+      continue;
+    }
+
+    page_table_t *pdpt = (page_table_t *) phys_to_virt(entry_to_phys(pml4e));
+    uint64_t pdpte = pdpt->entries[pdpt_index(virt)];
+    if (!(pdpte & PAGE_PRESENT) || (pdpte & PAGE_HUGE))
+    {
+      // 1 GiB pages are only ever created by the bootloader
+      virt = (virt | ((1ULL << 30) - 1)) + 1;
+      continue;
+    }
+
+    page_table_t *pd = (page_table_t *) phys_to_virt(entry_to_phys(pdpte));
+    uint64_t pde = pd->entries[pd_index(virt)];
+    uint64_t next = (virt | (HUGE_PAGE_SIZE - 1)) + 1;
+
+    if (pde & PAGE_HUGE)
+    {
+      // Huge pages only partly covered by the range are left alone
+      if ((virt & (HUGE_PAGE_SIZE - 1)) == 0 && next <= end)
+      {
+        unmapped += clear_entries(&batch, pd, pd_index(virt), pd_index(virt) + 1, virt, HUGE_PAGE_SIZE);
+      }
+    } else if (pde & PAGE_PRESENT)
+    {
+      page_table_t *pt = (page_table_t *) phys_to_virt(entry_to_phys(pde));
+      uint64_t last = next <= end ? 512 : pt_index(end);
+      unmapped += clear_entries(&batch, pt, pt_index(virt), last, virt, PAGE_SIZE);
+    }
+
+    virt = next;
+  }
+
+  if (release)
+  {
+    unmap_batch_flush(&batch);
+  } else
+  {
+    tlb_batch_flush(&batch.tlb);
+  }
+
+  if (scratch)
+  {
+    pmm_free_page(scratch);
+  }
+
+  return unmapped;
 }
 
 void vmm_switch_address_space(address_space_t *as)
@@ -228,32 +826,100 @@ void vmm_switch_address_space(address_space_t *as)
     return;
   }
 
-  __asm__ volatile("mov %0, %%cr3" : : "r"(as->cr3_value) : "memory");
+  sync_kernel_tlb();
+
+  uint32_t cpu = cpu_current_id();
+  uint32_t bit = 1U << cpu;
+  int stale = (__atomic_load_n(&as->tlb_stale, __ATOMIC_ACQUIRE) & bit) != 0;
+  if (as == current_address_space[cpu] && !stale)
+  {
+    return;
+  }
+
+  // Whoever last used the shared PCID here may have been somebody else
+  if (as->pcid == PCID_SHARED)
+  {
+    stale = 1;
+  }
+
+  // With PCIDs each address space keeps its own TLB entries across switches,
+  // only flush when they may be stale
+  uint64_t cr3 = as->cr3_value;
+  if (pcid_enabled)
+  {
+    cr3 |= as->pcid;
+    if (!stale)
+    {
+      cr3 |= CR3_NO_FLUSH;
+    }
+  }
+  __atomic_fetch_and(&as->tlb_stale, ~bit, __ATOMIC_RELAXED);
+
+  __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+  current_address_space[cpu] = as;
+}
+
+// A PCID nothing else alive uses, or PCID_SHARED if there's none left
+static uint16_t pcid_alloc(void)
+{
+  for (uint32_t i = 0; i < PCID_COUNT / 64; i++)
+  {
+    uint64_t word = __atomic_load_n(&pcid_bitmap[i], __ATOMIC_RELAXED);
+    while (~word)
+    {
+      uint32_t bit = __builtin_ctzll(~word);
+      if (__atomic_compare_exchange_n(
+              &pcid_bitmap[i], &word, word | (1ULL << bit), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+        return (uint16_t) (i * 64 + bit);
+      }
+    }
+  }
+  return PCID_SHARED;
+}
+
+static void pcid_free(uint16_t pcid)
+{
+  if (pcid != 0 && pcid != PCID_SHARED)
+  {
+    __atomic_fetch_and(&pcid_bitmap[pcid / 64], ~(1ULL << (pcid % 64)), __ATOMIC_RELEASE);
+  }
 }
 
 address_space_t *vmm_get_kernel_address_space() { return &kernel_address_space; }
 
+address_space_t *vmm_get_current_address_space() { return current_address_space[cpu_current_id()]; }
+
 address_space_t *vmm_create_address_space()
 {
-  // This allocates physical memory, not virtual!
-  address_space_t *as_phys = pmm_alloc_page();
-  if (!as_phys)
+  address_space_t *as = kmem_cache_alloc(address_space_cache);
+  if (!as)
   {
     return NULL;
   }
 
-  address_space_t *as = (address_space_t *) phys_to_virt((uint64_t) as_phys);
-
   void *pml4_phys = pmm_alloc_page();
   if (!pml4_phys)
   {
-    pmm_free_page(as_phys);
+    kmem_cache_free(address_space_cache, as);
     return NULL;
   }
+  pmm_set_owner(pml4_phys, PMM_OWNER_PAGE_TABLE);
 
   as->pml4 = (page_table_t *) phys_to_virt((uint64_t) pml4_phys);
   as->cr3_value = (uint64_t) pml4_phys;
 
+  // No other live address space has this PCID, but a dead one may have left
+  // entries under it, so it's flushed on the first switch everywhere
+  as->pcid = 0;
+  if (pcid_enabled)
+  {
+    as->pcid = pcid_alloc();
+  }
+  as->tlb_stale = ~0U;
+  as->regions = NULL;
+  as->async = NULL;
+
   // Copy kernel mappings (upper half)
   for (int i = 256; i < 512; i++)
   {
@@ -263,20 +929,181 @@ address_space_t *vmm_create_address_space()
   return as;
 }
 
-void vmm_destroy_address_space(address_space_t *as)
+// Copy the tables below src into dst, sharing the leaves. Writable ones turn
+// read-only and PAGE_COW in both, every shared frame gains a reference.
+static int clone_table(page_table_t *src, page_table_t *dst, int level, int entries)
 {
-  if (!as || as == &kernel_address_space)
+  for (int i = 0; i < entries; i++)
+  {
+    uint64_t entry = src->entries[i];
+    if (!(entry & PAGE_PRESENT))
+    {
+      continue;
+    }
+
+    if (level == 1 || (entry & PAGE_HUGE))
+    {
+      if (!(entry & PAGE_UNOWNED))
+      {
+        uint64_t phys = entry_to_phys(entry);
+        if (level == 2)
+        {
+          phys &= ~(HUGE_PAGE_SIZE - 1);
+        }
+
+        if (pmm_ref_pages((void *) phys) != 0)
+        {
+          return -1;
+        }
+
+        if (entry & PAGE_WRITE)
+        {
+          entry = (entry & ~PAGE_WRITE) | PAGE_COW;
+          src->entries[i] = entry;
+        }
+      }
+
+      dst->entries[i] = entry;
+      continue;
+    }
+
+    void *table_phys = pmm_alloc_page();
+    if (!table_phys)
+    {
+      return -1;
+    }
+    pmm_set_owner(table_phys, PMM_OWNER_PAGE_TABLE);
+
+    dst->entries[i] = (uint64_t) table_phys | (entry & ~0x000FFFFFFFFFF000ULL);
+    page_table_t *src_table = (page_table_t *) phys_to_virt(entry_to_phys(entry));
+    if (clone_table(src_table, (page_table_t *) phys_to_virt((uint64_t) table_phys), level - 1, 512) != 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+address_space_t *vmm_clone_address_space(address_space_t *parent)
+{
+  if (!parent || parent == &kernel_address_space)
+  {
+    return NULL;
+  }
+
+  address_space_t *child = vmm_create_address_space();
+  if (!child)
+  {
+    return NULL;
+  }
+
+  int result = vma_clone(child, parent) == 0 ? clone_table(parent->pml4, child->pml4, 4, 256) : -1;
+
+  // The parent lost write access to whatever got shared, even on failure
+  flush_all(parent, 0);
+
+  if (result != 0)
+  {
+    vmm_destroy_address_space(child);
+    return NULL;
+  }
+
+  return child;
+}
+
+// Frees collected during teardown, handed to the PMM in batches
+typedef struct
+{
+  void *pages[VMM_FREE_BATCH];
+  uint32_t count;
+  uint64_t total;
+} free_batch_t;
+
+static void free_batch_add(free_batch_t *batch, uint64_t phys)
+{
+  if (batch->count == VMM_FREE_BATCH)
+  {
+    pmm_free_page_batch(batch->pages, batch->count);
+    batch->count = 0;
+  }
+
+  batch->pages[batch->count++] = (void *) phys;
+  batch->total++;
+}
+
+static void free_leaf(free_batch_t *batch, uint64_t entry)
+{
+  if (entry & PAGE_UNOWNED)
   {
     return;
   }
-  // TODO: Walk and free user page tables, for now just free the PML4
 
+  if (entry & PAGE_HUGE)
+  {
+    pmm_free_pages((void *) (entry_to_phys(entry) & ~(HUGE_PAGE_SIZE - 1)), PMM_HUGE_PAGE_ORDER);
+    batch->total += 1ULL << PMM_HUGE_PAGE_ORDER;
+  } else
+  {
+    free_batch_add(batch, entry_to_phys(entry));
+  }
+}
+
+// Walk a table at the given level (4 = PML4) and free everything below it,
+// the table itself included
+static void free_table(free_batch_t *batch, page_table_t *table, int level, int entries)
+{
+  for (int i = 0; i < entries; i++)
+  {
+    uint64_t entry = table->entries[i];
+    if (!(entry & PAGE_PRESENT))
+    {
+      continue;
+    }
+
+    if (level == 1 || (entry & PAGE_HUGE))
+    {
+      free_leaf(batch, entry);
+    } else
+    {
+      free_table(batch, (page_table_t *) phys_to_virt(entry_to_phys(entry)), level - 1, 512);
+    }
+  }
+
+  free_batch_add(batch, virt_to_phys(table));
+}
+
+uint64_t vmm_destroy_address_space(address_space_t *as)
+{
+  if (!as || as == &kernel_address_space)
+  {
+    return 0;
+  }
+
+  // An exiting thread tears down its own address space while it's loaded
+  if (as == current_address_space[cpu_current_id()])
+  {
+    vmm_switch_address_space(&kernel_address_space);
+  }
+
+  vma_destroy_all(as);
+
+  // Nothing has this address space loaded any more and its PCID gets flushed
+  // before reuse, so the frames can go without any TLB shootdown. Only the
+  // user half is walked, the kernel half is shared.
+  free_batch_t batch = { .count = 0, .total = 0 };
   if (as->pml4)
   {
-    uint64_t pml4_phys = virt_to_phys(as->pml4);
-    pmm_free_page((void *) pml4_phys);
+    free_table(&batch, as->pml4, 4, 256);
   }
+  pmm_free_page_batch(batch.pages, batch.count);
+
+  pcid_free(as->pcid);
+  kmem_cache_free(address_space_cache, as);
+
+  serial_print("VMM: Reclaimed ");
+  serial_print_dec(batch.total);
+  serial_print(" pages from address space\n");
 
-  uint64_t as_phys = virt_to_phys(as);
-  pmm_free_page((void *) as_phys);
+  return batch.total;
 }
@@ -7,6 +7,178 @@ typedef struct
   int data[4];
 } Message;
 
+// Fixed spot for memory shared with spawned workers, which get no arguments
+#define SPAWN_ARENA ((uint64_t *) 0x0000200000000000ULL)
+#define SPAWN_ARENA_SIZE (16 * 1024)
+
+// Runs in a copy-on-write clone of init, arena[0] is the port to report to
+static void spawn_worker(void)
+{
+  uint64_t *arena = SPAWN_ARENA;
+  uint64_t seen = arena[1];
+  arena[1] = 8;
+  user_send((uint32_t) arena[0], 43, (uint32_t) seen, (uint32_t) arena[1], 0, 0);
+  user_exit(0);
+}
+
+// Answers one call on arena[0] with the request's data doubled
+static void call_server(void)
+{
+  uint64_t *arena = SPAWN_ARENA;
+  Message msg;
+  if (user_recv((uint32_t) arena[0], &msg) == 0)
+  {
+    user_reply(msg.id + 1, msg.data[0] * 2, msg.data[1] * 2, 0, 0);
+  }
+  user_exit(0);
+}
+
+// One of a pool draining arena[0], answers on arena[2] with id + 100, or 0
+// if it couldn't receive
+static void pool_worker(void)
+{
+  uint64_t *arena = SPAWN_ARENA;
+  Message msg;
+  int id = user_recv((uint32_t) arena[0], &msg) == 0 ? msg.id + 100 : 0;
+  user_send((uint32_t) arena[2], id, 0, 0, 0, 0);
+  user_exit(0);
+}
+
+#define RING_MESSAGES 64
+
+// Streams RING_MESSAGES numbered messages into the ring port arena[0]
+static void ring_producer(void)
+{
+  uint64_t *arena = SPAWN_ARENA;
+  for (int i = 0; i < RING_MESSAGES; i++)
+  {
+    user_send((uint32_t) arena[0], i, (uint32_t) i * 3, 0, 0, 0);
+  }
+  user_exit(0);
+}
+
+#define POLL_SPIN_ROUNDS 100000
+
+// Yields until the kernel poller has posted count completions, returns 0 if
+// it never did
+static int poll_completions(async_rings_t *rings, uint32_t count)
+{
+  for (int i = 0; i < POLL_SPIN_ROUNDS; i++)
+  {
+    if (__atomic_load_n(&rings->cq_tail, __ATOMIC_ACQUIRE) == count)
+    {
+      return 1;
+    }
+    user_yield();
+  }
+  return 0;
+}
+
+// Sets up polled rings and submits without entering the kernel. Reports 44
+// on arena[0] with whether both NOPs completed, and whether the second one
+// needed the doorbell because the poller had gone to sleep.
+static void poll_worker(void)
+{
+  uint64_t *arena = SPAWN_ARENA;
+  async_rings_t *rings = user_async_setup(4, ASYNC_SETUP_POLL);
+  if ((int64_t) rings < 0)
+  {
+    user_send((uint32_t) arena[0], 44, 0, 0, 0, 0);
+    user_exit(1);
+  }
+  async_sqe_t *sq = (async_sqe_t *) ((uint8_t *) rings + rings->sq_offset);
+  async_cqe_t *cq = (async_cqe_t *) ((uint8_t *) rings + rings->cq_offset);
+
+  // The poller is awake right after setup and finds this by itself
+  sq[0] = (async_sqe_t) { .opcode = ASYNC_OP_NOP, .user_data = 1 };
+  __atomic_store_n(&rings->sq_tail, 1, __ATOMIC_RELEASE);
+  int ok = poll_completions(rings, 1) && cq[0].user_data == 1;
+
+  // Wait for it to give up and ask for the doorbell
+  int i = 0;
+  while (i++ < POLL_SPIN_ROUNDS && !(__atomic_load_n(&rings->flags, __ATOMIC_ACQUIRE) & ASYNC_NEED_WAKEUP))
+  {
+    user_yield();
+  }
+
+  // Either the poller sees sq_tail or we see its flag
+  sq[1] = (async_sqe_t) { .opcode = ASYNC_OP_NOP, .user_data = 2 };
+  __atomic_store_n(&rings->sq_tail, 2, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int rang = 0;
+  if (__atomic_load_n(&rings->flags, __ATOMIC_ACQUIRE) & ASYNC_NEED_WAKEUP)
+  {
+    rang = user_async_enter(0) == 0;
+  }
+  ok = ok && poll_completions(rings, 2) && cq[1].user_data == 2;
+  __atomic_store_n(&rings->cq_head, 2, __ATOMIC_RELEASE);
+
+  user_send((uint32_t) arena[0], 44, ok, rang, 0, 0);
+  user_exit(0);
+}
+
+#define NULL_SYSCALL_ROUNDS 10000
+
+static inline uint64_t read_tsc(void)
+{
+  uint32_t low, high;
+  __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t) high << 32) | low;
+}
+
+// Average cycles per SYS_NULL through SYSCALL, or the interrupt gate if int80
+static uint64_t null_syscall_cycles(int int80)
+{
+  uint64_t start = read_tsc();
+  for (int i = 0; i < NULL_SYSCALL_ROUNDS; i++)
+  {
+    if (int80)
+    {
+      syscall0_int80(SYS_NULL);
+    } else
+    {
+      syscall0(SYS_NULL);
+    }
+  }
+  return (read_tsc() - start) / NULL_SYSCALL_ROUNDS;
+}
+
+// Prints "[INIT]   <label>: <value> cycles"
+static void print_cycles(const char *label, uint64_t value)
+{
+  char line[64];
+  int len = 0;
+  for (const char *c = "[INIT]   "; *c; c++)
+  {
+    line[len++] = *c;
+  }
+  for (const char *c = label; *c && len < 32; c++)
+  {
+    line[len++] = *c;
+  }
+  line[len++] = ':';
+  line[len++] = ' ';
+
+  char digits[20];
+  int count = 0;
+  do
+  {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count)
+  {
+    line[len++] = digits[--count];
+  }
+
+  for (const char *c = " cycles\n"; *c; c++)
+  {
+    line[len++] = *c;
+  }
+  line[len] = '\0';
+  user_debug_print(line);
+}
+
 __attribute__((section(".text._start"))) void _start(void)
 {
   user_debug_print("[INIT] PlasmaOS userspace init starting...\n");
@@ -62,6 +234,362 @@ __attribute__((section(".text._start"))) void _start(void)
   }
   user_debug_print("[INIT] SUCCESS: Multiple yields complete\n\n");
 
+  // Test 6: Memory statistics
+  user_debug_print("[INIT] Test 6: Reading memory statistics...\n");
+  pmm_stats_t stats;
+  result = user_mem_stats(&stats, MEM_STATS_DUMP);
+  if (result < 0 || stats.total_pages == 0 || stats.used_pages > stats.total_pages)
+  {
+    user_debug_print("[INIT] FAILED: Bad memory statistics\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Memory statistics read\n\n");
+
+  // Test 7: Anonymous and huge page mappings
+  user_debug_print("[INIT] Test 7: Mapping memory...\n");
+  uint64_t *arena = user_map_memory(0, 64 * 1024, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_POPULATE, 0, 0);
+  uint64_t *huge = user_map_memory(0, 2 * 1024 * 1024, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_HUGE, 0, 0);
+  if ((int64_t) arena < 0 || (int64_t) huge < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not map memory\n");
+    user_exit(1);
+  }
+
+  arena[0] = 1;
+  arena[8191] = 2;
+  huge[0] = 3;
+  huge[262143] = 4;
+  if (arena[0] + arena[8191] + huge[0] + huge[262143] != 10 || arena[1] != 0 || huge[1] != 0)
+  {
+    user_debug_print("[INIT] FAILED: Mapped memory reads back wrong\n");
+    user_exit(1);
+  }
+
+  if (user_unmap_memory(arena, 64 * 1024) < 0 || user_unmap_memory(huge, 2 * 1024 * 1024) < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not unmap memory\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Mapped, touched and unmapped memory\n\n");
+
+  // Test 8: Copy-on-write spawn
+  user_debug_print("[INIT] Test 8: Spawning a copy-on-write worker...\n");
+  uint64_t *shared = user_map_memory(SPAWN_ARENA, SPAWN_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_FIXED, 0, 0);
+  if ((int64_t) shared < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not map spawn arena\n");
+    user_exit(1);
+  }
+
+  shared[0] = port_id;
+  shared[1] = 7;
+
+  // The worker's stack lives in the top of its copy of the arena
+  void *worker_stack = (uint8_t *) shared + SPAWN_ARENA_SIZE - 8;
+  result = user_spawn(spawn_worker, worker_stack);
+  if (result < 0 || user_recv(port_id, &msg) < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not spawn worker\n");
+    user_exit(1);
+  }
+
+  if (msg.id != 43 || msg.data[0] != 7 || msg.data[1] != 8 || shared[1] != 7)
+  {
+    user_debug_print("[INIT] FAILED: Worker and init memory not separated\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Worker saw init's memory, its writes stayed private\n\n");
+
+  // Test 9: Scheduling classes
+  user_debug_print("[INIT] Test 9: Switching scheduling classes...\n");
+  if (user_set_priority(SCHED_LATENCY, 0) < 0 || user_set_priority(SCHED_BACKGROUND + 1, 0) >= 0)
+  {
+    user_debug_print("[INIT] FAILED: Bad scheduling class handling\n");
+    user_exit(1);
+  }
+  user_yield();
+  user_set_priority(SCHED_NORMAL, 8);
+  user_debug_print("[INIT] SUCCESS: Ran in the latency class and went back to normal\n\n");
+
+  // Test 10: Synchronous call and reply
+  user_debug_print("[INIT] Test 10: Calling a spawned server...\n");
+  int call_port = user_port_create();
+  shared[0] = call_port;
+  if (call_port < 0 || user_spawn(call_server, worker_stack) < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not start call server\n");
+    user_exit(1);
+  }
+
+  msg.id = 50;
+  msg.data[0] = 3;
+  msg.data[1] = 4;
+  if (user_call(call_port, &msg) < 0 || msg.id != 51 || msg.data[0] != 6 || msg.data[1] != 8)
+  {
+    user_debug_print("[INIT] FAILED: Bad reply from call server\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Call answered by the server\n\n");
+
+  // Test 11: Bounded port queues
+  user_debug_print("[INIT] Test 11: Overflowing a bounded port...\n");
+  port_stats_t port_stats;
+  if (user_port_configure(port_id, 2, PORT_OVERFLOW_FAIL, 0) < 0 || user_send(port_id, 1, 0, 0, 0, 0) < 0
+      || user_send(port_id, 2, 0, 0, 0, 0) < 0 || user_send(port_id, 3, 0, 0, 0, 0) >= 0
+      || user_port_stats(port_id, &port_stats) < 0 || port_stats.depth != 2 || port_stats.dropped != 1)
+  {
+    user_debug_print("[INIT] FAILED: Full port accepted a message\n");
+    user_exit(1);
+  }
+
+  // Now the oldest message makes room for the newest
+  user_port_configure(port_id, 2, PORT_OVERFLOW_DROP_OLDEST, 0);
+  user_send(port_id, 4, 0, 0, 0, 0);
+  if (user_recv(port_id, &msg) < 0 || msg.id != 2 || user_recv(port_id, &msg) < 0 || msg.id != 4)
+  {
+    user_debug_print("[INIT] FAILED: Oldest message was not dropped\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Full queue failed, then dropped its oldest message\n\n");
+
+  // Test 12: Ring port streaming from another thread
+  user_debug_print("[INIT] Test 12: Streaming through a ring port...\n");
+  int ring_port = user_port_create();
+  shared[0] = ring_port;
+  if (ring_port < 0 || user_port_configure(ring_port, 8, PORT_OVERFLOW_BLOCK, PORT_RING) < 0
+      || user_spawn(ring_producer, worker_stack) < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not set up ring port\n");
+    user_exit(1);
+  }
+
+  for (int i = 0; i < RING_MESSAGES; i++)
+  {
+    if (user_recv(ring_port, &msg) < 0 || msg.id != i || msg.data[0] != i * 3)
+    {
+      user_debug_print("[INIT] FAILED: Ring message lost or out of order\n");
+      user_exit(1);
+    }
+  }
+
+  if (user_port_stats(ring_port, &port_stats) < 0 || port_stats.capacity != 8 || port_stats.depth != 0
+      || port_stats.received != RING_MESSAGES || user_port_configure(ring_port, 16, PORT_OVERFLOW_FAIL, 0) >= 0)
+  {
+    user_debug_print("[INIT] FAILED: Bad ring port state\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Ring delivered every message in order\n\n");
+
+  // Test 13: Page grants
+  user_debug_print("[INIT] Test 13: Sending 64 KiB by page grant...\n");
+  uint64_t bulk_size = 64 * 1024;
+  uint64_t *bulk = user_map_memory(0, bulk_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS, 0, 0);
+  int bulk_port = user_port_create();
+  if ((int64_t) bulk < 0 || bulk_port < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not set up grant test\n");
+    user_exit(1);
+  }
+
+  for (uint64_t i = 0; i < bulk_size / 8; i++)
+  {
+    bulk[i] = i;
+  }
+
+  // Shared copy-on-write first, a write on one side stays there
+  ipc_grant_t grant;
+  msg.id = 60;
+  if (user_send_grant(bulk_port, &msg, bulk, bulk_size, GRANT_SHARE) < 0
+      || user_recv_grant(bulk_port, &msg, &grant) < 0 || msg.id != 60 || grant.length != bulk_size)
+  {
+    user_debug_print("[INIT] FAILED: Shared grant not delivered\n");
+    user_exit(1);
+  }
+
+  uint64_t *shared_copy = (uint64_t *) grant.addr;
+  shared_copy[0] = 12345;
+  if (shared_copy[bulk_size / 8 - 1] != bulk_size / 8 - 1 || bulk[0] != 0)
+  {
+    user_debug_print("[INIT] FAILED: Shared grant not copy-on-write\n");
+    user_exit(1);
+  }
+  user_unmap_memory(shared_copy, bulk_size);
+
+  // Then moved, the pages leave bulk for good
+  msg.id = 61;
+  if (user_send_grant(bulk_port, &msg, bulk, bulk_size, 0) < 0 || user_recv_grant(bulk_port, &msg, &grant) < 0
+      || msg.id != 61 || grant.length != bulk_size || ((uint64_t *) grant.addr)[4096] != 4096)
+  {
+    user_debug_print("[INIT] FAILED: Moved grant not delivered\n");
+    user_exit(1);
+  }
+  user_unmap_memory((void *) grant.addr, bulk_size);
+  user_debug_print("[INIT] SUCCESS: Pages shared and moved without copying\n\n");
+
+  // Test 14: Waiting on several ports, several receivers on one port
+  user_debug_print("[INIT] Test 14: Waiting on two ports at once...\n");
+  uint32_t any_ports[2] = { user_port_create(), user_port_create() };
+  user_send(any_ports[1], 70, 0, 0, 0, 0);
+  if (user_recv_any(any_ports, 2, &msg) != 1 || msg.id != 70)
+  {
+    user_debug_print("[INIT] FAILED: Queued message not found\n");
+    user_exit(1);
+  }
+
+  // Blocks until the worker sends to the first port
+  shared[0] = any_ports[0];
+  shared[1] = 7;
+  if (user_spawn(spawn_worker, worker_stack) < 0 || user_recv_any(any_ports, 2, &msg) != 0 || msg.id != 43)
+  {
+    user_debug_print("[INIT] FAILED: Blocked wait missed the message\n");
+    user_exit(1);
+  }
+
+  // Two workers blocked on one port each take one message
+  shared[0] = any_ports[0];
+  shared[2] = any_ports[1];
+  if (user_spawn(pool_worker, worker_stack) < 0 || user_spawn(pool_worker, worker_stack) < 0)
+  {
+    user_debug_print("[INIT] FAILED: Could not start pool workers\n");
+    user_exit(1);
+  }
+  user_yield();
+  user_send(any_ports[0], 1, 0, 0, 0, 0);
+  user_send(any_ports[0], 2, 0, 0, 0, 0);
+
+  int answered = 0;
+  for (int i = 0; i < 2; i++)
+  {
+    if (user_recv(any_ports[1], &msg) == 0)
+    {
+      answered += msg.id;
+    }
+  }
+  if (answered != 203)
+  {
+    user_debug_print("[INIT] FAILED: Pool workers did not share the port\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Waited on two ports, two workers drained one\n\n");
+
+  // Test 15: Batched send and receive
+  user_debug_print("[INIT] Test 15: Moving messages in batches...\n");
+  Message batch[10];
+  for (int i = 0; i < 10; i++)
+  {
+    batch[i].id = 80 + i;
+    batch[i].data[0] = i;
+  }
+
+  // Only 8 fit, the batch stops there instead of failing
+  int batch_port = user_port_create();
+  if (batch_port < 0 || user_port_configure(batch_port, 8, PORT_OVERFLOW_FAIL, 0) < 0
+      || user_send_batch(batch_port, batch, 10) != 8)
+  {
+    user_debug_print("[INIT] FAILED: Batch send did not stop at a full queue\n");
+    user_exit(1);
+  }
+
+  if (user_recv_batch(batch_port, batch, 10) != 8 || batch[0].id != 80 || batch[7].id != 87 || batch[7].data[0] != 7)
+  {
+    user_debug_print("[INIT] FAILED: Batch receive lost messages\n");
+    user_exit(1);
+  }
+
+  if (user_send_batch(batch_port, batch, 3) != 3 || user_recv_batch(batch_port, batch, 2) != 2
+      || user_recv_batch(batch_port, batch, 2) != 1 || batch[0].id != 82)
+  {
+    user_debug_print("[INIT] FAILED: Partial batch receive\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Batches completed partially where the queue ran out\n\n");
+
+  // Test 16: Submission and completion rings
+  user_debug_print("[INIT] Test 16: Submitting through shared rings...\n");
+  async_rings_t *rings = user_async_setup(8, 0);
+  if ((int64_t) rings < 0 || rings->sq_mask != 7 || rings->cq_mask != 15)
+  {
+    user_debug_print("[INIT] FAILED: Could not set up rings\n");
+    user_exit(1);
+  }
+  async_sqe_t *sq = (async_sqe_t *) ((uint8_t *) rings + rings->sq_offset);
+  async_cqe_t *cq = (async_cqe_t *) ((uint8_t *) rings + rings->cq_offset);
+
+  // The receive is queued first and waits for the send behind it
+  int async_port = user_port_create();
+  uint32_t tail = rings->sq_tail;
+  sq[tail++ & rings->sq_mask] = (async_sqe_t) { .opcode = ASYNC_OP_RECV, .port = async_port, .user_data = 1 };
+  sq[tail++ & rings->sq_mask] = (async_sqe_t) {
+    .opcode = ASYNC_OP_SEND, .port = async_port, .user_data = 2, .msg = { .id = 90, .data = { 9 } }
+  };
+  sq[tail++ & rings->sq_mask] = (async_sqe_t) { .opcode = ASYNC_OP_NOP, .user_data = 3 };
+  __atomic_store_n(&rings->sq_tail, tail, __ATOMIC_RELEASE);
+
+  if (user_async_enter(3) != 3 || __atomic_load_n(&rings->cq_tail, __ATOMIC_ACQUIRE) - rings->cq_head != 3)
+  {
+    user_debug_print("[INIT] FAILED: Submissions did not complete\n");
+    user_exit(1);
+  }
+
+  uint64_t seen = 0;
+  for (uint32_t head = rings->cq_head; head != rings->cq_tail; head++)
+  {
+    async_cqe_t *cqe = &cq[head & rings->cq_mask];
+    if (cqe->result != 0 || (cqe->user_data == 1 && (cqe->msg.id != 90 || cqe->msg.data[0] != 9)))
+    {
+      user_debug_print("[INIT] FAILED: Bad completion\n");
+      user_exit(1);
+    }
+    seen |= 1 << cqe->user_data;
+  }
+  __atomic_store_n(&rings->cq_head, rings->cq_tail, __ATOMIC_RELEASE);
+
+  if (seen != 0xE || user_async_setup(8, 0) != (void *) -1)
+  {
+    user_debug_print("[INIT] FAILED: Completions missing or rings set up twice\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Three submissions completed with one syscall\n");
+
+  // A process can only set up rings once, so the polled ones live in a worker
+  shared[0] = async_port;
+  if (user_spawn(poll_worker, worker_stack) < 0 || user_recv(async_port, &msg) != 0 || msg.id != 44)
+  {
+    user_debug_print("[INIT] FAILED: Could not start poll worker\n");
+    user_exit(1);
+  }
+  if (!msg.data[0] || !msg.data[1])
+  {
+    user_debug_print("[INIT] FAILED: Kernel poller missed a submission\n");
+    user_exit(1);
+  }
+  user_debug_print("[INIT] SUCCESS: Kernel poller took submissions, and woke for the doorbell\n\n");
+
+  // Test 17: SYSCALL against the interrupt gate
+  user_debug_print("[INIT] Test 17: Timing null syscalls...\n");
+  if (user_null() != 0 || syscall0_int80(SYS_NULL) != 0)
+  {
+    user_debug_print("[INIT] FAILED: Null syscall\n");
+    user_exit(1);
+  }
+
+  // Both entry paths have to leave the argument registers the way the
+  // wrappers promise
+  int entry_port = user_port_create();
+  if (user_send(entry_port, 91, 1, 2, 3, 4) != 0 || user_recv(entry_port, &msg) != 0 || msg.id != 91
+      || msg.data[3] != 4)
+  {
+    user_debug_print("[INIT] FAILED: SYSCALL lost an argument\n");
+    user_exit(1);
+  }
+
+  // Warm up, then measure
+  null_syscall_cycles(0);
+  null_syscall_cycles(1);
+  print_cycles("syscall", null_syscall_cycles(0));
+  print_cycles("int 0x80", null_syscall_cycles(1));
+  user_debug_print("[INIT] SUCCESS: Both entry paths work\n\n");
+
   user_debug_print("======================================\n");
   user_debug_print("[INIT] All tests passed!\n");
   user_debug_print("[INIT] Userspace is working correctly\n");